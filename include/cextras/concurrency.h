@@ -45,6 +45,146 @@ extern "C" {
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <time.h>
+
+/***************************************
+ * concurrency/work_deque.c
+ */
+
+struct CxWorkDequeArray;
+
+/**
+ * @brief A lock-free Chase-Lev work-stealing deque.
+ *
+ * Only the owning thread may push and pop items at the bottom of the deque.
+ * Any other thread may steal items from the top.
+ */
+struct CxWorkDeque {
+	/**
+	 * @privatesection
+	 */
+	_Atomic(int64_t) top;
+	_Atomic(int64_t) bottom;
+	_Atomic(struct CxWorkDequeArray *) array;
+};
+
+/**
+ * @internal
+ * @memberof CxWorkDeque
+ * @brief Initializes a work-stealing deque.
+ *
+ * @param deque The deque to initialize.
+ *
+ * @return 0 on success, less than 0 on error.
+ */
+CX_NO_UNUSED int cx_work_deque_init(struct CxWorkDeque *deque);
+
+/**
+ * @internal
+ * @memberof CxWorkDeque
+ * @brief Pushes an item to the bottom of the deque. Must only be called by the
+ * owner of the deque.
+ *
+ * @param deque The deque to push to.
+ * @param item The item to push. Must not be NULL.
+ *
+ * @return 0 on success, less than 0 on error.
+ */
+CX_NO_UNUSED int cx_work_deque_push(struct CxWorkDeque *deque, void *item);
+
+/**
+ * @internal
+ * @memberof CxWorkDeque
+ * @brief Pops an item from the bottom of the deque. Must only be called by the
+ * owner of the deque.
+ *
+ * @param deque The deque to pop from.
+ *
+ * @return The item or NULL if the deque is empty.
+ */
+void *cx_work_deque_pop(struct CxWorkDeque *deque);
+
+/**
+ * @internal
+ * @memberof CxWorkDeque
+ * @brief Steals an item from the top of the deque. May be called by any
+ * thread.
+ *
+ * @param deque The deque to steal from.
+ *
+ * @return The item or NULL if the deque is empty or the item was taken by
+ * another thread.
+ */
+void *cx_work_deque_steal(struct CxWorkDeque *deque);
+
+/**
+ * @internal
+ * @memberof CxWorkDeque
+ * @brief Returns the approximate number of items in the deque.
+ *
+ * @param deque The deque.
+ *
+ * @return The number of items.
+ */
+size_t cx_work_deque_size(struct CxWorkDeque *deque);
+
+/**
+ * @internal
+ * @memberof CxWorkDeque
+ * @brief Frees the memory of the deque. Items still in the deque are not
+ * touched.
+ *
+ * @param deque The deque to clean up.
+ *
+ * @return 0 on success, less than 0 on error.
+ */
+int cx_work_deque_cleanup(struct CxWorkDeque *deque);
+
+/***************************************
+ * concurrency/semaphore.c
+ */
+
+/**
+ * @brief A counting semaphore.
+ *
+ * Uncontended waits and posts are a single atomic operation. Waiters spin
+ * briefly before they park in the kernel.
+ */
+struct CxSemaphore {
+	/**
+	 * @privatesection
+	 */
+	_Atomic(uint32_t) count;
+	_Atomic(uint32_t) waiters;
+};
+
+int cx_semaphore_init(struct CxSemaphore *semaphore, size_t count);
+
+int cx_semaphore_wait(struct CxSemaphore *semaphore);
+
+/**
+ * @brief Decrements the semaphore if this is possible without blocking.
+ *
+ * @param semaphore The semaphore to decrement.
+ *
+ * @return 0 on success, -CX_ERR_WOULD_BLOCK if the count is 0.
+ */
+int cx_semaphore_try_wait(struct CxSemaphore *semaphore);
+
+/**
+ * @brief Decrements the semaphore, blocking at most for `timeout`.
+ *
+ * @param semaphore The semaphore to decrement.
+ * @param timeout The maximum time to wait, relative to now.
+ *
+ * @return 0 on success, -CX_ERR_TIMEOUT if the timeout expired.
+ */
+int cx_semaphore_wait_timeout(
+		struct CxSemaphore *semaphore, const struct timespec *timeout);
+
+int cx_semaphore_post(struct CxSemaphore *semaphore);
+
+int cx_semaphore_destroy(struct CxSemaphore *semaphore);
 
 /***************************************
  * concurrency/threadpool.c
@@ -52,32 +192,228 @@ extern "C" {
 
 typedef void (*cx_threadpool_task_t)(void *);
 
+#define CX_THREADPOOL_LATENCY_BUCKETS 32
+
+/**
+ * @brief The priority of a task. Workers run tasks of a higher priority
+ * first, but still run lower priority tasks now and then so that they do not
+ * starve.
+ */
+enum CxTaskPriority {
+	CX_TASK_PRIORITY_HIGH,
+	CX_TASK_PRIORITY_NORMAL,
+	CX_TASK_PRIORITY_LOW,
+	CX_TASK_PRIORITY_COUNT,
+};
+
+/**
+ * @brief What cx_threadpool_schedule does when the queue capacity of the pool
+ * is reached.
+ */
+enum CxThreadpoolOverflow {
+	/**
+	 * Wait until a task finished. While waiting, the caller runs queued
+	 * tasks.
+	 */
+	CX_THREADPOOL_OVERFLOW_BLOCK,
+	/**
+	 * Fail with -CX_ERR_WOULD_BLOCK.
+	 */
+	CX_THREADPOOL_OVERFLOW_FAIL,
+	/**
+	 * Run the task in the caller.
+	 */
+	CX_THREADPOOL_OVERFLOW_CALLER_RUNS,
+};
+
+/**
+ * @brief What cx_threadpool_shutdown does with tasks that are still queued.
+ */
+enum CxThreadpoolShutdown {
+	/**
+	 * Run all queued tasks, including tasks they schedule, before stopping.
+	 */
+	CX_THREADPOOL_SHUTDOWN_DRAIN,
+	/**
+	 * Do not run queued tasks. The cancel function of each task is called
+	 * instead, see cx_task_set_cancel.
+	 */
+	CX_THREADPOOL_SHUTDOWN_CANCEL,
+	/**
+	 * Do not run queued tasks and do not call their cancel functions. Tasks
+	 * the library queued itself, e.g. for timers, futures and coroutines,
+	 * are still cancelled so that these are released.
+	 */
+	CX_THREADPOOL_SHUTDOWN_DETACH,
+};
+
 struct CxTask {
 	cx_threadpool_task_t function;
 	void *arg;
 	struct CxTask *next;
+	struct CxTaskGroup *group;
+	enum CxTaskPriority priority;
+	bool pooled;
+	uint64_t enqueue_time_ns;
+	struct CxThreadpool *threadpool;
+	_Atomic(uint32_t) join_state;
+	cx_threadpool_task_t cancel;
+	bool internal;
+};
+
+/**
+ * @brief A snapshot of the counters of a worker.
+ */
+struct CxWorkerStats {
+	/** Tasks run by the worker. */
+	uint64_t tasks_executed;
+	/** Tasks the worker took from other workers. */
+	uint64_t tasks_stolen;
+	/** Attempts to take a task from another worker. */
+	uint64_t steal_attempts;
+	/** Nanoseconds the worker spent parked. */
+	uint64_t parked_ns;
+	/** Nanoseconds the worker spent running tasks. */
+	uint64_t busy_ns;
+	/** The longest the queue of the worker has been. */
+	uint64_t max_queue_depth;
+	/**
+	 * Tasks by the time from scheduling until the worker started them.
+	 * Bucket `i` counts latencies from `2^i` up to `2^(i+1)` nanoseconds,
+	 * the last bucket also counts everything longer.
+	 */
+	uint64_t latency_histogram[CX_THREADPOOL_LATENCY_BUCKETS];
+};
+
+struct CxWorkerCounters {
+	_Atomic(uint64_t) tasks_executed;
+	_Atomic(uint64_t) tasks_stolen;
+	_Atomic(uint64_t) steal_attempts;
+	_Atomic(uint64_t) parked_ns;
+	_Atomic(uint64_t) busy_ns;
+	_Atomic(uint64_t) max_queue_depth;
+	_Atomic(uint64_t) latency_histogram[CX_THREADPOOL_LATENCY_BUCKETS];
+};
+
+struct CxWorkerQueue {
+	struct CxWorkDeque deque;
+	struct CxTask *head;
+	struct CxTask *tail;
 };
 
 struct CxWorker {
 	pthread_t thread;
+	bool joinable;
+	atomic_int state;
 	struct CxThreadpool *pool;
-	struct CxTask *head;
-	struct CxTask *tail;
+	int cpu;
+	int numa_node;
+	size_t *steal_order;
+	struct CxWorkerQueue queues[CX_TASK_PRIORITY_COUNT];
+	size_t dequeue_tick;
 	atomic_size_t queue_length;
+	atomic_bool inbox_pending;
 	pthread_mutex_t queue_mutex;
-	pthread_cond_t queue_cond;
+	_Atomic(uint32_t) wake_epoch;
+	_Atomic(uint32_t) parked;
+
+	struct CxWorkerCounters counters;
+};
+
+struct CxTimerQueue {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_cond_t idle_cond;
+	pthread_t thread;
+	bool started;
+	bool stopping;
+	struct CxTimer **heap;
+	size_t count;
+	size_t capacity;
 };
 
 struct CxThreadpool {
 	struct CxWorker *workers;
-	size_t worker_count;
+	size_t worker_capacity;
+	atomic_size_t worker_count;
+	atomic_size_t target_worker_count;
+	atomic_size_t blocked_count;
+	pthread_mutex_t resize_mutex;
+	long idle_timeout_ns;
+	size_t queue_capacity;
+	enum CxThreadpoolOverflow overflow;
+	struct CxSemaphore queue_slots;
+	struct CxTimerQueue timers;
 	atomic_bool running;
 	atomic_size_t active_tasks;
+	atomic_size_t help_index;
+	long idle_spin_ns;
+	long idle_yield_ns;
 	pthread_mutex_t wait_mutex;
 	pthread_cond_t wait_cond;
 
-	pthread_mutex_t task_pool_mutex;
-	struct CxPreallocPool task_pool;
+	struct CxConcurrentPool task_pool;
+};
+
+/**
+ * @brief Options for cx_threadpool_init2.
+ */
+struct CxThreadpoolOptions {
+	/**
+	 * The number of workers. If 0, `cpu_count` or the number of online CPUs
+	 * is used.
+	 */
+	size_t worker_count;
+	/**
+	 * If set, worker `i` is pinned to `cpus[i % cpu_count]`.
+	 */
+	const int *cpus;
+	size_t cpu_count;
+	/**
+	 * If set and `cpus` is not, worker `i` is pinned to the CPUs of NUMA node
+	 * `numa_nodes[i % numa_node_count]`.
+	 */
+	const int *numa_nodes;
+	size_t numa_node_count;
+	/**
+	 * If set and neither `cpus` nor `numa_nodes` are, workers are spread
+	 * over all NUMA nodes of the system that have CPUs the process may run
+	 * on. Memory-only nodes are skipped.
+	 */
+	bool numa_aware;
+	/**
+	 * How long an idle worker polls for work with pause instructions before
+	 * it starts yielding. If 0, a default is used; if negative, the worker
+	 * does not spin.
+	 */
+	long idle_spin_ns;
+	/**
+	 * How long an idle worker polls for work with sched_yield() after
+	 * spinning before it parks. If 0, a default is used; if negative, the
+	 * worker does not yield.
+	 */
+	long idle_yield_ns;
+	/**
+	 * The maximum number of workers the pool grows to with
+	 * cx_threadpool_resize and cx_threadpool_blocking_begin. If smaller
+	 * than the initial number of workers, the pool does not grow.
+	 */
+	size_t max_worker_count;
+	/**
+	 * How long a worker beyond the target number of workers stays idle
+	 * before it exits. If 0, a default is used.
+	 */
+	long idle_timeout_ns;
+	/**
+	 * The maximum number of tasks that are queued or running at the same
+	 * time. If 0, the number of tasks is not limited.
+	 */
+	size_t queue_capacity;
+	/**
+	 * What happens when a task is scheduled while `queue_capacity` tasks are
+	 * queued or running.
+	 */
+	enum CxThreadpoolOverflow overflow;
 };
 
 /**
@@ -86,31 +422,501 @@ struct CxThreadpool {
 int cx_threadpool_init(struct CxThreadpool *threadpool, size_t num_threads);
 
 /**
- * @brief Adds a task to the threadpool.
+ * @brief Initializes a threadpool with options.
+ *
+ * Workers that are placed on a NUMA node try to steal from workers on the
+ * same node first.
+ *
+ * @param threadpool The threadpool to initialize.
+ * @param options The options.
+ *
+ * @return 0 on success, less than 0 on error.
+ */
+int cx_threadpool_init2(
+		struct CxThreadpool *threadpool,
+		const struct CxThreadpoolOptions *options);
+
+/**
+ * @brief Changes the number of workers of the threadpool.
+ *
+ * Missing workers are started right away. Excess workers exit once they were
+ * idle for the idle timeout; tasks queued on them are moved to the remaining
+ * workers.
+ *
+ * @param threadpool The threadpool to resize.
+ * @param worker_count The new number of workers, clamped to the range from 1
+ * to the maximum number of workers.
+ *
+ * @return 0 on success, less than 0 on error.
+ */
+int cx_threadpool_resize(struct CxThreadpool *threadpool, size_t worker_count);
+
+/**
+ * @brief Returns the number of running workers.
+ *
+ * @param threadpool The threadpool.
+ *
+ * @return The number of running workers.
+ */
+size_t cx_threadpool_worker_count(struct CxThreadpool *threadpool);
+
+/**
+ * @brief Takes a snapshot of the counters of each worker slot.
+ *
+ * The counters are updated with relaxed atomics while the pool is running, so
+ * the snapshot is not consistent across counters. Tasks run by threads
+ * helping out while waiting are not counted.
+ *
+ * @param threadpool The threadpool.
+ * @param stats An array receiving the counters of up to `count` workers.
+ * @param count The length of `stats`.
+ *
+ * @return The number of worker slots of the pool.
+ */
+size_t cx_threadpool_stats(
+		struct CxThreadpool *threadpool, struct CxWorkerStats *stats,
+		size_t count);
+
+/**
+ * @brief Marks the begin of a blocking call, for example I/O, in a task.
+ *
+ * If this leaves fewer than the target number of workers available, a spare
+ * worker is started, as long as the maximum number of workers is not
+ * reached. The spare worker exits once it was idle for the idle timeout after
+ * cx_threadpool_blocking_end.
+ *
+ * @param threadpool The threadpool the task runs on.
+ */
+void cx_threadpool_blocking_begin(struct CxThreadpool *threadpool);
+
+/**
+ * @brief Marks the end of a blocking call started with
+ * cx_threadpool_blocking_begin.
+ *
+ * @param threadpool The threadpool the task runs on.
+ */
+void cx_threadpool_blocking_end(struct CxThreadpool *threadpool);
+
+/**
+ * @brief Adds a task to the threadpool. Tasks of the same priority that are
+ * scheduled to a worker from outside the pool start in the order they were
+ * scheduled, unless they are stolen by another worker.
  *
  * @param threadpool The threadpool to add the task to.
  * @param task The task function to run the task
  * @param arg The argument to the task function.
+ *
+ * @return 0 on success, less than 0 on error.
  */
 int cx_threadpool_schedule(
 		struct CxThreadpool *threadpool, cx_threadpool_task_t task, void *arg);
 
 /**
- * @brief Waits for all tasks to finish.
+ * @brief Adds a task with the given priority to the threadpool.
+ *
+ * @param threadpool The threadpool to add the task to.
+ * @param priority The priority of the task.
+ * @param task The task function to run the task
+ * @param arg The argument to the task function.
+ *
+ * @return 0 on success, less than 0 on error.
+ */
+int cx_threadpool_schedule_priority(
+		struct CxThreadpool *threadpool, enum CxTaskPriority priority,
+		cx_threadpool_task_t task, void *arg);
+
+/**
+ * @brief Adds a task to the threadpool, preferring a worker on the given NUMA
+ * node.
+ *
+ * @param threadpool The threadpool to add the task to.
+ * @param numa_node The preferred NUMA node. If negative or no worker runs on
+ * the node, this behaves like cx_threadpool_schedule.
+ * @param task The task function to run the task
+ * @param arg The argument to the task function.
+ *
+ * @return 0 on success, less than 0 on error.
+ */
+int cx_threadpool_schedule_on_node(
+		struct CxThreadpool *threadpool, int numa_node,
+		cx_threadpool_task_t task, void *arg);
+
+/**
+ * @brief Adds multiple tasks to the threadpool at once.
+ *
+ * The tasks are split into one slice per worker. Each worker is locked and
+ * woken up at most once. If the pool has a queue capacity, every task still
+ * takes a queue slot of its own.
+ *
+ * Either all tasks are taken or none: on success every task is queued or,
+ * depending on the overflow policy, run on the calling thread. On error no
+ * task was queued or run. If the pool has a queue capacity and fails on
+ * overflow, -CX_ERR_WOULD_BLOCK is returned unless all tasks fit.
+ *
+ * @param threadpool The threadpool to add the tasks to.
+ * @param function The function to run for each task.
+ * @param args The arguments to the task function, one per task.
+ * @param count The number of tasks.
+ *
+ * @return 0 on success, less than 0 on error.
+ */
+int cx_threadpool_schedule_batch(
+		struct CxThreadpool *threadpool, cx_threadpool_task_t function,
+		void **args, size_t count);
+
+/**
+ * @brief Initializes a task that is owned by the caller.
+ *
+ * @param task The task to initialize.
+ * @param function The function to run the task.
+ * @param arg The argument to the task function.
+ */
+void
+cx_task_init(struct CxTask *task, cx_threadpool_task_t function, void *arg);
+
+/**
+ * @brief Sets the priority of a task before it is scheduled. Tasks are
+ * initialized with CX_TASK_PRIORITY_NORMAL.
+ *
+ * @param task The task.
+ * @param priority The priority of the task.
+ */
+void cx_task_set_priority(struct CxTask *task, enum CxTaskPriority priority);
+
+/**
+ * @brief Sets a function that is called with the argument of the task instead
+ * of the task function if the task is cancelled by cx_threadpool_shutdown or
+ * cx_threadpool_cleanup. Use it to release resources owned by the task.
+ *
+ * @param task The task.
+ * @param cancel The cancel function.
+ */
+void cx_task_set_cancel(struct CxTask *task, cx_threadpool_task_t cancel);
+
+/**
+ * @brief Adds a task owned by the caller to the threadpool.
+ *
+ * Unlike cx_threadpool_schedule, this does not allocate and does not take
+ * any pool-wide lock. The task must be initialized with cx_task_init and must
+ * stay valid until its function is called. The threadpool does not access the
+ * task after that, so the task function may release or reuse it.
+ *
+ * Called from a task running on a worker of the same pool, the task is
+ * pushed to the deque of that worker, where idle workers can steal it.
+ *
+ * @param threadpool The threadpool to add the task to.
+ * @param task The task to add.
+ *
+ * @return 0 on success, less than 0 on error.
+ */
+int cx_threadpool_schedule_task(
+		struct CxThreadpool *threadpool, struct CxTask *task);
+
+/**
+ * @brief Adds a task owned by the caller to the threadpool, preferring a worker
+ * on the given NUMA node. See cx_threadpool_schedule_task and
+ * cx_threadpool_schedule_on_node.
+ *
+ * @param threadpool The threadpool to add the task to.
+ * @param numa_node The preferred NUMA node.
+ * @param task The task to add.
+ *
+ * @return 0 on success, less than 0 on error.
+ */
+int cx_threadpool_schedule_task_on_node(
+		struct CxThreadpool *threadpool, int numa_node, struct CxTask *task);
+
+/**
+ * @brief Adds a task owned by the caller to the threadpool, so that it can be
+ * waited for with cx_task_join.
+ *
+ * Unlike with cx_threadpool_schedule_task, the task must stay valid until
+ * cx_task_join returned.
+ *
+ * @param threadpool The threadpool to add the task to.
+ * @param task The task to add, initialized with cx_task_init.
+ *
+ * @return 0 on success, less than 0 on error.
+ */
+int cx_task_fork(struct CxThreadpool *threadpool, struct CxTask *task);
+
+/**
+ * @brief Waits for a task added with cx_task_fork to finish.
+ *
+ * While waiting, the calling thread runs other queued tasks, starting with the
+ * ones of its own worker, so recursive fork and join does not run out of
+ * workers.
+ *
+ * A task can be joined once per successful cx_task_fork. Joining a task that
+ * was not forked, whose cx_task_fork failed or that was already joined fails
+ * instead of waiting forever.
+ *
+ * @param task The task to wait for.
+ *
+ * @return 0 on success, less than 0 if the task is not forked.
+ */
+int cx_task_join(struct CxTask *task);
+
+/**
+ * @brief Waits for all tasks to finish. Timers that did not fire yet are not
+ * waited for.
  */
 int cx_threadpool_wait(struct CxThreadpool *threadpool);
 
 /**
- * @brief Cleans up a threadpool.
+ * @memberof CxThreadpool
+ * @brief Stops the workers of the threadpool.
+ *
+ * Timers stop firing and the workers finish the tasks they are running. What
+ * happens to queued tasks depends on `mode`. Tasks scheduled after the
+ * workers stopped are rejected. The threadpool must still be cleaned up with
+ * cx_threadpool_cleanup.
+ *
+ * @param threadpool The threadpool.
+ * @param mode What to do with queued tasks.
+ * @param deadline The absolute time, measured against CLOCK_REALTIME, after
+ * which CX_THREADPOOL_SHUTDOWN_DRAIN stops running queued tasks and cancels
+ * the remaining ones. NULL waits until the queues are empty.
+ *
+ * @return 0 on success, -CX_ERR_TIMEOUT if the deadline passed before all
+ * tasks were drained.
+ */
+int cx_threadpool_shutdown(
+		struct CxThreadpool *threadpool, enum CxThreadpoolShutdown mode,
+		const struct timespec *deadline);
+
+/**
+ * @brief Cleans up a threadpool. Tasks that are still queued are cancelled as
+ * with CX_THREADPOOL_SHUTDOWN_CANCEL.
  */
 int cx_threadpool_cleanup(struct CxThreadpool *threadpool);
 
+/**
+ * @brief A group of tasks that can be waited for independently of other
+ * tasks in the threadpool.
+ */
+struct CxTaskGroup {
+	/**
+	 * @privatesection
+	 */
+	struct CxThreadpool *threadpool;
+	atomic_size_t pending;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+/**
+ * @memberof CxTaskGroup
+ * @brief Initializes a task group.
+ *
+ * @param group The task group to initialize.
+ * @param threadpool The threadpool to run the tasks of the group on.
+ *
+ * @return 0 on success, less than 0 on error.
+ */
+int
+cx_task_group_init(struct CxTaskGroup *group, struct CxThreadpool *threadpool);
+
+/**
+ * @memberof CxTaskGroup
+ * @brief Adds a task to the group and schedules it on the threadpool.
+ *
+ * @param group The task group to add the task to.
+ * @param function The task function to run the task.
+ * @param arg The argument to the task function.
+ *
+ * @return 0 on success, less than 0 on error.
+ */
+int cx_task_group_schedule(
+		struct CxTaskGroup *group, cx_threadpool_task_t function, void *arg);
+
+/**
+ * @memberof CxTaskGroup
+ * @brief Adds a task owned by the caller to the group and schedules it on the
+ * threadpool. See cx_threadpool_schedule_task.
+ *
+ * @param group The task group to add the task to.
+ * @param task The task to add.
+ *
+ * @return 0 on success, less than 0 on error.
+ */
+int cx_task_group_schedule_task(struct CxTaskGroup *group, struct CxTask *task);
+
+/**
+ * @memberof CxTaskGroup
+ * @brief Waits for all tasks of the group to finish.
+ *
+ * While waiting, the calling thread runs queued tasks of the threadpool. These
+ * may belong to other groups, so tasks must not block on the waiting thread.
+ *
+ * @param group The task group to wait for.
+ *
+ * @return 0 on success, less than 0 on error.
+ */
+int cx_task_group_wait(struct CxTaskGroup *group);
+
+/**
+ * @memberof CxTaskGroup
+ * @brief Cleans up a task group. The group must not have pending tasks.
+ *
+ * @param group The task group to clean up.
+ *
+ * @return 0 on success, less than 0 on error.
+ */
+int cx_task_group_cleanup(struct CxTaskGroup *group);
+
+/***************************************
+ * concurrency/timer.c
+ */
+
+/**
+ * @brief A task that runs on a threadpool once a deadline passed, optionally
+ * repeating with a fixed period. Zero-initialize a timer before it is used,
+ * so that it can be cancelled even if it was never started.
+ */
+struct CxTimer {
+	/**
+	 * @privatesection
+	 */
+	struct CxTask task;
+	struct CxThreadpool *threadpool;
+	cx_threadpool_task_t function;
+	void *arg;
+	uint64_t deadline_ns;
+	uint64_t period_ns;
+	size_t heap_index;
+	int state;
+	bool cancelled;
+	bool owned;
+};
+
+/**
+ * @brief Runs a task on the threadpool after a delay.
+ *
+ * Timers are kept in a min-heap served by a single thread per pool, which is
+ * started with the first timer.
+ *
+ * @param threadpool The threadpool to run the task on.
+ * @param delay_ns The delay in nanoseconds.
+ * @param function The task function.
+ * @param arg The argument to the task function.
+ *
+ * @return 0 on success, less than 0 on error, e.g. if the pool is shut down.
+ */
+int cx_threadpool_schedule_after(
+		struct CxThreadpool *threadpool, uint64_t delay_ns,
+		cx_threadpool_task_t function, void *arg);
+
+/**
+ * @memberof CxTimer
+ * @brief Starts a timer owned by the caller that runs a task every `period_ns`
+ * nanoseconds, the first time after one period.
+ *
+ * The next run is armed once the previous one finished, so runs of the same
+ * timer never overlap. Runs that were missed because the task took longer
+ * than a period are skipped.
+ *
+ * @param timer The timer to start.
+ * @param threadpool The threadpool to run the task on.
+ * @param period_ns The period in nanoseconds, must not be 0.
+ * @param function The task function.
+ * @param arg The argument to the task function.
+ *
+ * @return 0 on success, less than 0 on error, e.g. if the pool is shut down.
+ */
+int cx_timer_start_periodic(
+		struct CxTimer *timer, struct CxThreadpool *threadpool,
+		uint64_t period_ns, cx_threadpool_task_t function, void *arg);
+
+/**
+ * @memberof CxTimer
+ * @brief Stops a timer. Waits until a run of the timer that is in progress
+ * finished, so the timer may be released afterwards. Must not be called from
+ * the task of the timer or after the threadpool was cleaned up. A timer that
+ * was zero-initialized and never started may be cancelled as well.
+ *
+ * @param timer The timer to cancel.
+ *
+ * @return 0 on success, less than 0 on error.
+ */
+int cx_timer_cancel(struct CxTimer *timer);
+
+/***************************************
+ * concurrency/parallel_for.c
+ */
+
+typedef void (*cx_threadpool_range_t)(size_t begin, size_t end, void *ctx);
+
+/**
+ * @brief Runs a function over an index range in parallel.
+ *
+ * The range is split by recursive halving. A range is only split while there
+ * are fewer queued ranges than workers, otherwise it is processed in steps of
+ * `grain` indices. The calling thread takes part in the work and helps with
+ * other queued tasks while waiting. This function returns once the whole range
+ * has been processed. Unlike cx_threadpool_wait, it does not wait for
+ * unrelated tasks.
+ *
+ * @param threadpool The threadpool to run the range on.
+ * @param begin The first index of the range.
+ * @param end The index after the last index of the range.
+ * @param grain The maximum number of indices passed to a single call of
+ * `function`. If 0, a grain size is chosen based on the number of workers.
+ * @param function The function to call for each sub range.
+ * @param ctx The context passed to the function.
+ *
+ * @return 0 if the whole range has been processed, less than 0 on error. If
+ * the threadpool is shut down while sub ranges are queued, these are skipped
+ * and -1 is returned.
+ */
+int cx_threadpool_parallel_for(
+		struct CxThreadpool *threadpool, size_t begin, size_t end,
+		size_t grain, cx_threadpool_range_t function, void *ctx);
+
 /***************************************
  * concurrency/future.c
  */
 
 typedef struct CxFuture *cx_future_t;
 
+typedef void *(*cx_future_task_t)(void *);
+
+/**
+ * @brief A task that is scheduled once a future is resolved.
+ *
+ * Continuations are embedded into whatever waits for a future, e.g. the future
+ * returned by cx_future_then or a coroutine, so that plain futures do not carry
+ * a task.
+ */
+struct CxContinuation {
+	/**
+	 * @privatesection
+	 */
+	struct CxTask task;
+	struct CxThreadpool *threadpool;
+	// The value of the resolved future, set before the task is scheduled.
+	void *value;
+	struct CxContinuation *next;
+};
+
+/**
+ * @brief A future that is resolved once with a value.
+ *
+ * Waiting for a resolved future and resolving a future without waiters do not
+ * enter the kernel.
+ */
+struct CxFuture {
+	/**
+	 * @privatesection
+	 */
+	_Atomic(uint32_t) state;
+	struct CxRc rc;
+	void *in_value;
+	void *out_value;
+	// Continuations that wait for this future.
+	_Atomic(struct CxContinuation *) continuations;
+};
+
 /**
  * @brief Initializes a future.
  *
@@ -120,6 +926,18 @@ typedef struct CxFuture *cx_future_t;
  */
 cx_future_t cx_future_init(void *in_value);
 
+/**
+ * @brief Initializes a future in storage owned by the caller, for example an
+ * element of a CxPreallocPool.
+ *
+ * Futures initialized this way must be released with cx_future_cleanup
+ * instead of cx_future_destroy.
+ *
+ * @param future The storage of the future.
+ * @param in_value The value to store in the future.
+ */
+void cx_future_init2(struct CxFuture *future, void *in_value);
+
 /**
  * @brief Gets the value of a future. If the future is not ready, this function
  * blocks.
@@ -140,6 +958,31 @@ void *cx_future_get_in_value(cx_future_t future);
  */
 void *cx_future_wait(cx_future_t future);
 
+/**
+ * @brief Gets the value of a future without blocking.
+ *
+ * @param future The future to get the value from.
+ * @param value Set to the value of the future if it is resolved.
+ *
+ * @return 0 if the future is resolved, -CX_ERR_WOULD_BLOCK otherwise.
+ */
+int cx_future_try_get(cx_future_t future, void **value);
+
+/**
+ * @brief Gets the value of a future. If the future is not ready, this function
+ * blocks until `deadline` is reached.
+ *
+ * @param future The future to get the value from.
+ * @param deadline The absolute time, measured against CLOCK_REALTIME, after
+ * which to give up.
+ * @param value Set to the value of the future if it is resolved.
+ *
+ * @return 0 if the future is resolved, -CX_ERR_TIMEOUT if the deadline has
+ * passed.
+ */
+int cx_future_wait_until(
+		cx_future_t future, const struct timespec *deadline, void **value);
+
 /**
  * @brief resolves a future.
  *
@@ -152,29 +995,323 @@ int cx_future_resolve(cx_future_t future, void *value);
 /**
  * @brief Cleans up a future.
  *
+ * Tasks and continuations that still need the future keep their own
+ * reference, so a future may be destroyed before it is resolved.
+ *
  * @param future The future to clean up.
  *
  * @return 0 on success, -1 on error.
  */
 int cx_future_destroy(cx_future_t future);
 
+/**
+ * @brief Cleans up a future initialized with cx_future_init2.
+ *
+ * Waits until no task or continuation references the future anymore. The
+ * storage can be reused afterwards.
+ *
+ * @param future The future to clean up.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int cx_future_cleanup(struct CxFuture *future);
+
+/**
+ * @brief Runs a function on the threadpool and returns a future that is
+ * resolved with its return value.
+ *
+ * @param threadpool The threadpool to run the function on.
+ * @param function The function to run.
+ * @param arg The argument to the function. This is the in value of the
+ * future.
+ *
+ * @return The future or NULL on error.
+ */
+cx_future_t cx_threadpool_submit(
+		struct CxThreadpool *threadpool, cx_future_task_t function,
+		void *arg);
+
+/**
+ * @brief Chains a continuation to a future.
+ *
+ * Once `future` is resolved, `function` is scheduled on the threadpool with
+ * the value of `future` as argument. The returned future is resolved with the
+ * return value of `function`. No thread is blocked while waiting for
+ * `future`.
+ *
+ * @param future The future to wait for.
+ * @param threadpool The threadpool to run the continuation on.
+ * @param function The continuation.
+ *
+ * @return The future of the continuation or NULL on error.
+ */
+cx_future_t cx_future_then(
+		cx_future_t future, struct CxThreadpool *threadpool,
+		cx_future_task_t function);
+
 /***************************************
- * concurrency/semaphore.c
+ * concurrency/coroutine.c
  */
 
-struct CxSemaphore {
-	size_t count;
-	pthread_mutex_t mutex;
-	pthread_cond_t cond;
+struct CxCoroutine;
+
+/**
+ * @brief The body of a coroutine.
+ *
+ * The body is written between CX_COROUTINE_BEGIN and CX_COROUTINE_END and
+ * returns CX_COROUTINE_DONE or CX_COROUTINE_SUSPENDED through these macros.
+ * Local variables are not preserved across CX_COROUTINE_AWAIT, keep state that
+ * outlives a suspension in `arg`.
+ */
+typedef int (*cx_coroutine_fn_t)(struct CxCoroutine *coroutine, void *arg);
+
+/**
+ * @brief The result of a step of a coroutine.
+ */
+enum CxCoroutineStatus {
+	CX_COROUTINE_DONE,
+	CX_COROUTINE_SUSPENDED,
 };
 
-int cx_semaphore_init(struct CxSemaphore *semaphore, size_t count);
+/**
+ * @brief A stackless coroutine whose steps run as tasks on a threadpool.
+ *
+ * Awaiting a future suspends the coroutine without blocking the worker. The
+ * coroutine is resumed on the threadpool once the future is resolved.
+ */
+struct CxCoroutine {
+	/**
+	 * @privatesection
+	 */
+	int resume_point;
+	cx_coroutine_fn_t function;
+	void *arg;
+	void *result;
+	struct CxFuture *awaited;
+	struct CxFuture *done;
+	// Registered as a continuation of the awaited future. Its task resumes
+	// the coroutine.
+	struct CxContinuation waker;
+};
 
-int cx_semaphore_wait(struct CxSemaphore *semaphore);
+/**
+ * @brief Starts the body of a coroutine.
+ */
+#define CX_COROUTINE_BEGIN(coroutine) \
+	switch ((coroutine)->resume_point) { \
+	case 0:
 
-int cx_semaphore_post(struct CxSemaphore *semaphore);
+/**
+ * @brief Waits for `future` and stores its value in `value`.
+ *
+ * If the future is not resolved yet, the coroutine returns to the worker and
+ * continues here once the future is resolved.
+ */
+#define CX_COROUTINE_AWAIT(coroutine, future, value) \
+	do { \
+		(coroutine)->resume_point = __LINE__; \
+		if (cx_coroutine_await((coroutine), (future)) == \
+			CX_COROUTINE_SUSPENDED) { \
+			return CX_COROUTINE_SUSPENDED; \
+		case __LINE__:; \
+		} \
+		(value) = cx_coroutine_awaited_value(coroutine); \
+	} while (0)
 
-int cx_semaphore_destroy(struct CxSemaphore *semaphore);
+/**
+ * @brief Finishes the coroutine and resolves its future with `value`.
+ */
+#define CX_COROUTINE_RETURN(coroutine, value) \
+	do { \
+		(coroutine)->result = (value); \
+		return CX_COROUTINE_DONE; \
+	} while (0)
+
+/**
+ * @brief Ends the body of a coroutine. Resolves its future with NULL if the
+ * body did not return a value.
+ */
+#define CX_COROUTINE_END(coroutine) \
+	} \
+	CX_COROUTINE_RETURN(coroutine, NULL)
+
+/**
+ * @memberof CxCoroutine
+ * @brief Starts a coroutine on the threadpool.
+ *
+ * The storage of the coroutine must stay valid until the returned future is
+ * resolved.
+ *
+ * @param coroutine The storage of the coroutine.
+ * @param threadpool The threadpool to run the coroutine on.
+ * @param function The body of the coroutine.
+ * @param arg The argument to the body.
+ *
+ * @return A future that is resolved with the value passed to
+ * CX_COROUTINE_RETURN, or NULL on error.
+ */
+cx_future_t cx_coroutine_start(
+		struct CxCoroutine *coroutine, struct CxThreadpool *threadpool,
+		cx_coroutine_fn_t function, void *arg);
+
+/**
+ * @memberof CxCoroutine
+ * @brief Registers the coroutine to be resumed once `future` is resolved.
+ * Used by CX_COROUTINE_AWAIT.
+ *
+ * @param coroutine The coroutine.
+ * @param future The future to wait for.
+ *
+ * @return CX_COROUTINE_SUSPENDED if the coroutine will be resumed later,
+ * CX_COROUTINE_DONE if the future is already resolved.
+ */
+int cx_coroutine_await(struct CxCoroutine *coroutine, cx_future_t future);
+
+/**
+ * @memberof CxCoroutine
+ * @brief Gets the value of the future the coroutine waited for. Used by
+ * CX_COROUTINE_AWAIT.
+ *
+ * @param coroutine The coroutine.
+ *
+ * @return The value of the awaited future.
+ */
+void *cx_coroutine_awaited_value(struct CxCoroutine *coroutine);
+
+/***************************************
+ * concurrency/io_executor.c
+ */
+
+/**
+ * @brief Options for cx_io_executor_init2.
+ */
+struct CxIoExecutorOptions {
+	/**
+	 * The maximum number of requests in flight. Further requests wait for a
+	 * free slot. If 0, a default is used.
+	 */
+	unsigned int queue_depth;
+	/**
+	 * Run requests as blocking calls on the threadpool even if io_uring is
+	 * available.
+	 */
+	bool use_threadpool;
+};
+
+/**
+ * @brief Runs reads and writes asynchronously and resolves futures with their
+ * results.
+ *
+ * On Linux, requests are submitted through io_uring and completed by a single
+ * thread, so a request in flight does not occupy a worker. Elsewhere, or if
+ * io_uring is not available, requests run as blocking calls on the threadpool
+ * between cx_threadpool_blocking_begin and cx_threadpool_blocking_end.
+ */
+struct CxIoExecutor {
+	/**
+	 * @privatesection
+	 */
+	struct CxThreadpool *threadpool;
+	bool uring;
+	int ring_fd;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	void *sqes;
+	size_t sqes_size;
+	_Atomic(unsigned int) *sq_head;
+	_Atomic(unsigned int) *sq_tail;
+	unsigned int *sq_array;
+	unsigned int sq_mask;
+	_Atomic(unsigned int) *cq_head;
+	_Atomic(unsigned int) *cq_tail;
+	void *cqes;
+	unsigned int cq_mask;
+	pthread_mutex_t submit_mutex;
+	pthread_t thread;
+	atomic_bool stopping;
+	atomic_size_t in_flight;
+	pthread_mutex_t idle_mutex;
+	pthread_cond_t idle_cond;
+	struct CxSemaphore slots;
+};
+
+/**
+ * @memberof CxIoExecutor
+ * @brief Initializes an I/O executor with default options.
+ *
+ * @param executor The executor to initialize.
+ * @param threadpool The threadpool that runs blocking requests and
+ * continuations.
+ *
+ * @return 0 on success, less than 0 on error.
+ */
+int cx_io_executor_init(
+		struct CxIoExecutor *executor, struct CxThreadpool *threadpool);
+
+/**
+ * @memberof CxIoExecutor
+ * @brief Initializes an I/O executor.
+ *
+ * @param executor The executor to initialize.
+ * @param threadpool The threadpool that runs blocking requests and
+ * continuations.
+ * @param options The options.
+ *
+ * @return 0 on success, less than 0 on error.
+ */
+int cx_io_executor_init2(
+		struct CxIoExecutor *executor, struct CxThreadpool *threadpool,
+		const struct CxIoExecutorOptions *options);
+
+/**
+ * @memberof CxIoExecutor
+ * @brief Reads from a file descriptor at an offset.
+ *
+ * The future is resolved with the number of bytes read or a negative errno
+ * value, both cast from `intptr_t`. Requests larger than UINT32_MAX bytes are
+ * resolved with -EOVERFLOW. Use cx_future_then to run a continuation
+ * on the threadpool once the read completed. `buffer` must stay valid until
+ * the future is resolved.
+ *
+ * @param executor The executor.
+ * @param fd The file descriptor to read from.
+ * @param buffer The buffer to read into.
+ * @param size The number of bytes to read.
+ * @param offset The offset in the file.
+ *
+ * @return The future or NULL on error.
+ */
+cx_future_t cx_io_read(
+		struct CxIoExecutor *executor, int fd, void *buffer, size_t size,
+		uint64_t offset);
+
+/**
+ * @memberof CxIoExecutor
+ * @brief Writes to a file descriptor at an offset. See cx_io_read.
+ *
+ * @param executor The executor.
+ * @param fd The file descriptor to write to.
+ * @param buffer The data to write.
+ * @param size The number of bytes to write.
+ * @param offset The offset in the file.
+ *
+ * @return The future or NULL on error.
+ */
+cx_future_t cx_io_write(
+		struct CxIoExecutor *executor, int fd, const void *buffer, size_t size,
+		uint64_t offset);
+
+/**
+ * @memberof CxIoExecutor
+ * @brief Waits for all requests in flight and cleans up the executor.
+ *
+ * @param executor The executor to clean up.
+ *
+ * @return 0 on success, less than 0 on error.
+ */
+int cx_io_executor_cleanup(struct CxIoExecutor *executor);
 
 #ifdef __cplusplus
 }
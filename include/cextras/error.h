@@ -44,6 +44,8 @@ enum CxError {
 	CX_ERR_BUFFER_OVERFLOW,
 	CX_ERR_NOT_FOUND,
 	CX_ERR_ALLOC,
+	CX_ERR_TIMEOUT,
+	CX_ERR_WOULD_BLOCK,
 };
 
 #ifdef __cplusplus
@@ -40,6 +40,8 @@ extern "C" {
 #endif
 
 #include "macro.h"
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdlib.h>
 
@@ -95,28 +97,397 @@ CX_NO_UNUSED void *cx_memdup(const void *source, size_t size);
  * memory/prealloc_pool.c
  */
 
-struct CxPreallocPool {
-	char **pools;
+struct CxPreallocChunk;
 
+/**
+ * @brief A pool of fixed size elements that are allocated in chunks.
+ *
+ * Chunks are aligned to their size, so that the chunk of an element is found
+ * from its address. Each chunk counts its live elements. A chunk that becomes
+ * empty is freed as soon as another empty chunk exists, the last empty chunk
+ * is released by cx_prealloc_pool_trim.
+ */
+struct CxPreallocPool {
+	/**
+	 * @privatesection
+	 */
+	struct CxPreallocChunk *chunks;
+	size_t chunk_count;
 	size_t chunk_size;
 	size_t element_size;
-	size_t next_offset;
-	size_t pool_count;
-	char *current_pool;
+	size_t empty_count;
+	bool lazy_zero;
+	bool mapped;
+	bool huge_pages;
+	// Chunks with free elements, partially used chunks first.
 	void *reuse_pool;
 };
 
+/**
+ * @brief Options for cx_prealloc_pool_init3.
+ */
+struct CxPreallocPoolOptions {
+	/**
+	 * The size of the elements.
+	 */
+	size_t element_size;
+	/**
+	 * The minimum number of elements per chunk. If 0, 8 is used.
+	 */
+	size_t element_count;
+	/**
+	 * The maximum size of a chunk in bytes, rounded down to a power of two.
+	 * Chunks still hold at least one element. If 0, chunks are not capped.
+	 */
+	size_t max_chunk_size;
+	/**
+	 * Zero elements when they are handed out the first time instead of
+	 * zeroing a whole chunk when it is allocated.
+	 */
+	bool lazy_zero;
+	/**
+	 * Allocate chunks with mmap. The pages of a chunk are only touched once
+	 * its elements are used.
+	 */
+	bool use_mmap;
+	/**
+	 * Ask for transparent huge pages. Implies `use_mmap` and chunks of at
+	 * least 2 MiB.
+	 */
+	bool huge_pages;
+};
+
+/**
+ * @memberof CxPreallocPool
+ * @brief Initializes a pool with chunks of at least 8 elements.
+ *
+ * @param pool The pool to initialize.
+ * @param element_size The size of the elements.
+ */
 void cx_prealloc_pool_init(struct CxPreallocPool *pool, size_t element_size);
 
+/**
+ * @memberof CxPreallocPool
+ * @brief Initializes a pool.
+ *
+ * @param pool The pool to initialize.
+ * @param element_count The minimum number of elements per chunk. Chunks are
+ * rounded up to a power of two bytes, at least a page.
+ * @param element_size The size of the elements.
+ */
 void cx_prealloc_pool_init2(
-		struct CxPreallocPool *pool, size_t chunk_size, size_t element_size);
+		struct CxPreallocPool *pool, size_t element_count,
+		size_t element_size);
+
+/**
+ * @memberof CxPreallocPool
+ * @brief Initializes a pool with options.
+ *
+ * @param pool The pool to initialize.
+ * @param options The options.
+ */
+void cx_prealloc_pool_init3(
+		struct CxPreallocPool *pool,
+		const struct CxPreallocPoolOptions *options);
 
 void *cx_prealloc_pool_get(struct CxPreallocPool *pool);
 
 void cx_prealloc_pool_recycle(struct CxPreallocPool *pool, void *element);
 
+/**
+ * @memberof CxPreallocPool
+ * @brief Frees chunks that have no live elements.
+ *
+ * @param pool The pool.
+ *
+ * @return The number of chunks freed.
+ */
+size_t cx_prealloc_pool_trim(struct CxPreallocPool *pool);
+
 void cx_prealloc_pool_cleanup(struct CxPreallocPool *pool);
 
+/***************************************
+ * memory/slab.c
+ */
+
+/**
+ * @brief The number of size classes of a CxSlab. The classes are the powers of
+ * two from 16 to 4096 bytes.
+ */
+#define CX_SLAB_CLASS_COUNT 9
+
+/**
+ * @brief An allocator for variable sized objects that routes allocations to a
+ * CxPreallocPool per size class.
+ *
+ * Allocations larger than the largest class are passed to malloc. The slab is
+ * not thread safe.
+ */
+struct CxSlab {
+	/**
+	 * @privatesection
+	 */
+	struct CxPreallocPool pools[CX_SLAB_CLASS_COUNT];
+	size_t live[CX_SLAB_CLASS_COUNT];
+	size_t allocations[CX_SLAB_CLASS_COUNT];
+};
+
+/**
+ * @brief Statistics of a size class of a CxSlab.
+ */
+struct CxSlabStats {
+	/**
+	 * The size of the elements of the class.
+	 */
+	size_t element_size;
+	/**
+	 * The number of elements currently allocated.
+	 */
+	size_t live;
+	/**
+	 * The number of allocations since the slab was initialized.
+	 */
+	size_t allocations;
+	/**
+	 * The number of chunks held by the class.
+	 */
+	size_t chunk_count;
+};
+
+/**
+ * @memberof CxSlab
+ * @brief Initializes a slab.
+ *
+ * @param slab The slab to initialize.
+ */
+void cx_slab_init(struct CxSlab *slab);
+
+/**
+ * @memberof CxSlab
+ * @brief Allocates memory from the slab. The memory is not initialized.
+ *
+ * @param slab The slab.
+ * @param size The size of the allocation.
+ *
+ * @return The memory or NULL on error.
+ */
+CX_NO_UNUSED void *cx_slab_alloc(struct CxSlab *slab, size_t size);
+
+/**
+ * @memberof CxSlab
+ * @brief Returns memory to the slab.
+ *
+ * @param slab The slab.
+ * @param memory The memory returned by cx_slab_alloc.
+ * @param size The size that was passed to cx_slab_alloc.
+ */
+void cx_slab_free(struct CxSlab *slab, void *memory, size_t size);
+
+/**
+ * @memberof CxSlab
+ * @brief Reports the statistics of a size class.
+ *
+ * @param slab The slab.
+ * @param size_class The index of the class, less than CX_SLAB_CLASS_COUNT.
+ * @param stats The statistics are written to this struct.
+ *
+ * @return 0 on success, -1 if the class does not exist.
+ */
+int cx_slab_stats(
+		const struct CxSlab *slab, size_t size_class,
+		struct CxSlabStats *stats);
+
+/**
+ * @memberof CxSlab
+ * @brief Frees the chunks of all size classes.
+ *
+ * @param slab The slab.
+ */
+void cx_slab_cleanup(struct CxSlab *slab);
+
+/***************************************
+ * memory/arena.c
+ */
+
+struct CxArenaChunk;
+
+/**
+ * @brief An allocator that hands out memory of any size from chunks by
+ * bumping an offset.
+ *
+ * Single allocations cannot be freed. Instead the arena is reset to a mark
+ * or as a whole, which frees all memory allocated after it.
+ */
+struct CxArena {
+	/**
+	 * @privatesection
+	 */
+	struct CxArenaChunk *chunk;
+	size_t offset;
+	size_t chunk_size;
+};
+
+/**
+ * @brief A position in an arena returned by cx_arena_mark.
+ */
+struct CxArenaMark {
+	/**
+	 * @privatesection
+	 */
+	struct CxArenaChunk *chunk;
+	size_t offset;
+};
+
+/**
+ * @memberof CxArena
+ * @brief Initializes an arena.
+ *
+ * @param arena The arena to initialize.
+ * @param chunk_size The size of the chunks. Larger allocations get a chunk of
+ * their own. If 0, a page is used.
+ */
+void cx_arena_init(struct CxArena *arena, size_t chunk_size);
+
+/**
+ * @memberof CxArena
+ * @brief Allocates memory from the arena. The memory is not initialized.
+ *
+ * @param arena The arena.
+ * @param size The size of the allocation.
+ * @param alignment The alignment of the allocation, a power of two.
+ *
+ * @return The memory or NULL on error.
+ */
+CX_NO_UNUSED void *cx_arena_alloc(
+		struct CxArena *arena, size_t size, size_t alignment);
+
+/**
+ * @memberof CxArena
+ * @brief Returns the current position of the arena.
+ *
+ * @param arena The arena.
+ *
+ * @return The mark.
+ */
+struct CxArenaMark cx_arena_mark(const struct CxArena *arena);
+
+/**
+ * @memberof CxArena
+ * @brief Frees all memory allocated after a mark was taken. Marks taken after
+ * it become invalid.
+ *
+ * @param arena The arena.
+ * @param mark The mark.
+ */
+void cx_arena_reset_to(struct CxArena *arena, const struct CxArenaMark *mark);
+
+/**
+ * @memberof CxArena
+ * @brief Frees all memory allocated from the arena. The first chunk is kept
+ * for the next allocations.
+ *
+ * @param arena The arena.
+ */
+void cx_arena_reset(struct CxArena *arena);
+
+/**
+ * @memberof CxArena
+ * @brief Frees all chunks of the arena.
+ *
+ * @param arena The arena.
+ */
+void cx_arena_cleanup(struct CxArena *arena);
+
+/***************************************
+ * memory/concurrent_pool.c
+ */
+
+struct CxConcurrentPoolElement;
+struct CxConcurrentPoolCache;
+
+/**
+ * @brief A pool of fixed size elements that can be used from any thread.
+ *
+ * Each thread takes elements from and returns elements to its own magazines.
+ * Full magazines are exchanged with a shared depot, so elements freed by
+ * another thread come back in batches. Locks are only taken once per
+ * magazine and to allocate new chunks.
+ *
+ * The magazines of a thread are found through a pthread key per pool, so at
+ * most PTHREAD_KEYS_MAX pools, minus the keys used elsewhere in the process,
+ * can exist at the same time. Each CxThreadpool uses one for its tasks.
+ */
+struct CxConcurrentPool {
+	/**
+	 * @privatesection
+	 */
+	size_t element_size;
+	size_t magazine_size;
+	pthread_key_t key;
+	pthread_mutex_t depot_mutex;
+	struct CxConcurrentPoolElement *depot;
+
+	pthread_mutex_t mutex;
+	char **chunks;
+	size_t chunk_count;
+	struct CxConcurrentPoolCache *caches;
+};
+
+/**
+ * @memberof CxConcurrentPool
+ * @brief Initializes a concurrent pool with a default magazine size.
+ *
+ * @param pool The pool to initialize.
+ * @param element_size The size of the elements.
+ *
+ * @return 0 on success, less than 0 on error.
+ */
+int cx_concurrent_pool_init(struct CxConcurrentPool *pool, size_t element_size);
+
+/**
+ * @memberof CxConcurrentPool
+ * @brief Initializes a concurrent pool.
+ *
+ * @param pool The pool to initialize.
+ * @param magazine_size The number of elements a thread caches before it
+ * exchanges a magazine with the depot.
+ * @param element_size The size of the elements.
+ *
+ * @return 0 on success, less than 0 on error.
+ */
+int cx_concurrent_pool_init2(
+		struct CxConcurrentPool *pool, size_t magazine_size,
+		size_t element_size);
+
+/**
+ * @memberof CxConcurrentPool
+ * @brief Takes an element from the pool.
+ *
+ * @param pool The pool.
+ *
+ * @return The element or NULL on error.
+ */
+void *cx_concurrent_pool_get(struct CxConcurrentPool *pool);
+
+/**
+ * @memberof CxConcurrentPool
+ * @brief Returns an element to the pool. The element may be returned by
+ * another thread than the one that took it.
+ *
+ * @param pool The pool.
+ * @param element The element.
+ */
+void cx_concurrent_pool_recycle(struct CxConcurrentPool *pool, void *element);
+
+/**
+ * @memberof CxConcurrentPool
+ * @brief Frees all elements of the pool. No other thread may use the pool
+ * anymore.
+ *
+ * @param pool The pool.
+ */
+void cx_concurrent_pool_cleanup(struct CxConcurrentPool *pool);
+
 #ifdef __cplusplus
 }
 #endif
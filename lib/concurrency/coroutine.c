@@ -0,0 +1,119 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright (c) 2023, Enno Boland <g@s01.de>                                 *
+ *                                                                            *
+ * Redistribution and use in source and binary forms, with or without         *
+ * modification, are permitted provided that the following conditions are     *
+ * met:                                                                       *
+ *                                                                            *
+ * * Redistributions of source code must retain the above copyright notice,   *
+ *   this list of conditions and the following disclaimer.                    *
+ * * Redistributions in binary form must reproduce the above copyright        *
+ *   notice, this list of conditions and the following disclaimer in the      *
+ *   documentation and/or other materials provided with the distribution.     *
+ *                                                                            *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS    *
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,  *
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR     *
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR          *
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,      *
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,        *
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR         *
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF     *
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING       *
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS         *
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.               *
+ *                                                                            *
+ ******************************************************************************/
+
+/**
+ * @author       Enno Boland (mail@eboland.de)
+ * @file         coroutine.c
+ *
+ * Stackless coroutines in the style of protothreads. Awaiting a future
+ * registers the coroutine as a continuation of the future, the step that
+ * resolves the future schedules the coroutine again.
+ */
+
+#include "../../include/cextras/concurrency.h"
+#include <stddef.h>
+
+extern int cx__future_add_continuation(
+		struct CxFuture *future, struct CxContinuation *continuation);
+extern void cx__task_set_internal(struct CxTask *task);
+
+static void
+coroutine_run(void *arg) {
+	struct CxCoroutine *coroutine = arg;
+	struct CxFuture *done = coroutine->done;
+
+	if (coroutine->function(coroutine, coroutine->arg) ==
+		CX_COROUTINE_SUSPENDED) {
+		// The coroutine may already run on another worker.
+		return;
+	}
+	// The storage of the coroutine may be released once the future is
+	// resolved.
+	cx_future_resolve(done, coroutine->result);
+	cx_future_destroy(done);
+}
+
+static void
+coroutine_cancel(void *arg) {
+	struct CxCoroutine *coroutine = arg;
+	struct CxFuture *done = coroutine->done;
+
+	cx_future_resolve(done, NULL);
+	cx_future_destroy(done);
+}
+
+cx_future_t
+cx_coroutine_start(
+		struct CxCoroutine *coroutine, struct CxThreadpool *threadpool,
+		cx_coroutine_fn_t function, void *arg) {
+	struct CxFuture *done = cx_future_init(NULL);
+	if (done == NULL) {
+		return NULL;
+	}
+	// The coroutine holds its own reference until it has finished.
+	cx_rc_retain(&done->rc);
+
+	coroutine->resume_point = 0;
+	coroutine->function = function;
+	coroutine->arg = arg;
+	coroutine->result = NULL;
+	coroutine->awaited = NULL;
+	coroutine->done = done;
+	coroutine->waker.threadpool = threadpool;
+	coroutine->waker.value = NULL;
+	coroutine->waker.next = NULL;
+	cx_task_init(&coroutine->waker.task, coroutine_run, coroutine);
+	cx_task_set_cancel(&coroutine->waker.task, coroutine_cancel);
+	cx__task_set_internal(&coroutine->waker.task);
+
+	if (cx_threadpool_schedule_task(threadpool, &coroutine->waker.task) < 0) {
+		cx_future_destroy(done);
+		cx_future_destroy(done);
+		return NULL;
+	}
+	return done;
+}
+
+int
+cx_coroutine_await(struct CxCoroutine *coroutine, struct CxFuture *future) {
+	coroutine->awaited = future;
+	if (cx__future_add_continuation(future, &coroutine->waker) == 0) {
+		return CX_COROUTINE_SUSPENDED;
+	}
+	// Already resolved, continue without a round trip through the
+	// threadpool.
+	return CX_COROUTINE_DONE;
+}
+
+void *
+cx_coroutine_awaited_value(struct CxCoroutine *coroutine) {
+	void *value = NULL;
+	cx_future_try_get(coroutine->awaited, &value);
+	coroutine->awaited = NULL;
+	return value;
+}
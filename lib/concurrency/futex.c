@@ -0,0 +1,151 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright (c) 2023, Enno Boland <g@s01.de>                                 *
+ *                                                                            *
+ * Redistribution and use in source and binary forms, with or without         *
+ * modification, are permitted provided that the following conditions are     *
+ * met:                                                                       *
+ *                                                                            *
+ * * Redistributions of source code must retain the above copyright notice,   *
+ *   this list of conditions and the following disclaimer.                    *
+ * * Redistributions in binary form must reproduce the above copyright        *
+ *   notice, this list of conditions and the following disclaimer in the      *
+ *   documentation and/or other materials provided with the distribution.     *
+ *                                                                            *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS    *
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,  *
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR     *
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR          *
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,      *
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,        *
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR         *
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF     *
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING       *
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS         *
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.               *
+ *                                                                            *
+ ******************************************************************************/
+
+/**
+ * @author       Enno Boland (mail@eboland.de)
+ * @file         futex.c
+ *
+ * Minimal wait/wake primitives on 32 bit words. Uses futexes on Linux and a
+ * table of condition variables hashed by address elsewhere.
+ */
+
+#define _GNU_SOURCE
+
+#include "../../include/cextras/concurrency.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __linux__
+#	include <linux/futex.h>
+#	include <sys/syscall.h>
+#	include <unistd.h>
+
+int
+cx__futex_wait(
+		_Atomic(uint32_t) *address, uint32_t expected,
+		const struct timespec *timeout) {
+	struct timespec relative;
+	const struct timespec *relative_ptr = NULL;
+
+	if (timeout != NULL) {
+		// FUTEX_WAIT takes a relative timeout, the API uses an absolute one.
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		relative.tv_sec = timeout->tv_sec - now.tv_sec;
+		relative.tv_nsec = timeout->tv_nsec - now.tv_nsec;
+		if (relative.tv_nsec < 0) {
+			relative.tv_sec--;
+			relative.tv_nsec += 1000000000;
+		}
+		if (relative.tv_sec < 0) {
+			return -ETIMEDOUT;
+		}
+		relative_ptr = &relative;
+	}
+
+	if (syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, expected,
+				relative_ptr, NULL, 0) < 0) {
+		return errno == ETIMEDOUT ? -ETIMEDOUT : 0;
+	}
+	return 0;
+}
+
+void
+cx__futex_wake(_Atomic(uint32_t) *address, int count) {
+	syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+#else
+#	define BUCKET_COUNT 64
+
+struct Bucket {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+static struct Bucket buckets[BUCKET_COUNT];
+static pthread_once_t buckets_once = PTHREAD_ONCE_INIT;
+
+static void
+buckets_init(void) {
+	for (size_t i = 0; i < BUCKET_COUNT; i++) {
+		pthread_mutex_init(&buckets[i].mutex, NULL);
+		pthread_cond_init(&buckets[i].cond, NULL);
+	}
+}
+
+static struct Bucket *
+bucket_get(_Atomic(uint32_t) *address) {
+	pthread_once(&buckets_once, buckets_init);
+	uintptr_t hash = (uintptr_t)address;
+	hash ^= hash >> 17;
+	return &buckets[(hash >> 2) % BUCKET_COUNT];
+}
+
+int
+cx__futex_wait(
+		_Atomic(uint32_t) *address, uint32_t expected,
+		const struct timespec *timeout) {
+	int rv = 0;
+	struct Bucket *bucket = bucket_get(address);
+
+	pthread_mutex_lock(&bucket->mutex);
+	if (atomic_load(address) == expected) {
+		if (timeout != NULL) {
+			rv = pthread_cond_timedwait(
+					&bucket->cond, &bucket->mutex, timeout);
+		} else {
+			rv = pthread_cond_wait(&bucket->cond, &bucket->mutex);
+		}
+	}
+	pthread_mutex_unlock(&bucket->mutex);
+	return rv == ETIMEDOUT ? -ETIMEDOUT : 0;
+}
+
+void
+cx__futex_wake(_Atomic(uint32_t) *address, int count) {
+	struct Bucket *bucket = bucket_get(address);
+	(void)count;
+
+	// Buckets are shared between addresses, so every waiter needs to
+	// recheck its condition.
+	pthread_mutex_lock(&bucket->mutex);
+	pthread_cond_broadcast(&bucket->cond);
+	pthread_mutex_unlock(&bucket->mutex);
+}
+#endif
+
+void
+cx__cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	__asm__ __volatile__("yield");
+#endif
+}
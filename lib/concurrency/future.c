@@ -27,65 +27,284 @@
  ******************************************************************************/
 
 #include "../../include/cextras/concurrency.h"
-#include <pthread.h>
+#include "../../include/cextras/error.h"
+#include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
-#include <unistd.h>
+#include <time.h>
 
-struct CxFuture {
-	pthread_mutex_t mutex;
-	pthread_cond_t cond;
-	void *in_value;
-	void *out_value;
+extern int cx__futex_wait(
+		_Atomic(uint32_t) *address, uint32_t expected,
+		const struct timespec *timeout);
+extern void cx__futex_wake(_Atomic(uint32_t) *address, int count);
+extern void cx__task_set_internal(struct CxTask *task);
+
+#define FUTURE_CLAIMED 0x1
+#define FUTURE_RESOLVED 0x2
+#define FUTURE_WAITING 0x4
+#define FUTURE_EMBEDDED 0x8
+
+// Marks the list of continuations as closed once the future is resolved.
+#define CONTINUATIONS_CLOSED ((struct CxContinuation *)(uintptr_t)1)
+
+/**
+ * A future that is resolved by running a function on the threadpool, created
+ * by cx_threadpool_submit and cx_future_then.
+ */
+struct FutureTask {
+	// Must be the first member, the allocation is released through the
+	// future.
+	struct CxFuture future;
+	struct CxContinuation continuation;
+	cx_future_task_t function;
 };
 
+static void
+future_init(struct CxFuture *future, void *in_value, uint32_t flags) {
+	atomic_init(&future->state, flags);
+	cx_rc_init(&future->rc);
+	future->in_value = in_value;
+	future->out_value = NULL;
+	atomic_init(&future->continuations, NULL);
+}
+
+static void
+future_release(struct CxFuture *future) {
+	if (cx_rc_release(&future->rc) == false) {
+		return;
+	}
+	if (atomic_load(&future->state) & FUTURE_EMBEDDED) {
+		// Wakes up cx_future_cleanup
+		cx__futex_wake((_Atomic(uint32_t) *)&future->rc.count, INT32_MAX);
+	} else {
+		free(future);
+	}
+}
+
 struct CxFuture *
 cx_future_init(void *in_value) {
-	struct CxFuture *future = calloc(1, sizeof(struct CxFuture));
+	struct CxFuture *future = malloc(sizeof(struct CxFuture));
 	if (future == NULL)
 		return NULL;
-	future->in_value = in_value;
-	pthread_mutex_init(&future->mutex, NULL);
-	pthread_cond_init(&future->cond, NULL);
+	future_init(future, in_value, 0);
 	return future;
 }
 
+void
+cx_future_init2(struct CxFuture *future, void *in_value) {
+	future_init(future, in_value, FUTURE_EMBEDDED);
+}
+
 void *
 cx_future_get_in_value(struct CxFuture *future) {
 	return future->in_value;
 }
 
+static int
+future_wait(struct CxFuture *future, const struct timespec *deadline) {
+	uint32_t state = atomic_load_explicit(&future->state, memory_order_acquire);
+
+	while ((state & FUTURE_RESOLVED) == 0) {
+		if ((state & FUTURE_WAITING) == 0 &&
+			!atomic_compare_exchange_weak(
+					&future->state, &state, state | FUTURE_WAITING)) {
+			continue;
+		}
+		if (cx__futex_wait(&future->state, state | FUTURE_WAITING, deadline) ==
+			-ETIMEDOUT) {
+			state = atomic_load_explicit(
+					&future->state, memory_order_acquire);
+			return (state & FUTURE_RESOLVED) ? 0 : -CX_ERR_TIMEOUT;
+		}
+		state = atomic_load_explicit(&future->state, memory_order_acquire);
+	}
+	return 0;
+}
+
 void *
 cx_future_wait(struct CxFuture *future) {
-	void *out_value = NULL;
-	pthread_mutex_lock(&future->mutex);
-	while (future->out_value == NULL)
-		pthread_cond_wait(&future->cond, &future->mutex);
-	out_value = future->out_value;
-	pthread_mutex_unlock(&future->mutex);
-	return out_value;
+	future_wait(future, NULL);
+	return future->out_value;
+}
+
+int
+cx_future_wait_until(
+		struct CxFuture *future, const struct timespec *deadline,
+		void **value) {
+	int rv = future_wait(future, deadline);
+	if (rv == 0 && value != NULL) {
+		*value = future->out_value;
+	}
+	return rv;
+}
+
+int
+cx_future_try_get(struct CxFuture *future, void **value) {
+	uint32_t state = atomic_load_explicit(&future->state, memory_order_acquire);
+	if ((state & FUTURE_RESOLVED) == 0) {
+		return -CX_ERR_WOULD_BLOCK;
+	}
+	if (value != NULL) {
+		*value = future->out_value;
+	}
+	return 0;
+}
+
+static void
+future_task_run(void *arg) {
+	struct FutureTask *task = arg;
+
+	void *out_value = task->function(task->continuation.value);
+	cx_future_resolve(&task->future, out_value);
+	// Drop the reference held by the task.
+	future_release(&task->future);
+}
+
+static void
+future_task_cancel(void *arg) {
+	struct FutureTask *task = arg;
+
+	// Waiters are woken up with NULL instead of waiting forever.
+	cx_future_resolve(&task->future, NULL);
+	future_release(&task->future);
+}
+
+static struct FutureTask *
+future_task_new(
+		struct CxThreadpool *threadpool, cx_future_task_t function,
+		void *in_value) {
+	struct FutureTask *task = malloc(sizeof(struct FutureTask));
+	if (task == NULL) {
+		return NULL;
+	}
+	future_init(&task->future, in_value, 0);
+	task->function = function;
+
+	struct CxContinuation *continuation = &task->continuation;
+	cx_task_init(&continuation->task, future_task_run, task);
+	cx_task_set_cancel(&continuation->task, future_task_cancel);
+	cx__task_set_internal(&continuation->task);
+	continuation->threadpool = threadpool;
+	continuation->value = in_value;
+	continuation->next = NULL;
+
+	// The task holds its own reference until it has run.
+	cx_rc_retain(&task->future.rc);
+	return task;
+}
+
+static int
+future_task_start(struct FutureTask *task) {
+	return cx_threadpool_schedule_task(
+			task->continuation.threadpool, &task->continuation.task);
 }
 
 int
 cx_future_resolve(struct CxFuture *future, void *value) {
-	int rv = 0;
-	pthread_mutex_lock(&future->mutex);
-	if (future->out_value != NULL) {
-		rv = -1;
-		goto out;
+	uint32_t state = atomic_fetch_or(&future->state, FUTURE_CLAIMED);
+	if (state & FUTURE_CLAIMED) {
+		return -1;
 	}
+
 	future->out_value = value;
-	pthread_cond_broadcast(&future->cond);
+	state = atomic_fetch_or_explicit(
+			&future->state, FUTURE_RESOLVED, memory_order_release);
+	// Close the list only after publishing the value, whoever finds it
+	// closed reads the value right away.
+	struct CxContinuation *continuations =
+			atomic_exchange(&future->continuations, CONTINUATIONS_CLOSED);
+	if (state & FUTURE_WAITING) {
+		cx__futex_wake(&future->state, INT32_MAX);
+	}
 
-out:
-	pthread_mutex_unlock(&future->mutex);
-	return rv;
+	while (continuations != NULL) {
+		// The continuation may be released as soon as it is scheduled.
+		struct CxContinuation *next = continuations->next;
+		struct CxTask *task = &continuations->task;
+		continuations->value = value;
+		if (cx_threadpool_schedule_task(continuations->threadpool, task) <
+			0) {
+			// Scheduling failed, run the continuation inline so that it
+			// resolves anyway.
+			task->function(task->arg);
+		}
+		continuations = next;
+	}
+	return 0;
 }
 
 int
 cx_future_destroy(struct CxFuture *future) {
-	pthread_mutex_destroy(&future->mutex);
-	pthread_cond_destroy(&future->cond);
-	free(future);
+	future_release(future);
+	return 0;
+}
+
+int
+cx_future_cleanup(struct CxFuture *future) {
+	// Drop the reference of the caller and wait for tasks and continuations
+	// to drop theirs, so that the storage can be reused afterwards.
+	_Atomic(uint32_t) *count = (_Atomic(uint32_t) *)&future->rc.count;
+	future_release(future);
+	uint32_t current;
+	while ((current = atomic_load(count)) != 0) {
+		cx__futex_wait(count, current, NULL);
+	}
+	return 0;
+}
+
+/**
+ * Registers `continuation` to have its task scheduled once `future` is
+ * resolved. Returns 1 without registering if the future is already resolved.
+ */
+int
+cx__future_add_continuation(
+		struct CxFuture *future, struct CxContinuation *continuation) {
+	struct CxContinuation *head = atomic_load(&future->continuations);
+	do {
+		if (head == CONTINUATIONS_CLOSED) {
+			return 1;
+		}
+		continuation->next = head;
+	} while (!atomic_compare_exchange_weak(
+			&future->continuations, &head, continuation));
 	return 0;
 }
+
+struct CxFuture *
+cx_threadpool_submit(
+		struct CxThreadpool *threadpool, cx_future_task_t function,
+		void *arg) {
+	struct FutureTask *task = future_task_new(threadpool, function, arg);
+	if (task == NULL) {
+		return NULL;
+	}
+
+	if (future_task_start(task) < 0) {
+		future_release(&task->future);
+		future_release(&task->future);
+		return NULL;
+	}
+	return &task->future;
+}
+
+struct CxFuture *
+cx_future_then(
+		struct CxFuture *future, struct CxThreadpool *threadpool,
+		cx_future_task_t function) {
+	struct FutureTask *task = future_task_new(threadpool, function, NULL);
+	if (task == NULL) {
+		return NULL;
+	}
+
+	if (cx__future_add_continuation(future, &task->continuation) == 1) {
+		// Already resolved, nobody else schedules the continuation.
+		task->continuation.value = future->out_value;
+		if (future_task_start(task) < 0) {
+			future_release(&task->future);
+			future_release(&task->future);
+			return NULL;
+		}
+	}
+	return &task->future;
+}
@@ -0,0 +1,547 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright (c) 2023, Enno Boland <g@s01.de>                                 *
+ *                                                                            *
+ * Redistribution and use in source and binary forms, with or without         *
+ * modification, are permitted provided that the following conditions are     *
+ * met:                                                                       *
+ *                                                                            *
+ * * Redistributions of source code must retain the above copyright notice,   *
+ *   this list of conditions and the following disclaimer.                    *
+ * * Redistributions in binary form must reproduce the above copyright        *
+ *   notice, this list of conditions and the following disclaimer in the      *
+ *   documentation and/or other materials provided with the distribution.     *
+ *                                                                            *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS    *
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,  *
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR     *
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR          *
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,      *
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,        *
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR         *
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF     *
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING       *
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS         *
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.               *
+ *                                                                            *
+ ******************************************************************************/
+
+/**
+ * @author       Enno Boland (mail@eboland.de)
+ * @file         io_executor.c
+ *
+ * Asynchronous reads and writes that resolve futures. Requests go through
+ * io_uring where the kernel supports it and run as blocking calls on the
+ * threadpool otherwise.
+ */
+
+#define _GNU_SOURCE
+
+#include "../../include/cextras/concurrency.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#	include <linux/io_uring.h>
+#	include <sys/mman.h>
+#	include <sys/syscall.h>
+#endif
+
+extern void cx__task_set_internal(struct CxTask *task);
+
+#define DEFAULT_QUEUE_DEPTH 1024
+
+// The user data of the request that wakes up the completion thread.
+#define WAKE_USER_DATA 0
+
+enum IoOperation {
+	IO_READ,
+	IO_WRITE,
+};
+
+struct IoRequest {
+	struct CxIoExecutor *executor;
+	enum IoOperation operation;
+	int fd;
+	void *buffer;
+	size_t size;
+	uint64_t offset;
+	struct CxFuture *future;
+	// Only used by the threadpool backend.
+	struct CxTask task;
+};
+
+static void
+io_complete(struct CxIoExecutor *executor, struct CxFuture *future, long rv) {
+	cx_future_resolve(future, (void *)(intptr_t)rv);
+	// Releases the reference taken when the request was submitted.
+	cx_future_destroy(future);
+
+	cx_semaphore_post(&executor->slots);
+
+	// The executor may be cleaned up as soon as nothing is in flight, so the
+	// last decrement happens while holding the mutex.
+	size_t in_flight = atomic_load(&executor->in_flight);
+	while (in_flight > 1) {
+		if (atomic_compare_exchange_weak(
+					&executor->in_flight, &in_flight, in_flight - 1)) {
+			return;
+		}
+	}
+	pthread_mutex_lock(&executor->idle_mutex);
+	atomic_fetch_sub(&executor->in_flight, 1);
+	pthread_cond_broadcast(&executor->idle_cond);
+	pthread_mutex_unlock(&executor->idle_mutex);
+}
+
+/***************************************
+ * Threadpool backend
+ */
+
+static void
+io_request_run(void *arg) {
+	struct IoRequest *request = arg;
+	struct CxIoExecutor *executor = request->executor;
+	long rv = 0;
+
+	cx_threadpool_blocking_begin(executor->threadpool);
+	if (request->operation == IO_READ) {
+		rv = pread(request->fd, request->buffer, request->size,
+				   (off_t)request->offset);
+	} else {
+		rv = pwrite(
+				request->fd, request->buffer, request->size,
+				(off_t)request->offset);
+	}
+	if (rv < 0) {
+		rv = -errno;
+	}
+	cx_threadpool_blocking_end(executor->threadpool);
+
+	io_complete(executor, request->future, rv);
+	free(request);
+}
+
+static void
+io_request_cancel(void *arg) {
+	struct IoRequest *request = arg;
+
+	io_complete(request->executor, request->future, -ECANCELED);
+	free(request);
+}
+
+static int
+threadpool_submit(struct CxIoExecutor *executor, struct IoRequest *request) {
+	struct IoRequest *copy = malloc(sizeof(struct IoRequest));
+	if (copy == NULL) {
+		return -1;
+	}
+	*copy = *request;
+
+	cx_task_init(&copy->task, io_request_run, copy);
+	cx_task_set_cancel(&copy->task, io_request_cancel);
+	cx__task_set_internal(&copy->task);
+	if (cx_threadpool_schedule_task(executor->threadpool, &copy->task) < 0) {
+		free(copy);
+		return -1;
+	}
+	return 0;
+}
+
+/***************************************
+ * io_uring backend
+ */
+
+#ifdef __linux__
+static int
+uring_enter(
+		struct CxIoExecutor *executor, unsigned int to_submit,
+		unsigned int min_complete, unsigned int flags) {
+	long rv = syscall(
+			__NR_io_uring_enter, executor->ring_fd, to_submit, min_complete,
+			flags, NULL, 0);
+	return rv < 0 ? -errno : (int)rv;
+}
+
+static void
+uring_unmap(struct CxIoExecutor *executor) {
+	if (executor->sqes != NULL) {
+		munmap(executor->sqes, executor->sqes_size);
+	}
+	if (executor->cq_ring != NULL && executor->cq_ring != executor->sq_ring) {
+		munmap(executor->cq_ring, executor->cq_ring_size);
+	}
+	if (executor->sq_ring != NULL) {
+		munmap(executor->sq_ring, executor->sq_ring_size);
+	}
+}
+
+static void *
+uring_map(struct CxIoExecutor *executor, size_t size, off_t offset) {
+	void *ptr =
+			mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				 executor->ring_fd, offset);
+	return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+/**
+ * Returns true if the kernel supports the read and write opcodes. These came
+ * with Linux 5.6, like the probe itself, so older kernels fail the probe.
+ */
+static bool
+uring_supports_ops(int ring_fd) {
+	bool supported = false;
+	size_t size = sizeof(struct io_uring_probe) +
+			IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, size);
+	if (probe == NULL) {
+		return false;
+	}
+
+	long rv = syscall(
+			__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe,
+			IORING_OP_LAST);
+	if (rv == 0 && probe->last_op >= IORING_OP_READ &&
+		probe->last_op >= IORING_OP_WRITE) {
+		supported =
+				(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+				(probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+	}
+	free(probe);
+	return supported;
+}
+
+static int
+uring_setup(struct CxIoExecutor *executor, unsigned int entries) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	executor->sq_ring = NULL;
+	executor->cq_ring = NULL;
+	executor->sqes = NULL;
+
+	long fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (fd < 0) {
+		return -1;
+	} else if (!uring_supports_ops((int)fd)) {
+		// Fall back to the threadpool instead of failing every request.
+		close((int)fd);
+		return -1;
+	}
+	executor->ring_fd = (int)fd;
+
+	executor->sq_ring_size =
+			params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	executor->cq_ring_size = params.cq_off.cqes +
+			params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		executor->sq_ring_size =
+				CX_MAX(executor->sq_ring_size, executor->cq_ring_size);
+		executor->cq_ring_size = executor->sq_ring_size;
+	}
+	executor->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	executor->sq_ring =
+			uring_map(executor, executor->sq_ring_size, IORING_OFF_SQ_RING);
+	if (executor->sq_ring == NULL) {
+		goto err;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		executor->cq_ring = executor->sq_ring;
+	} else {
+		executor->cq_ring = uring_map(
+				executor, executor->cq_ring_size, IORING_OFF_CQ_RING);
+		if (executor->cq_ring == NULL) {
+			goto err;
+		}
+	}
+	executor->sqes = uring_map(executor, executor->sqes_size, IORING_OFF_SQES);
+	if (executor->sqes == NULL) {
+		goto err;
+	}
+
+	char *sq = executor->sq_ring;
+	char *cq = executor->cq_ring;
+	executor->sq_head = (_Atomic(unsigned int) *)(sq + params.sq_off.head);
+	executor->sq_tail = (_Atomic(unsigned int) *)(sq + params.sq_off.tail);
+	executor->sq_array = (unsigned int *)(sq + params.sq_off.array);
+	executor->sq_mask = *(unsigned int *)(sq + params.sq_off.ring_mask);
+	executor->cq_head = (_Atomic(unsigned int) *)(cq + params.cq_off.head);
+	executor->cq_tail = (_Atomic(unsigned int) *)(cq + params.cq_off.tail);
+	executor->cqes = cq + params.cq_off.cqes;
+	executor->cq_mask = *(unsigned int *)(cq + params.cq_off.ring_mask);
+
+	return 0;
+err:
+	uring_unmap(executor);
+	close(executor->ring_fd);
+	return -1;
+}
+
+/**
+ * Queues a request and submits it to the kernel. Returns the negative errno
+ * value if the kernel rejected the submission.
+ */
+static int
+uring_push(
+		struct CxIoExecutor *executor, uint8_t opcode,
+		const struct IoRequest *request, uint64_t user_data) {
+	int rv = 0;
+
+	pthread_mutex_lock(&executor->submit_mutex);
+	unsigned int tail =
+			atomic_load_explicit(executor->sq_tail, memory_order_relaxed);
+	unsigned int index = tail & executor->sq_mask;
+	struct io_uring_sqe *sqe = &((struct io_uring_sqe *)executor->sqes)[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->user_data = user_data;
+	if (request != NULL) {
+		sqe->fd = request->fd;
+		sqe->addr = (uint64_t)(uintptr_t)request->buffer;
+		sqe->len = (uint32_t)request->size;
+		sqe->off = request->offset;
+	}
+	executor->sq_array[index] = index;
+	atomic_store_explicit(executor->sq_tail, tail + 1, memory_order_release);
+
+	do {
+		rv = uring_enter(executor, 1, 0, 0);
+	} while (rv == -EINTR || rv == -EAGAIN);
+	if (rv < 0) {
+		// Nothing was consumed, take the entry back.
+		atomic_store_explicit(executor->sq_tail, tail, memory_order_release);
+	}
+	pthread_mutex_unlock(&executor->submit_mutex);
+
+	return rv < 0 ? rv : 0;
+}
+
+static void *
+uring_run(void *data) {
+	struct CxIoExecutor *executor = data;
+	struct io_uring_cqe *cqes = executor->cqes;
+
+	for (;;) {
+		unsigned int head =
+				atomic_load_explicit(executor->cq_head, memory_order_relaxed);
+		unsigned int tail =
+				atomic_load_explicit(executor->cq_tail, memory_order_acquire);
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe = &cqes[head & executor->cq_mask];
+			if (cqe->user_data != WAKE_USER_DATA) {
+				io_complete(
+						executor,
+						(struct CxFuture *)(uintptr_t)cqe->user_data,
+						cqe->res);
+			}
+		}
+		atomic_store_explicit(executor->cq_head, head, memory_order_release);
+
+		if (atomic_load(&executor->stopping) &&
+			atomic_load(&executor->in_flight) == 0) {
+			break;
+		}
+		uring_enter(executor, 0, 1, IORING_ENTER_GETEVENTS);
+	}
+	return NULL;
+}
+
+static int
+uring_submit(struct CxIoExecutor *executor, struct IoRequest *request) {
+	uint8_t opcode =
+			request->operation == IO_READ ? IORING_OP_READ : IORING_OP_WRITE;
+	uint64_t user_data = (uint64_t)(uintptr_t)request->future;
+
+	int rv = uring_push(executor, opcode, request, user_data);
+	if (rv < 0) {
+		// Report the error through the future like a failed request.
+		io_complete(executor, request->future, rv);
+	}
+	return 0;
+}
+
+static int
+uring_init(struct CxIoExecutor *executor, unsigned int queue_depth) {
+	int rv = uring_setup(executor, queue_depth);
+	if (rv < 0) {
+		return rv;
+	}
+	rv = pthread_create(&executor->thread, NULL, uring_run, executor);
+	if (rv != 0) {
+		uring_unmap(executor);
+		close(executor->ring_fd);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+uring_cleanup(struct CxIoExecutor *executor) {
+	atomic_store(&executor->stopping, true);
+	// Wakes up the completion thread in case nothing is in flight.
+	uring_push(executor, IORING_OP_NOP, NULL, WAKE_USER_DATA);
+	pthread_join(executor->thread, NULL);
+
+	uring_unmap(executor);
+	close(executor->ring_fd);
+}
+#else
+static int
+uring_submit(struct CxIoExecutor *executor, struct IoRequest *request) {
+	(void)executor;
+	(void)request;
+	return -1;
+}
+
+static int
+uring_init(struct CxIoExecutor *executor, unsigned int queue_depth) {
+	(void)executor;
+	(void)queue_depth;
+	return -1;
+}
+
+static void
+uring_cleanup(struct CxIoExecutor *executor) {
+	(void)executor;
+}
+#endif
+
+/***************************************
+ * Public interface
+ */
+
+int
+cx_io_executor_init(
+		struct CxIoExecutor *executor, struct CxThreadpool *threadpool) {
+	struct CxIoExecutorOptions options = {0};
+	return cx_io_executor_init2(executor, threadpool, &options);
+}
+
+int
+cx_io_executor_init2(
+		struct CxIoExecutor *executor, struct CxThreadpool *threadpool,
+		const struct CxIoExecutorOptions *options) {
+	int rv = 0;
+	unsigned int queue_depth = options->queue_depth == 0
+			? DEFAULT_QUEUE_DEPTH
+			: options->queue_depth;
+
+	executor->threadpool = threadpool;
+	executor->uring = false;
+	atomic_init(&executor->stopping, false);
+	atomic_init(&executor->in_flight, 0);
+	cx_semaphore_init(&executor->slots, queue_depth);
+
+	rv = pthread_mutex_init(&executor->submit_mutex, NULL);
+	if (rv != 0) {
+		goto destroy_slots;
+	}
+	rv = pthread_mutex_init(&executor->idle_mutex, NULL);
+	if (rv != 0) {
+		goto destroy_submit_mutex;
+	}
+	rv = pthread_cond_init(&executor->idle_cond, NULL);
+	if (rv != 0) {
+		goto destroy_idle_mutex;
+	}
+
+	if (!options->use_threadpool && uring_init(executor, queue_depth) == 0) {
+		executor->uring = true;
+	}
+	return 0;
+
+destroy_idle_mutex:
+	pthread_mutex_destroy(&executor->idle_mutex);
+destroy_submit_mutex:
+	pthread_mutex_destroy(&executor->submit_mutex);
+destroy_slots:
+	cx_semaphore_destroy(&executor->slots);
+	return -1;
+}
+
+static struct CxFuture *
+io_submit(struct CxIoExecutor *executor, struct IoRequest *request) {
+	int rv = 0;
+	struct CxFuture *future = cx_future_init(NULL);
+	if (future == NULL) {
+		return NULL;
+	} else if (request->size > UINT32_MAX) {
+		// io_uring takes 32 bit lengths. Both backends reject larger
+		// requests, so that they behave the same.
+		cx_future_resolve(future, (void *)(intptr_t)-EOVERFLOW);
+		return future;
+	}
+	// One reference for the caller, one for the request.
+	cx_rc_retain(&future->rc);
+	request->executor = executor;
+	request->future = future;
+
+	cx_semaphore_wait(&executor->slots);
+	atomic_fetch_add(&executor->in_flight, 1);
+	if (executor->uring) {
+		rv = uring_submit(executor, request);
+	} else {
+		rv = threadpool_submit(executor, request);
+	}
+	if (rv < 0) {
+		atomic_fetch_sub(&executor->in_flight, 1);
+		cx_semaphore_post(&executor->slots);
+		cx_future_destroy(future);
+		cx_future_destroy(future);
+		return NULL;
+	}
+	return future;
+}
+
+struct CxFuture *
+cx_io_read(
+		struct CxIoExecutor *executor, int fd, void *buffer, size_t size,
+		uint64_t offset) {
+	struct IoRequest request = {
+			.operation = IO_READ,
+			.fd = fd,
+			.buffer = buffer,
+			.size = size,
+			.offset = offset,
+	};
+	return io_submit(executor, &request);
+}
+
+struct CxFuture *
+cx_io_write(
+		struct CxIoExecutor *executor, int fd, const void *buffer, size_t size,
+		uint64_t offset) {
+	struct IoRequest request = {
+			.operation = IO_WRITE,
+			.fd = fd,
+			.buffer = (void *)buffer,
+			.size = size,
+			.offset = offset,
+	};
+	return io_submit(executor, &request);
+}
+
+int
+cx_io_executor_cleanup(struct CxIoExecutor *executor) {
+	if (executor->uring) {
+		uring_cleanup(executor);
+	} else {
+		pthread_mutex_lock(&executor->idle_mutex);
+		while (atomic_load(&executor->in_flight) > 0) {
+			pthread_cond_wait(&executor->idle_cond, &executor->idle_mutex);
+		}
+		pthread_mutex_unlock(&executor->idle_mutex);
+	}
+	pthread_cond_destroy(&executor->idle_cond);
+	pthread_mutex_destroy(&executor->idle_mutex);
+	pthread_mutex_destroy(&executor->submit_mutex);
+	cx_semaphore_destroy(&executor->slots);
+	return 0;
+}
@@ -0,0 +1,173 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright (c) 2023, Enno Boland <g@s01.de>                                 *
+ *                                                                            *
+ * Redistribution and use in source and binary forms, with or without         *
+ * modification, are permitted provided that the following conditions are     *
+ * met:                                                                       *
+ *                                                                            *
+ * * Redistributions of source code must retain the above copyright notice,   *
+ *   this list of conditions and the following disclaimer.                    *
+ * * Redistributions in binary form must reproduce the above copyright        *
+ *   notice, this list of conditions and the following disclaimer in the      *
+ *   documentation and/or other materials provided with the distribution.     *
+ *                                                                            *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS    *
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,  *
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR     *
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR          *
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,      *
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,        *
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR         *
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF     *
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING       *
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS         *
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.               *
+ *                                                                            *
+ ******************************************************************************/
+
+/**
+ * @author       Enno Boland (mail@eboland.de)
+ * @file         parallel_for.c
+ */
+
+#include "../../include/cextras/concurrency.h"
+#include <stdlib.h>
+
+#define AUTO_GRAIN_CHUNKS_PER_WORKER 8
+
+extern void cx__task_set_internal(struct CxTask *task);
+
+struct ParallelFor {
+	cx_threadpool_range_t function;
+	void *ctx;
+	size_t grain;
+	size_t worker_count;
+
+	atomic_size_t queued;
+	atomic_size_t cancelled;
+	struct CxTaskGroup group;
+};
+
+struct RangeTask {
+	struct CxTask task;
+	struct ParallelFor *state;
+	size_t begin;
+	size_t end;
+};
+
+static void range_task_run(void *arg);
+static void range_task_cancel(void *arg);
+
+static bool
+split_range(struct ParallelFor *state, size_t begin, size_t end) {
+	struct RangeTask *range = calloc(1, sizeof(struct RangeTask));
+	if (range == NULL) {
+		return false;
+	}
+	range->state = state;
+	range->begin = begin;
+	range->end = end;
+	cx_task_init(&range->task, range_task_run, range);
+	cx_task_set_cancel(&range->task, range_task_cancel);
+	cx__task_set_internal(&range->task);
+
+	atomic_fetch_add(&state->queued, 1);
+	if (cx_task_group_schedule_task(&state->group, &range->task) < 0) {
+		atomic_fetch_sub(&state->queued, 1);
+		free(range);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Runs a range, splitting off the upper half whenever there are fewer queued
+ * ranges than workers. If all workers are busy, the range is processed in
+ * grain sized steps, so that splitting resumes as soon as a worker becomes
+ * idle.
+ */
+static void
+run_range(struct ParallelFor *state, size_t begin, size_t end) {
+	const size_t grain = state->grain;
+
+	while (end - begin > grain) {
+		if (atomic_load(&state->queued) < state->worker_count) {
+			size_t middle = begin + (end - begin) / 2;
+			if (split_range(state, middle, end)) {
+				end = middle;
+				continue;
+			}
+		}
+		state->function(begin, begin + grain, state->ctx);
+		begin += grain;
+	}
+	if (begin < end) {
+		state->function(begin, end, state->ctx);
+	}
+}
+
+static void
+range_task_run(void *arg) {
+	struct RangeTask *range = arg;
+	struct ParallelFor *state = range->state;
+	size_t begin = range->begin;
+	size_t end = range->end;
+	free(range);
+
+	atomic_fetch_sub(&state->queued, 1);
+	run_range(state, begin, end);
+}
+
+/**
+ * Called if the pool is shut down before the range ran. The range is skipped
+ * and reported to the caller of cx_threadpool_parallel_for.
+ */
+static void
+range_task_cancel(void *arg) {
+	struct RangeTask *range = arg;
+	struct ParallelFor *state = range->state;
+	free(range);
+
+	atomic_fetch_add(&state->cancelled, 1);
+	atomic_fetch_sub(&state->queued, 1);
+}
+
+int
+cx_threadpool_parallel_for(
+		struct CxThreadpool *threadpool, size_t begin, size_t end,
+		size_t grain, cx_threadpool_range_t function, void *ctx) {
+	int rv = 0;
+	struct ParallelFor state = {
+			.function = function,
+			.ctx = ctx,
+			.grain = grain,
+			.worker_count = cx_threadpool_worker_count(threadpool),
+	};
+
+	if (begin >= end) {
+		return 0;
+	}
+	if (state.grain == 0) {
+		// A pool may have no running worker after shutdown or while it
+		// resizes.
+		state.grain = (end - begin) /
+				(CX_MAX(state.worker_count, 1) * AUTO_GRAIN_CHUNKS_PER_WORKER);
+		state.grain = CX_MAX(state.grain, 1);
+	}
+	atomic_init(&state.queued, 0);
+	atomic_init(&state.cancelled, 0);
+	rv = cx_task_group_init(&state.group, threadpool);
+	if (rv < 0) {
+		return rv;
+	}
+
+	run_range(&state, begin, end);
+
+	rv = cx_task_group_wait(&state.group);
+	cx_task_group_cleanup(&state.group);
+	if (rv == 0 && atomic_load(&state.cancelled) > 0) {
+		rv = -1;
+	}
+	return rv;
+}
@@ -1,89 +1,111 @@
 #include "../../include/cextras/concurrency.h"
+#include "../../include/cextras/error.h"
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+#define SPIN_COUNT 128
+
+extern int cx__futex_wait(
+		_Atomic(uint32_t) *address, uint32_t expected,
+		const struct timespec *timeout);
+extern void cx__futex_wake(_Atomic(uint32_t) *address, int count);
+extern void cx__cpu_relax(void);
+
+static bool
+semaphore_try_take(struct CxSemaphore *semaphore) {
+	uint32_t count =
+			atomic_load_explicit(&semaphore->count, memory_order_relaxed);
+	while (count > 0) {
+		if (atomic_compare_exchange_weak_explicit(
+					&semaphore->count, &count, count - 1,
+					memory_order_acquire, memory_order_relaxed)) {
+			return true;
+		}
+	}
+	return false;
+}
 
-int
-cx_semaphore_init(struct CxSemaphore *semaphore, size_t count) {
+static int
+semaphore_wait(
+		struct CxSemaphore *semaphore, const struct timespec *deadline) {
 	int rv = 0;
 
-	rv = pthread_mutex_init(&semaphore->mutex, NULL);
-	if (rv != 0) {
-		goto out;
+	for (int i = 0; i < SPIN_COUNT; i++) {
+		if (semaphore_try_take(semaphore)) {
+			return 0;
+		}
+		cx__cpu_relax();
 	}
 
-	rv = pthread_cond_init(&semaphore->cond, NULL);
-	if (rv != 0) {
-		pthread_mutex_destroy(&semaphore->mutex);
-		goto out;
+	// Announce the waiter before checking the count a last time, so that
+	// cx_semaphore_post either sees the waiter or we see its increment.
+	atomic_fetch_add(&semaphore->waiters, 1);
+	while (!semaphore_try_take(semaphore)) {
+		if (cx__futex_wait(&semaphore->count, 0, deadline) == -ETIMEDOUT &&
+			!semaphore_try_take(semaphore)) {
+			rv = -CX_ERR_TIMEOUT;
+			break;
+		}
 	}
+	atomic_fetch_sub(&semaphore->waiters, 1);
 
-	semaphore->count = count;
-
-out:
 	return rv;
 }
 
 int
-cx_semaphore_wait(struct CxSemaphore *semaphore) {
-	int rv = 0;
-
-	rv = pthread_mutex_lock(&semaphore->mutex);
-	if (rv != 0) {
-		goto out;
+cx_semaphore_init(struct CxSemaphore *semaphore, size_t count) {
+	if (count > UINT32_MAX) {
+		return -CX_ERR_INTEGER_OVERFLOW;
 	}
+	atomic_init(&semaphore->count, (uint32_t)count);
+	atomic_init(&semaphore->waiters, 0);
+	return 0;
+}
 
-	while (semaphore->count == 0) {
-		rv = pthread_cond_wait(&semaphore->cond, &semaphore->mutex);
-		if (rv != 0) {
-			pthread_mutex_unlock(&semaphore->mutex);
-			goto out;
-		}
+int
+cx_semaphore_wait(struct CxSemaphore *semaphore) {
+	return semaphore_wait(semaphore, NULL);
+}
+
+int
+cx_semaphore_try_wait(struct CxSemaphore *semaphore) {
+	if (semaphore_try_take(semaphore)) {
+		return 0;
 	}
-	semaphore->count--;
+	return -CX_ERR_WOULD_BLOCK;
+}
 
-	rv = pthread_mutex_unlock(&semaphore->mutex);
-	if (rv != 0) {
-		goto out;
+int
+cx_semaphore_wait_timeout(
+		struct CxSemaphore *semaphore, const struct timespec *timeout) {
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout->tv_sec;
+	deadline.tv_nsec += timeout->tv_nsec;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
 	}
 
-out:
-	return rv;
+	return semaphore_wait(semaphore, &deadline);
 }
 
 int
 cx_semaphore_post(struct CxSemaphore *semaphore) {
-	int rv = 0;
-
-	rv = pthread_mutex_lock(&semaphore->mutex);
-	if (rv != 0) {
-		goto out;
-	}
-
-	semaphore->count++;
-	rv = pthread_cond_signal(&semaphore->cond);
-	if (rv != 0) {
-		pthread_mutex_unlock(&semaphore->mutex);
-		goto out;
+	if (atomic_fetch_add(&semaphore->count, 1) == UINT32_MAX) {
+		atomic_fetch_sub(&semaphore->count, 1);
+		return -CX_ERR_INTEGER_OVERFLOW;
 	}
-
-	rv = pthread_mutex_unlock(&semaphore->mutex);
-	if (rv != 0) {
-		goto out;
+	if (atomic_load(&semaphore->waiters) > 0) {
+		cx__futex_wake(&semaphore->count, 1);
 	}
-
-out:
-	return rv;
+	return 0;
 }
 
 int
 cx_semaphore_destroy(struct CxSemaphore *semaphore) {
-	int rv = 0;
-
-	rv = pthread_mutex_destroy(&semaphore->mutex);
-	if (rv != 0) {
-		goto out;
-	}
-
-	rv = pthread_cond_destroy(&semaphore->cond);
-
-out:
-	return rv;
+	(void)semaphore;
+	return 0;
 }
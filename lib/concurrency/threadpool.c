@@ -27,223 +27,551 @@
  ******************************************************************************/
 
 #include "../../include/cextras/concurrency.h"
+#include "../../include/cextras/error.h"
+#include <assert.h>
+#include <errno.h>
 #include <pthread.h>
 #include <sched.h>
 #include <stdbool.h>
+#include <time.h>
 #include <unistd.h>
 
+#define HELP_POLL_INTERVAL_NS 1000000
+#define MAX_NUMA_NODES 256
+#define DEFAULT_IDLE_SPIN_NS 20000
+#define DEFAULT_IDLE_YIELD_NS 100000
+#define IDLE_CLOCK_INTERVAL 64
+#define STARVATION_INTERVAL 8
+#define DEFAULT_IDLE_TIMEOUT_NS 1000000000L
+
+enum TaskJoinState {
+	TASK_DETACHED,
+	TASK_FORKED,
+	TASK_JOIN_WAITING,
+	TASK_DONE,
+};
+
+enum WorkerState {
+	WORKER_STOPPED,
+	WORKER_RUNNING,
+	WORKER_RETIRING,
+};
+
+extern size_t cx__numa_nodes(int *nodes, size_t max_nodes);
+extern int cx__numa_node_of_cpu(int cpu);
+extern int cx__pin_attr_to_cpu(pthread_attr_t *attr, int cpu);
+extern int cx__pin_attr_to_node(pthread_attr_t *attr, int node);
+extern int cx__futex_wait(
+		_Atomic(uint32_t) *address, uint32_t expected,
+		const struct timespec *timeout);
+extern void cx__futex_wake(_Atomic(uint32_t) *address, int count);
+extern void cx__cpu_relax(void);
+extern int cx__timer_queue_init(struct CxTimerQueue *queue);
+extern void cx__timer_queue_stop(struct CxTimerQueue *queue);
+extern void cx__timer_queue_cleanup(struct CxTimerQueue *queue);
+
+/**
+ * The worker the current thread runs, or NULL if it is not a worker thread.
+ */
+static _Thread_local struct CxWorker *current_worker = NULL;
+
 static int
 cpu_count(void) {
 	long numCPUs = sysconf(_SC_NPROCESSORS_ONLN);
 	return (int)numCPUs;
 }
 
+static uint64_t
+now_ns(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * Adds to a counter that only the owning worker writes. This avoids a locked
+ * instruction, readers may see a slightly stale value.
+ */
+static void
+counter_add(_Atomic(uint64_t) *counter, uint64_t value) {
+	uint64_t current = atomic_load_explicit(counter, memory_order_relaxed);
+	atomic_store_explicit(counter, current + value, memory_order_relaxed);
+}
+
+static void
+counter_max(_Atomic(uint64_t) *counter, uint64_t value) {
+	uint64_t current = atomic_load_explicit(counter, memory_order_relaxed);
+	while (current < value &&
+		   !atomic_compare_exchange_weak_explicit(
+				   counter, &current, value, memory_order_relaxed,
+				   memory_order_relaxed)) {
+	}
+}
+
+static size_t
+latency_bucket(uint64_t latency_ns) {
+	size_t bucket = 0;
+	while (latency_ns > 1 && bucket < CX_THREADPOOL_LATENCY_BUCKETS - 1) {
+		latency_ns >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
 static struct CxTask *
 task_new(
 		struct CxThreadpool *threadpool, cx_threadpool_task_t function,
 		void *arg) {
-	pthread_mutex_lock(&threadpool->task_pool_mutex);
-	struct CxTask *task = cx_prealloc_pool_get(&threadpool->task_pool);
-	pthread_mutex_unlock(&threadpool->task_pool_mutex);
-
+	struct CxTask *task = cx_concurrent_pool_get(&threadpool->task_pool);
 	if (task == NULL) {
 		return NULL;
 	}
 
-	task->function = function;
-	task->arg = arg;
-	task->next = NULL;
+	cx_task_init(task, function, arg);
+	task->pooled = true;
 
 	return task;
 }
 
 static void
 task_free(struct CxThreadpool *threadpool, struct CxTask *task) {
-	pthread_mutex_lock(&threadpool->task_pool_mutex);
-	cx_prealloc_pool_recycle(&threadpool->task_pool, task);
-	pthread_mutex_unlock(&threadpool->task_pool_mutex);
+	cx_concurrent_pool_recycle(&threadpool->task_pool, task);
 }
 
-static struct CxTask *
-worker_get_task(struct CxWorker *worker) {
-	struct CxTask *task = worker->head;
-	if (task != NULL) {
-		worker->head = task->next;
-		if (worker->head == NULL) {
-			worker->tail = NULL;
+static void
+task_done(struct CxThreadpool *threadpool) {
+	// Release the queue slot first, the pool may be cleaned up as soon as the
+	// last task is done.
+	if (threadpool->queue_capacity > 0) {
+		cx_semaphore_post(&threadpool->queue_slots);
+	}
+	// Only the completion of the last task needs to take the lock.
+	if (atomic_fetch_sub(&threadpool->active_tasks, 1) == 1) {
+		pthread_mutex_lock(&threadpool->wait_mutex);
+		pthread_cond_broadcast(&threadpool->wait_cond);
+		pthread_mutex_unlock(&threadpool->wait_mutex);
+	}
+}
+
+static void
+task_group_done(struct CxTaskGroup *group) {
+	// The group may be cleaned up as soon as its counter drops to zero, so
+	// the last decrement happens while holding the mutex.
+	size_t pending = atomic_load(&group->pending);
+	while (pending > 1) {
+		if (atomic_compare_exchange_weak(
+					&group->pending, &pending, pending - 1)) {
+			return;
 		}
-		atomic_fetch_sub(&worker->queue_length, 1);
 	}
-	return task;
+	pthread_mutex_lock(&group->mutex);
+	atomic_fetch_sub(&group->pending, 1);
+	pthread_cond_broadcast(&group->cond);
+	pthread_mutex_unlock(&group->mutex);
 }
 
-static struct CxTask *
-worker_find_task(struct CxWorker *worker) {
-	struct CxThreadpool *threadpool = worker->pool;
-	struct CxTask *task = NULL;
+/**
+ * Releases a task after its function or cancel function returned. The values
+ * are read before, as the task may already be released by the caller.
+ */
+static void
+task_finish(
+		struct CxThreadpool *threadpool, struct CxTask *task, bool pooled,
+		struct CxTaskGroup *group, bool joinable) {
+	if (pooled) {
+		task_free(threadpool, task);
+	}
+	if (group != NULL) {
+		task_group_done(group);
+	}
+	if (joinable &&
+		atomic_exchange(&task->join_state, TASK_DONE) == TASK_JOIN_WAITING) {
+		cx__futex_wake(&task->join_state, INT32_MAX);
+	}
+}
 
-	size_t worker_count = threadpool->worker_count;
-	size_t worker_index = worker - threadpool->workers;
-	for (size_t i = 0; i < worker_count && task == NULL; i++) {
-		struct CxWorker *candidate =
-				&worker->pool->workers[(i + worker_index) % worker_count];
-		pthread_mutex_lock(&candidate->queue_mutex);
-		task = worker_get_task(candidate);
-		pthread_mutex_unlock(&candidate->queue_mutex);
+/**
+ * Runs a task without marking it as done in the pool. `worker` is NULL if the
+ * task is run by a thread that is not a worker.
+ */
+static void
+task_run(
+		struct CxThreadpool *threadpool, struct CxWorker *worker,
+		struct CxTask *task) {
+	// Tasks scheduled with cx_threadpool_schedule_task are owned by the
+	// caller and may be released by the task function. Do not touch them
+	// after the function has been called.
+	bool pooled = task->pooled;
+	struct CxTaskGroup *group = task->group;
+	bool joinable = atomic_load(&task->join_state) != TASK_DETACHED;
+
+	if (worker != NULL) {
+		struct CxWorkerCounters *counters = &worker->counters;
+		uint64_t start = now_ns();
+		uint64_t latency = start > task->enqueue_time_ns
+				? start - task->enqueue_time_ns
+				: 0;
+		counter_add(&counters->latency_histogram[latency_bucket(latency)], 1);
+
+		task->function(task->arg);
+
+		counter_add(&counters->busy_ns, now_ns() - start);
+		counter_add(&counters->tasks_executed, 1);
+	} else {
+		task->function(task->arg);
 	}
-	return task;
+
+	task_finish(threadpool, task, pooled, group, joinable);
 }
 
-static struct CxTask *
-worker_wait_for_task(struct CxWorker *worker) {
-	struct CxTask *task = NULL;
+/**
+ * Calls the cancel function of a queued task instead of running it and marks
+ * it as done in the pool. If `detach` is set, only tasks queued by the library
+ * itself are cancelled, others are released without calling anything.
+ */
+static void
+task_cancel(struct CxThreadpool *threadpool, struct CxTask *task, bool detach) {
+	bool pooled = task->pooled;
+	struct CxTaskGroup *group = task->group;
+	bool joinable = atomic_load(&task->join_state) != TASK_DETACHED;
 
-	pthread_mutex_lock(&worker->queue_mutex);
+	if (task->cancel != NULL && (!detach || task->internal)) {
+		task->cancel(task->arg);
+	}
+	task_finish(threadpool, task, pooled, group, joinable);
+	task_done(threadpool);
+}
 
-	task = worker_get_task(worker);
-	if (task == NULL) {
-		while (task == NULL && atomic_load(&worker->pool->running)) {
-			pthread_cond_wait(&worker->queue_cond, &worker->queue_mutex);
-			task = worker_get_task(worker);
+/**
+ * Runs a queued task. `worker` is NULL if the task is run by a thread helping
+ * out while waiting.
+ */
+static void
+threadpool_run_task(
+		struct CxThreadpool *threadpool, struct CxWorker *worker,
+		struct CxTask *task) {
+	task_run(threadpool, worker, task);
+	task_done(threadpool);
+}
+
+/**
+ * Takes the tasks of all priorities from the inbox. Must be called with the
+ * queue mutex held.
+ */
+static bool
+worker_take_inbox(
+		struct CxWorker *worker, struct CxTask *tasks[CX_TASK_PRIORITY_COUNT]) {
+	bool found = false;
+	for (int i = 0; i < CX_TASK_PRIORITY_COUNT; i++) {
+		struct CxWorkerQueue *queue = &worker->queues[i];
+		tasks[i] = queue->head;
+		found |= queue->head != NULL;
+		queue->head = NULL;
+		queue->tail = NULL;
+	}
+	atomic_store(&worker->inbox_pending, false);
+	return found;
+}
+
+/**
+ * Returns true if the deque of any priority is empty, so that the inbox tasks
+ * of that priority can be adopted.
+ */
+static bool
+worker_has_empty_deque(struct CxWorker *worker) {
+	for (int i = 0; i < CX_TASK_PRIORITY_COUNT; i++) {
+		if (cx_work_deque_size(&worker->queues[i].deque) == 0) {
+			return true;
 		}
 	}
-	pthread_mutex_unlock(&worker->queue_mutex);
+	return false;
+}
 
-	return task;
+/**
+ * Takes the inbox tasks of the priorities whose deque is empty. The tasks of
+ * other priorities stay in the inbox until the deque is drained, so that newer
+ * tasks do not overtake older ones. Must be called with the queue mutex held.
+ */
+static bool
+worker_take_inbox_batch(
+		struct CxWorker *worker, struct CxTask *tasks[CX_TASK_PRIORITY_COUNT]) {
+	bool found = false;
+	bool pending = false;
+	for (int i = 0; i < CX_TASK_PRIORITY_COUNT; i++) {
+		struct CxWorkerQueue *queue = &worker->queues[i];
+		tasks[i] = NULL;
+		if (queue->head == NULL) {
+			continue;
+		} else if (cx_work_deque_size(&queue->deque) > 0) {
+			pending = true;
+			continue;
+		}
+		tasks[i] = queue->head;
+		found = true;
+		queue->head = NULL;
+		queue->tail = NULL;
+	}
+	atomic_store(&worker->inbox_pending, pending);
+	return found;
 }
 
-static void *
-worker_run(void *data) {
-	struct CxWorker *worker = data;
-	struct CxThreadpool *threadpool = worker->pool;
-	struct CxTask *task = NULL;
+static struct CxTask *
+task_list_reverse(struct CxTask *tasks) {
+	struct CxTask *reversed = NULL;
+	while (tasks != NULL) {
+		struct CxTask *next = tasks->next;
+		tasks->next = reversed;
+		reversed = tasks;
+		tasks = next;
+	}
+	return reversed;
+}
 
-	while (atomic_load(&threadpool->running)) {
-		task = worker_find_task(worker);
-		if (task == NULL) {
-			task = worker_wait_for_task(worker);
-		}
-		if (task != NULL) {
-			task->function(task->arg);
-			task_free(threadpool, task);
+static void
+worker_unpark(struct CxWorker *worker) {
+	atomic_fetch_add(&worker->wake_epoch, 1);
+	cx__futex_wake(&worker->wake_epoch, 1);
+}
 
-			pthread_mutex_lock(&threadpool->wait_mutex);
-			if (atomic_fetch_sub(&threadpool->active_tasks, 1) == 1) {
-				pthread_cond_signal(&threadpool->wait_cond);
-			}
-			pthread_mutex_unlock(&threadpool->wait_mutex);
+/**
+ * Wakes up the worker if it is parked. The worker announces itself in
+ * `parked` before it checks for work one last time, so a producer that
+ * published work before calling this either sees the announcement or the
+ * worker sees the work. Producers skip the syscall when nobody is parked.
+ */
+static void
+worker_notify(struct CxWorker *worker) {
+	// Orders the store that published the work before the load of `parked`.
+	// Pairs with the fence in worker_park.
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load(&worker->parked) == 0) {
+		return;
+	}
+	worker_unpark(worker);
+}
+
+/**
+ * Wakes up the next parked peer of the worker, so that it steals the work the
+ * worker just published. Busy peers are skipped, they look for work on their
+ * own once their current task finished.
+ */
+static void
+worker_wake_peer(struct CxWorker *worker) {
+	struct CxThreadpool *threadpool = worker->pool;
+	size_t capacity = threadpool->worker_capacity;
+	size_t worker_index = worker - threadpool->workers;
+
+	// Pairs with the fence in worker_park, see worker_notify.
+	atomic_thread_fence(memory_order_seq_cst);
+	for (size_t i = 1; i < capacity; i++) {
+		struct CxWorker *peer =
+				&threadpool->workers[(worker_index + i) % capacity];
+		if (atomic_load(&peer->state) == WORKER_RUNNING &&
+			atomic_load(&peer->parked) != 0) {
+			worker_unpark(peer);
+			return;
 		}
 	}
-	return 0;
 }
 
+/**
+ * Returns the priority the next dequeue starts with. Usually this is the
+ * highest priority, but every STARVATION_INTERVAL-th dequeue starts one level
+ * lower, every STARVATION_INTERVAL^2-th two levels lower, and so on.
+ */
 static int
-worker_cleanup(struct CxWorker *worker) {
-	pthread_mutex_lock(&worker->queue_mutex);
-	pthread_cond_signal(&worker->queue_cond);
-	pthread_mutex_unlock(&worker->queue_mutex);
+worker_first_priority(struct CxWorker *worker) {
+	size_t tick = ++worker->dequeue_tick;
+	int priority = 0;
 
-	pthread_join(worker->thread, NULL);
-	pthread_mutex_destroy(&worker->queue_mutex);
-	pthread_cond_destroy(&worker->queue_cond);
-	return 0;
+	while (priority < CX_TASK_PRIORITY_COUNT - 1 &&
+		   tick % STARVATION_INTERVAL == 0) {
+		tick /= STARVATION_INTERVAL;
+		priority++;
+	}
+	return priority;
 }
 
-static int
-worker_init(struct CxWorker *worker, struct CxThreadpool *threadpool) {
-	int rv = 0;
-	worker->pool = threadpool;
-	worker->head = NULL;
-	worker->tail = NULL;
-	atomic_init(&worker->queue_length, 0);
+static struct CxTask *
+worker_pop(struct CxWorker *worker) {
+	struct CxTask *task = NULL;
+	int first = worker_first_priority(worker);
 
-	rv = pthread_mutex_init(&worker->queue_mutex, NULL);
-	if (rv != 0) {
-		rv = -1;
-		goto out;
+	for (int i = 0; i < CX_TASK_PRIORITY_COUNT && task == NULL; i++) {
+		int priority = (first + i) % CX_TASK_PRIORITY_COUNT;
+		task = cx_work_deque_pop(&worker->queues[priority].deque);
 	}
-	rv = pthread_cond_init(&worker->queue_cond, NULL);
-	if (rv != 0) {
-		rv = -1;
-		goto out;
+	if (task != NULL) {
+		atomic_fetch_sub(&worker->queue_length, 1);
 	}
+	return task;
+}
 
-out:
-	if (rv < 0) {
-		worker_cleanup(worker);
+/**
+ * Puts a list of tasks back to the front of the inbox.
+ */
+static void
+worker_return_to_inbox(
+		struct CxWorker *worker, struct CxWorkerQueue *queue,
+		struct CxTask *tasks) {
+	pthread_mutex_lock(&worker->queue_mutex);
+	struct CxTask *tail = tasks;
+	while (tail->next != NULL) {
+		tail = tail->next;
 	}
-	return 0;
+	tail->next = queue->head;
+	if (queue->head == NULL) {
+		queue->tail = tail;
+	}
+	queue->head = tasks;
+	atomic_store(&worker->inbox_pending, true);
+	pthread_mutex_unlock(&worker->queue_mutex);
 }
 
-static int
-worker_start(struct CxWorker *worker) {
-	int rv = pthread_create(&worker->thread, NULL, worker_run, worker);
-	if (rv != 0) {
-		rv = -1;
-		goto out;
+/**
+ * Moves the tasks taken from the inbox to the empty deques of the worker, so
+ * that idle workers can steal them. The tasks are pushed newest first, so the
+ * owner pops them in the order they were scheduled.
+ */
+static void
+worker_adopt(
+		struct CxWorker *worker, struct CxTask *tasks[CX_TASK_PRIORITY_COUNT]) {
+	for (int i = 0; i < CX_TASK_PRIORITY_COUNT; i++) {
+		struct CxWorkerQueue *queue = &worker->queues[i];
+		struct CxTask *rest = task_list_reverse(tasks[i]);
+		while (rest != NULL) {
+			struct CxTask *next = rest->next;
+			if (cx_work_deque_push(&queue->deque, rest) < 0) {
+				break;
+			}
+			rest = next;
+		}
+		if (rest != NULL) {
+			// Out of memory while growing the deque, put the remaining
+			// tasks back into the inbox.
+			worker_return_to_inbox(worker, queue, task_list_reverse(rest));
+		}
 	}
-out:
-	return rv;
 }
 
-int
-cx_threadpool_init(struct CxThreadpool *threadpool, size_t worker_count) {
-	int rv = 0;
-	if (worker_count == 0) {
-		worker_count = cpu_count();
+static struct CxTask *
+worker_steal_from(struct CxWorker *victim, int priority) {
+	struct CxWorkerQueue *queue = &victim->queues[priority];
+	struct CxTask *task = cx_work_deque_steal(&queue->deque);
+	if (task == NULL && pthread_mutex_trylock(&victim->queue_mutex) == 0) {
+		task = queue->head;
+		if (task != NULL) {
+			queue->head = task->next;
+			if (queue->head == NULL) {
+				queue->tail = NULL;
+			}
+		}
+		pthread_mutex_unlock(&victim->queue_mutex);
 	}
+	if (task != NULL) {
+		atomic_fetch_sub(&victim->queue_length, 1);
+	}
+	return task;
+}
 
-	cx_prealloc_pool_init(&threadpool->task_pool, sizeof(struct CxTask));
-
-	threadpool->worker_count = worker_count;
-	atomic_init(&threadpool->active_tasks, 0);
-	atomic_init(&threadpool->running, true);
+static struct CxTask *
+worker_steal(struct CxWorker *worker) {
+	struct CxThreadpool *threadpool = worker->pool;
+	size_t victim_count = threadpool->worker_capacity - 1;
 
-	threadpool->workers = calloc(worker_count, sizeof(struct CxWorker));
-	if (threadpool->workers == NULL) {
-		rv = -1;
-		goto out;
+	// Take the highest priority task any worker has. The steal order lists
+	// workers on the same NUMA node first.
+	for (int priority = 0; priority < CX_TASK_PRIORITY_COUNT; priority++) {
+		for (size_t i = 0; i < victim_count; i++) {
+			struct CxWorker *victim =
+					&threadpool->workers[worker->steal_order[i]];
+			if (atomic_load(&victim->queue_length) == 0) {
+				continue;
+			}
+			struct CxTask *task = worker_steal_from(victim, priority);
+			counter_add(&worker->counters.steal_attempts, 1);
+			if (task == NULL) {
+				continue;
+			}
+			counter_add(&worker->counters.tasks_stolen, 1);
+			if (atomic_load(&victim->queue_length) > 0) {
+				worker_wake_peer(worker);
+			}
+			return task;
+		}
 	}
+	return NULL;
+}
 
-	for (size_t i = 0; i < worker_count; i++) {
-		struct CxWorker *worker = &threadpool->workers[i];
-		rv = worker_init(worker, threadpool);
-		if (rv < 0) {
-			goto out;
+/**
+ * Runs a single queued task on the calling thread.
+ */
+static bool
+threadpool_help(struct CxThreadpool *threadpool) {
+	struct CxTask *task = NULL;
+	size_t worker_count = threadpool->worker_capacity;
+	size_t start = atomic_fetch_add(&threadpool->help_index, 1);
+
+	for (int priority = 0; priority < CX_TASK_PRIORITY_COUNT && task == NULL;
+		 priority++) {
+		for (size_t i = 0; i < worker_count && task == NULL; i++) {
+			task = worker_steal_from(
+					&threadpool->workers[(start + i) % worker_count],
+					priority);
 		}
 	}
+	if (task == NULL) {
+		return false;
+	}
+	threadpool_run_task(threadpool, NULL, task);
+	return true;
+}
 
-	for (size_t i = 0; i < worker_count; i++) {
-		struct CxWorker *worker = &threadpool->workers[i];
-		rv = worker_start(worker);
-		if (rv != 0) {
-			rv = -1;
-			goto out;
+static struct CxTask *
+worker_find_task(struct CxWorker *worker) {
+	struct CxTask *task = NULL;
+	struct CxTask *tasks[CX_TASK_PRIORITY_COUNT];
+
+	// Drain the inbox first, it may hold tasks of a higher priority than the
+	// ones in the deques.
+	if (atomic_load(&worker->inbox_pending) && worker_has_empty_deque(worker)) {
+		pthread_mutex_lock(&worker->queue_mutex);
+		bool found = worker_take_inbox_batch(worker, tasks);
+		pthread_mutex_unlock(&worker->queue_mutex);
+		if (found) {
+			worker_adopt(worker, tasks);
 		}
 	}
 
-out:
-	if (rv < 0) {
-		cx_threadpool_cleanup(threadpool);
+	task = worker_pop(worker);
+	if (task != NULL) {
+		if (atomic_load(&worker->queue_length) > 0) {
+			worker_wake_peer(worker);
+		}
+		return task;
 	}
-	return 0;
+
+	// Only steal from others once the own queue is drained.
+	return worker_steal(worker);
 }
 
-int
-cx_threadpool_schedule(
-		struct CxThreadpool *threadpool, cx_threadpool_task_t function,
-		void *arg) {
-	int rv = 0;
+/**
+ * Returns the running worker with the shortest queue. If `numa_node` is not
+ * negative, workers on that node are preferred. Returns NULL if no worker is
+ * running.
+ */
+static struct CxWorker *
+threadpool_least_loaded_worker(struct CxThreadpool *threadpool, int numa_node) {
 	size_t min_queue_length = SIZE_MAX;
 	struct CxWorker *worker = NULL;
-	bool worker_locked = false;
-	struct CxTask *new_task = task_new(threadpool, function, arg);
-	if (new_task == NULL) {
-		goto out;
-	}
 
-	for (size_t i = 0; i < threadpool->worker_count; ++i) {
+	for (size_t i = 0; i < threadpool->worker_capacity; ++i) {
 		struct CxWorker *candidate = &threadpool->workers[i];
+		if (atomic_load(&candidate->state) != WORKER_RUNNING) {
+			continue;
+		} else if (numa_node >= 0 && candidate->numa_node != numa_node) {
+			continue;
+		}
 		size_t queue_length = atomic_load(&candidate->queue_length);
 		if (queue_length < min_queue_length) {
 			worker = candidate;
@@ -251,58 +579,1215 @@ cx_threadpool_schedule(
 		}
 	}
 
-	if (worker == NULL) {
-		__builtin_unreachable();
+	if (worker == NULL && numa_node >= 0) {
+		// No worker on this node.
+		return threadpool_least_loaded_worker(threadpool, -1);
 	}
+	return worker;
+}
 
-	rv = pthread_mutex_lock(&worker->queue_mutex);
+/**
+ * Appends a linked list of tasks to the inbox of a worker and wakes it up.
+ * All tasks in the list must have the same priority. Returns 1 if the worker
+ * is retiring and does not take new tasks.
+ */
+static int
+worker_push_tasks(
+		struct CxWorker *worker, struct CxTask *head, struct CxTask *tail,
+		size_t count) {
+	struct CxWorkerQueue *queue = &worker->queues[head->priority];
+	int rv = pthread_mutex_lock(&worker->queue_mutex);
 	if (rv != 0) {
-		rv = -1;
-		goto out;
+		return -1;
+	}
+	if (atomic_load(&worker->state) != WORKER_RUNNING) {
+		pthread_mutex_unlock(&worker->queue_mutex);
+		return 1;
 	}
-	worker_locked = true;
 
-	if (worker->tail != NULL) {
-		worker->tail->next = new_task;
+	tail->next = NULL;
+	if (queue->tail != NULL) {
+		queue->tail->next = head;
 	} else {
-		worker->head = new_task;
+		queue->head = head;
 	}
-	worker->tail = new_task;
+	queue->tail = tail;
 
-	atomic_fetch_add(&threadpool->active_tasks, 1);
-	atomic_fetch_add(&worker->queue_length, 1);
-	pthread_cond_signal(&worker->queue_cond);
+	size_t queue_length = atomic_fetch_add(&worker->queue_length, count);
+	counter_max(&worker->counters.max_queue_depth, queue_length + count);
+	atomic_store(&worker->inbox_pending, true);
 
-out:
-	if (worker_locked) {
-		pthread_mutex_unlock(&worker->queue_mutex);
-	}
+	pthread_mutex_unlock(&worker->queue_mutex);
+	worker_notify(worker);
+	return 0;
+}
 
-	if (rv < 0) {
-		task_free(threadpool, new_task);
+/**
+ * Appends a linked list of tasks to the least loaded running worker.
+ */
+static int
+threadpool_push_tasks(
+		struct CxThreadpool *threadpool, int numa_node, struct CxTask *head,
+		struct CxTask *tail, size_t count) {
+	int rv = 0;
+	do {
+		struct CxWorker *worker =
+				threadpool_least_loaded_worker(threadpool, numa_node);
+		if (worker == NULL) {
+			return -1;
+		}
+		rv = worker_push_tasks(worker, head, tail, count);
+	} while (rv > 0);
+	return rv;
+}
+
+static void
+worker_hand_off_task(struct CxWorker *worker, struct CxTask *task) {
+	struct CxThreadpool *threadpool = worker->pool;
+
+	atomic_fetch_sub(&worker->queue_length, 1);
+	task->next = NULL;
+	if (threadpool_push_tasks(threadpool, -1, task, task, 1) < 0) {
+		threadpool_run_task(threadpool, worker, task);
 	}
-	return 0;
 }
 
-int
-cx_threadpool_wait(struct CxThreadpool *threadpool) {
-	pthread_mutex_lock(&threadpool->wait_mutex);
-	while (atomic_load(&threadpool->active_tasks) > 0) {
-		pthread_cond_wait(&threadpool->wait_cond, &threadpool->wait_mutex);
+/**
+ * Moves the tasks of a retiring worker to the running workers.
+ */
+static void
+worker_hand_off(struct CxWorker *worker) {
+	struct CxTask *tasks[CX_TASK_PRIORITY_COUNT];
+	struct CxTask *task = NULL;
+
+	pthread_mutex_lock(&worker->queue_mutex);
+	worker_take_inbox(worker, tasks);
+	pthread_mutex_unlock(&worker->queue_mutex);
+
+	for (int i = 0; i < CX_TASK_PRIORITY_COUNT; i++) {
+		while ((task = cx_work_deque_pop(&worker->queues[i].deque)) != NULL) {
+			worker_hand_off_task(worker, task);
+		}
+		while (tasks[i] != NULL) {
+			task = tasks[i];
+			tasks[i] = task->next;
+			worker_hand_off_task(worker, task);
+		}
 	}
-	pthread_mutex_unlock(&threadpool->wait_mutex);
-	return 0;
 }
 
-int
-cx_threadpool_cleanup(struct CxThreadpool *threadpool) {
-	atomic_store(&threadpool->running, false);
-	for (size_t i = 0; i < threadpool->worker_count; i++) {
-		struct CxWorker *worker = &threadpool->workers[i];
-		worker_cleanup(worker);
+static long
+elapsed_ns(const struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000000L +
+			(now.tv_nsec - start->tv_nsec);
+}
+
+/**
+ * Polls for work until `duration_ns` passed, either with pause instructions
+ * or by yielding the CPU.
+ */
+static struct CxTask *
+worker_poll(struct CxWorker *worker, long duration_ns, bool yield) {
+	struct CxTask *task = NULL;
+	struct timespec start;
+
+	if (duration_ns <= 0) {
+		return NULL;
 	}
-	free(threadpool->workers);
-	cx_prealloc_pool_cleanup(&threadpool->task_pool);
 
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (size_t i = 1; atomic_load(&worker->pool->running); i++) {
+		task = worker_find_task(worker);
+		if (task != NULL) {
+			return task;
+		}
+		if (yield) {
+			sched_yield();
+		} else {
+			cx__cpu_relax();
+		}
+		if (i % IDLE_CLOCK_INTERVAL == 0 && elapsed_ns(&start) >= duration_ns) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Parks the worker until it is notified or `deadline` passed. Returns a task
+ * if one showed up while parking, sets `timed_out` if the deadline passed.
+ */
+static struct CxTask *
+worker_park(
+		struct CxWorker *worker, const struct timespec *deadline,
+		bool *timed_out) {
+	struct CxTask *task = NULL;
+	uint32_t epoch = 0;
+
+	atomic_store(&worker->parked, 1);
+	atomic_thread_fence(memory_order_seq_cst);
+	epoch = atomic_load(&worker->wake_epoch);
+	// Check again after announcing, work published before now is seen here,
+	// work published after now bumps the epoch.
+	task = worker_find_task(worker);
+	if (task == NULL && atomic_load(&worker->pool->running)) {
+		uint64_t start = now_ns();
+		*timed_out = cx__futex_wait(&worker->wake_epoch, epoch, deadline) ==
+				-ETIMEDOUT;
+		counter_add(&worker->counters.parked_ns, now_ns() - start);
+	}
+	atomic_store(&worker->parked, 0);
+
+	return task;
+}
+
+/**
+ * Returns true if more workers are available than the pool should have.
+ * Workers blocked in a task do not count as available.
+ */
+static bool
+threadpool_has_excess_workers(struct CxThreadpool *threadpool) {
+	return atomic_load(&threadpool->worker_count) >
+			atomic_load(&threadpool->target_worker_count) +
+			atomic_load(&threadpool->blocked_count);
+}
+
+/**
+ * Marks an excess worker as retiring, so that no new tasks are pushed to it.
+ */
+static bool
+worker_try_retire(struct CxWorker *worker) {
+	struct CxThreadpool *threadpool = worker->pool;
+	bool retire = false;
+
+	pthread_mutex_lock(&threadpool->resize_mutex);
+	if (threadpool_has_excess_workers(threadpool)) {
+		// Producers check the state with the queue mutex held.
+		pthread_mutex_lock(&worker->queue_mutex);
+		atomic_store(&worker->state, WORKER_RETIRING);
+		pthread_mutex_unlock(&worker->queue_mutex);
+		atomic_fetch_sub(&threadpool->worker_count, 1);
+		retire = true;
+	}
+	pthread_mutex_unlock(&threadpool->resize_mutex);
+
+	return retire;
+}
+
+static struct CxTask *
+worker_wait_for_task(struct CxWorker *worker) {
+	struct CxThreadpool *threadpool = worker->pool;
+	struct CxTask *task = NULL;
+	struct timespec deadline;
+	bool excess = false;
+	bool timed_out = false;
+
+	task = worker_poll(worker, threadpool->idle_spin_ns, false);
+	if (task == NULL) {
+		task = worker_poll(worker, threadpool->idle_yield_ns, true);
+	}
+	if (task != NULL) {
+		return task;
+	}
+
+	excess = threadpool_has_excess_workers(threadpool);
+	if (excess) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += threadpool->idle_timeout_ns / 1000000000L;
+		deadline.tv_nsec += threadpool->idle_timeout_ns % 1000000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+	task = worker_park(worker, excess ? &deadline : NULL, &timed_out);
+	if (task == NULL && timed_out) {
+		worker_try_retire(worker);
+	}
+	return task;
+}
+
+static void *
+worker_run(void *data) {
+	struct CxWorker *worker = data;
+	struct CxThreadpool *threadpool = worker->pool;
+	struct CxTask *task = NULL;
+
+	current_worker = worker;
+	while (atomic_load(&threadpool->running) &&
+		   atomic_load(&worker->state) == WORKER_RUNNING) {
+		task = worker_find_task(worker);
+		if (task == NULL) {
+			task = worker_wait_for_task(worker);
+		}
+		if (task != NULL) {
+			threadpool_run_task(threadpool, worker, task);
+		}
+	}
+	if (atomic_load(&worker->state) == WORKER_RETIRING) {
+		worker_hand_off(worker);
+	}
+	return 0;
+}
+
+/**
+ * Joins the thread of a worker that is stopping or has retired. Must be
+ * called with the resize mutex held.
+ */
+static void
+worker_join(struct CxWorker *worker) {
+	if (worker->joinable) {
+		worker_notify(worker);
+		pthread_join(worker->thread, NULL);
+		worker->joinable = false;
+	}
+	atomic_store(&worker->state, WORKER_STOPPED);
+}
+
+/**
+ * Cancels the tasks left in the queues of a stopped worker.
+ */
+static void
+worker_cancel_tasks(struct CxWorker *worker, bool detach) {
+	struct CxThreadpool *threadpool = worker->pool;
+	struct CxTask *tasks[CX_TASK_PRIORITY_COUNT];
+	struct CxTask *task = NULL;
+
+	pthread_mutex_lock(&worker->queue_mutex);
+	worker_take_inbox(worker, tasks);
+	pthread_mutex_unlock(&worker->queue_mutex);
+
+	for (int i = 0; i < CX_TASK_PRIORITY_COUNT; i++) {
+		while ((task = cx_work_deque_pop(&worker->queues[i].deque)) != NULL) {
+			task_cancel(threadpool, task, detach);
+		}
+		while (tasks[i] != NULL) {
+			task = tasks[i];
+			tasks[i] = task->next;
+			task_cancel(threadpool, task, detach);
+		}
+	}
+	atomic_store(&worker->queue_length, 0);
+}
+
+static void
+worker_cleanup_queues(struct CxWorker *worker, int count) {
+	for (int i = 0; i < count; i++) {
+		cx_work_deque_cleanup(&worker->queues[i].deque);
+	}
+}
+
+static int
+worker_cleanup(struct CxWorker *worker) {
+	pthread_mutex_destroy(&worker->queue_mutex);
+	worker_cleanup_queues(worker, CX_TASK_PRIORITY_COUNT);
+	free(worker->steal_order);
+	worker->steal_order = NULL;
+	return 0;
+}
+
+static int
+worker_init(struct CxWorker *worker, struct CxThreadpool *threadpool) {
+	int rv = 0;
+	int queues = 0;
+	worker->joinable = false;
+	atomic_init(&worker->state, WORKER_STOPPED);
+	worker->pool = threadpool;
+	worker->cpu = -1;
+	worker->numa_node = -1;
+	worker->dequeue_tick = 0;
+	atomic_init(&worker->queue_length, 0);
+	atomic_init(&worker->inbox_pending, false);
+	atomic_init(&worker->wake_epoch, 0);
+	atomic_init(&worker->parked, 0);
+	worker->counters = (struct CxWorkerCounters){0};
+
+	for (; queues < CX_TASK_PRIORITY_COUNT; queues++) {
+		struct CxWorkerQueue *queue = &worker->queues[queues];
+		queue->head = NULL;
+		queue->tail = NULL;
+		rv = cx_work_deque_init(&queue->deque);
+		if (rv < 0) {
+			rv = -1;
+			goto free_queues;
+		}
+	}
+	worker->steal_order =
+			calloc(CX_MAX(threadpool->worker_capacity, 1), sizeof(size_t));
+	if (worker->steal_order == NULL) {
+		rv = -1;
+		goto free_queues;
+	}
+	rv = pthread_mutex_init(&worker->queue_mutex, NULL);
+	if (rv != 0) {
+		rv = -1;
+		goto free_steal_order;
+	}
+
+	return 0;
+
+free_steal_order:
+	free(worker->steal_order);
+free_queues:
+	worker_cleanup_queues(worker, queues);
+	return rv;
+}
+
+static void
+worker_init_steal_order(struct CxWorker *worker) {
+	struct CxThreadpool *threadpool = worker->pool;
+	size_t worker_count = threadpool->worker_capacity;
+	size_t worker_index = worker - threadpool->workers;
+	size_t n = 0;
+
+	for (int local = 1; local >= 0; local--) {
+		for (size_t i = 1; i < worker_count; i++) {
+			size_t index = (worker_index + i) % worker_count;
+			bool is_local =
+					threadpool->workers[index].numa_node == worker->numa_node;
+			if (is_local == local) {
+				worker->steal_order[n++] = index;
+			}
+		}
+	}
+	assert(n == worker_count - 1);
+}
+
+static void
+worker_place(
+		struct CxWorker *worker, const struct CxThreadpoolOptions *options,
+		const int *nodes, size_t node_count) {
+	size_t worker_index = worker - worker->pool->workers;
+
+	if (options->cpus != NULL && options->cpu_count > 0) {
+		worker->cpu = options->cpus[worker_index % options->cpu_count];
+		worker->numa_node = cx__numa_node_of_cpu(worker->cpu);
+	} else if (options->numa_nodes != NULL && options->numa_node_count > 0) {
+		worker->numa_node =
+				options->numa_nodes[worker_index % options->numa_node_count];
+	} else if (options->numa_aware) {
+		worker->numa_node = nodes[worker_index % node_count];
+	}
+}
+
+static int
+worker_start(struct CxWorker *worker) {
+	int rv = 0;
+	pthread_attr_t attr;
+	rv = pthread_attr_init(&attr);
+	if (rv != 0) {
+		return -1;
+	}
+
+	if (worker->cpu >= 0) {
+		rv = cx__pin_attr_to_cpu(&attr, worker->cpu);
+	} else if (worker->numa_node >= 0) {
+		rv = cx__pin_attr_to_node(&attr, worker->numa_node);
+	}
+	if (rv < 0) {
+		goto out;
+	}
+
+	rv = pthread_create(&worker->thread, &attr, worker_run, worker);
+	if (rv != 0) {
+		rv = -1;
+		goto out;
+	}
+	worker->joinable = true;
+out:
+	pthread_attr_destroy(&attr);
+	return rv;
+}
+
+int
+cx_threadpool_init(struct CxThreadpool *threadpool, size_t worker_count) {
+	struct CxThreadpoolOptions options = {.worker_count = worker_count};
+	return cx_threadpool_init2(threadpool, &options);
+}
+
+/**
+ * Starts a worker in a free slot. Must be called with the resize mutex held.
+ */
+static int
+threadpool_spawn_worker(struct CxThreadpool *threadpool) {
+	int rv = 0;
+
+	for (size_t i = 0; i < threadpool->worker_capacity; i++) {
+		struct CxWorker *worker = &threadpool->workers[i];
+		if (atomic_load(&worker->state) == WORKER_RUNNING) {
+			continue;
+		}
+		// A retired worker may still be handing off its tasks.
+		worker_join(worker);
+
+		atomic_store(&worker->state, WORKER_RUNNING);
+		atomic_fetch_add(&threadpool->worker_count, 1);
+		rv = worker_start(worker);
+		if (rv < 0) {
+			atomic_store(&worker->state, WORKER_STOPPED);
+			atomic_fetch_sub(&threadpool->worker_count, 1);
+		}
+		return rv;
+	}
+	return -1;
+}
+
+int
+cx_threadpool_init2(
+		struct CxThreadpool *threadpool,
+		const struct CxThreadpoolOptions *options) {
+	int rv = 0;
+	int nodes[MAX_NUMA_NODES];
+	size_t node_count = 0;
+	size_t initialized = 0;
+	size_t worker_count = options->worker_count;
+	if (worker_count == 0 && options->cpus != NULL) {
+		worker_count = options->cpu_count;
+	}
+	if (worker_count == 0) {
+		worker_count = cpu_count();
+	}
+	size_t capacity = CX_MAX(worker_count, options->max_worker_count);
+	if (options->numa_aware) {
+		node_count = cx__numa_nodes(nodes, MAX_NUMA_NODES);
+	}
+
+	rv = cx_concurrent_pool_init(&threadpool->task_pool, sizeof(struct CxTask));
+	if (rv < 0) {
+		return rv;
+	}
+
+	threadpool->worker_capacity = capacity;
+	atomic_init(&threadpool->worker_count, 0);
+	atomic_init(&threadpool->target_worker_count, worker_count);
+	atomic_init(&threadpool->blocked_count, 0);
+	atomic_init(&threadpool->active_tasks, 0);
+	atomic_init(&threadpool->help_index, 0);
+	atomic_init(&threadpool->running, true);
+	threadpool->idle_spin_ns = options->idle_spin_ns == 0
+			? DEFAULT_IDLE_SPIN_NS
+			: options->idle_spin_ns;
+	threadpool->idle_yield_ns = options->idle_yield_ns == 0
+			? DEFAULT_IDLE_YIELD_NS
+			: options->idle_yield_ns;
+	threadpool->idle_timeout_ns = options->idle_timeout_ns <= 0
+			? DEFAULT_IDLE_TIMEOUT_NS
+			: options->idle_timeout_ns;
+	threadpool->queue_capacity = CX_MIN(options->queue_capacity, UINT32_MAX);
+	threadpool->overflow = options->overflow;
+	cx_semaphore_init(&threadpool->queue_slots, threadpool->queue_capacity);
+
+	rv = pthread_mutex_init(&threadpool->resize_mutex, NULL);
+	if (rv != 0) {
+		rv = -1;
+		goto free_task_pool;
+	}
+	rv = pthread_mutex_init(&threadpool->wait_mutex, NULL);
+	if (rv != 0) {
+		rv = -1;
+		goto destroy_resize_mutex;
+	}
+	rv = pthread_cond_init(&threadpool->wait_cond, NULL);
+	if (rv != 0) {
+		rv = -1;
+		goto destroy_wait_mutex;
+	}
+	rv = cx__timer_queue_init(&threadpool->timers);
+	if (rv < 0) {
+		goto destroy_wait_cond;
+	}
+
+	// All slots are set up front, so that workers can be added and removed
+	// without moving the array that other workers steal from.
+	threadpool->workers = calloc(capacity, sizeof(struct CxWorker));
+	if (threadpool->workers == NULL) {
+		rv = -1;
+		goto cleanup_timers;
+	}
+	for (; initialized < capacity; initialized++) {
+		struct CxWorker *worker = &threadpool->workers[initialized];
+		rv = worker_init(worker, threadpool);
+		if (rv < 0) {
+			goto cleanup_workers;
+		}
+		worker_place(worker, options, nodes, node_count);
+	}
+	for (size_t i = 0; i < capacity; i++) {
+		worker_init_steal_order(&threadpool->workers[i]);
+	}
+
+	pthread_mutex_lock(&threadpool->resize_mutex);
+	for (size_t i = 0; i < worker_count && rv == 0; i++) {
+		rv = threadpool_spawn_worker(threadpool);
+	}
+	pthread_mutex_unlock(&threadpool->resize_mutex);
+	if (rv < 0) {
+		goto cleanup_workers;
+	}
+
+	return 0;
+
+cleanup_workers:
+	atomic_store(&threadpool->running, false);
+	for (size_t i = 0; i < initialized; i++) {
+		worker_join(&threadpool->workers[i]);
+	}
+	for (size_t i = 0; i < initialized; i++) {
+		worker_cleanup(&threadpool->workers[i]);
+	}
+	free(threadpool->workers);
+	threadpool->workers = NULL;
+cleanup_timers:
+	cx__timer_queue_cleanup(&threadpool->timers);
+destroy_wait_cond:
+	pthread_cond_destroy(&threadpool->wait_cond);
+destroy_wait_mutex:
+	pthread_mutex_destroy(&threadpool->wait_mutex);
+destroy_resize_mutex:
+	pthread_mutex_destroy(&threadpool->resize_mutex);
+free_task_pool:
+	cx_concurrent_pool_cleanup(&threadpool->task_pool);
+	return rv;
+}
+
+int
+cx_threadpool_resize(struct CxThreadpool *threadpool, size_t worker_count) {
+	int rv = 0;
+	worker_count = CX_MAX(worker_count, 1);
+	worker_count = CX_MIN(worker_count, threadpool->worker_capacity);
+
+	pthread_mutex_lock(&threadpool->resize_mutex);
+	atomic_store(&threadpool->target_worker_count, worker_count);
+	while (rv == 0 && atomic_load(&threadpool->worker_count) < worker_count) {
+		rv = threadpool_spawn_worker(threadpool);
+	}
+	pthread_mutex_unlock(&threadpool->resize_mutex);
+
+	// Parked workers only notice that they are in excess once they wake up.
+	for (size_t i = 0; i < threadpool->worker_capacity; i++) {
+		worker_notify(&threadpool->workers[i]);
+	}
+	return rv;
+}
+
+size_t
+cx_threadpool_worker_count(struct CxThreadpool *threadpool) {
+	return atomic_load(&threadpool->worker_count);
+}
+
+size_t
+cx_threadpool_stats(
+		struct CxThreadpool *threadpool, struct CxWorkerStats *stats,
+		size_t count) {
+	count = CX_MIN(count, threadpool->worker_capacity);
+	for (size_t i = 0; i < count; i++) {
+		struct CxWorkerCounters *counters = &threadpool->workers[i].counters;
+		stats[i].tasks_executed = atomic_load_explicit(
+				&counters->tasks_executed, memory_order_relaxed);
+		stats[i].tasks_stolen = atomic_load_explicit(
+				&counters->tasks_stolen, memory_order_relaxed);
+		stats[i].steal_attempts = atomic_load_explicit(
+				&counters->steal_attempts, memory_order_relaxed);
+		stats[i].parked_ns = atomic_load_explicit(
+				&counters->parked_ns, memory_order_relaxed);
+		stats[i].busy_ns = atomic_load_explicit(
+				&counters->busy_ns, memory_order_relaxed);
+		stats[i].max_queue_depth = atomic_load_explicit(
+				&counters->max_queue_depth, memory_order_relaxed);
+		for (size_t j = 0; j < CX_THREADPOOL_LATENCY_BUCKETS; j++) {
+			stats[i].latency_histogram[j] = atomic_load_explicit(
+					&counters->latency_histogram[j], memory_order_relaxed);
+		}
+	}
+	return threadpool->worker_capacity;
+}
+
+void
+cx_threadpool_blocking_begin(struct CxThreadpool *threadpool) {
+	atomic_fetch_add(&threadpool->blocked_count, 1);
+	if (threadpool_has_excess_workers(threadpool) ||
+		atomic_load(&threadpool->worker_count) >=
+				threadpool->worker_capacity) {
+		return;
+	}
+
+	pthread_mutex_lock(&threadpool->resize_mutex);
+	size_t available = atomic_load(&threadpool->worker_count) -
+			CX_MIN(atomic_load(&threadpool->blocked_count),
+				   atomic_load(&threadpool->worker_count));
+	if (available < atomic_load(&threadpool->target_worker_count)) {
+		// Failing to start a spare only costs parallelism.
+		threadpool_spawn_worker(threadpool);
+	}
+	pthread_mutex_unlock(&threadpool->resize_mutex);
+}
+
+void
+cx_threadpool_blocking_end(struct CxThreadpool *threadpool) {
+	atomic_fetch_sub(&threadpool->blocked_count, 1);
+}
+
+void
+cx_task_init(struct CxTask *task, cx_threadpool_task_t function, void *arg) {
+	task->function = function;
+	task->arg = arg;
+	task->next = NULL;
+	task->group = NULL;
+	task->priority = CX_TASK_PRIORITY_NORMAL;
+	task->pooled = false;
+	task->enqueue_time_ns = 0;
+	task->threadpool = NULL;
+	atomic_init(&task->join_state, TASK_DETACHED);
+	task->cancel = NULL;
+	task->internal = false;
+}
+
+void
+cx__task_set_internal(struct CxTask *task) {
+	task->internal = true;
+}
+
+void
+cx_task_set_priority(struct CxTask *task, enum CxTaskPriority priority) {
+	task->priority = priority;
+}
+
+void
+cx_task_set_cancel(struct CxTask *task, cx_threadpool_task_t cancel) {
+	task->cancel = cancel;
+}
+
+/**
+ * Takes a queue slot for a new task without blocking. Returns 0 if the task
+ * may be queued, 1 if the caller should run it instead, or -CX_ERR_WOULD_BLOCK
+ * if the pool is full.
+ */
+static int
+threadpool_try_admit(struct CxThreadpool *threadpool) {
+	if (threadpool->queue_capacity == 0 ||
+		cx_semaphore_try_wait(&threadpool->queue_slots) == 0) {
+		return 0;
+	} else if (threadpool->overflow == CX_THREADPOOL_OVERFLOW_CALLER_RUNS) {
+		return 1;
+	} else {
+		return -CX_ERR_WOULD_BLOCK;
+	}
+}
+
+/**
+ * Reserves queue slots for `count` tasks. Either all slots are reserved or
+ * none.
+ */
+static int
+threadpool_try_admit_all(struct CxThreadpool *threadpool, size_t count) {
+	if (threadpool->queue_capacity == 0) {
+		return 0;
+	}
+	for (size_t i = 0; i < count; i++) {
+		if (cx_semaphore_try_wait(&threadpool->queue_slots) < 0) {
+			while (i-- > 0) {
+				cx_semaphore_post(&threadpool->queue_slots);
+			}
+			return -CX_ERR_WOULD_BLOCK;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Like threadpool_try_admit, but waits for a queue slot if the overflow
+ * policy says so. The caller runs queued tasks while waiting, so that a full
+ * pool makes progress even if all workers are scheduling tasks themselves.
+ */
+static int
+threadpool_admit(struct CxThreadpool *threadpool) {
+	int rv = threadpool_try_admit(threadpool);
+	if (rv != -CX_ERR_WOULD_BLOCK ||
+		threadpool->overflow != CX_THREADPOOL_OVERFLOW_BLOCK) {
+		return rv;
+	}
+
+	while (cx_semaphore_try_wait(&threadpool->queue_slots) < 0) {
+		if (threadpool_help(threadpool)) {
+			continue;
+		}
+		struct timespec timeout = {.tv_nsec = HELP_POLL_INTERVAL_NS};
+		if (cx_semaphore_wait_timeout(&threadpool->queue_slots, &timeout) ==
+			0) {
+			break;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Pushes a task to the deque of the current worker if the current thread is a
+ * worker of the pool. This avoids the scan for the least loaded worker and the
+ * lock of its inbox.
+ */
+static bool
+worker_push_local(struct CxThreadpool *threadpool, struct CxTask *task) {
+	struct CxWorker *worker = current_worker;
+	if (worker == NULL || worker->pool != threadpool ||
+		atomic_load(&worker->state) != WORKER_RUNNING) {
+		return false;
+	}
+
+	struct CxWorkerQueue *queue = &worker->queues[task->priority];
+	if (cx_work_deque_push(&queue->deque, task) < 0) {
+		return false;
+	}
+	size_t queue_length = atomic_fetch_add(&worker->queue_length, 1);
+	counter_max(&worker->counters.max_queue_depth, queue_length + 1);
+	worker_wake_peer(worker);
+	return true;
+}
+
+int
+cx_threadpool_schedule_task_on_node(
+		struct CxThreadpool *threadpool, int numa_node, struct CxTask *task) {
+	int rv = threadpool_admit(threadpool);
+	if (rv < 0) {
+		return rv;
+	} else if (rv > 0) {
+		task_run(threadpool, NULL, task);
+		return 0;
+	}
+
+	task->enqueue_time_ns = now_ns();
+	atomic_fetch_add(&threadpool->active_tasks, 1);
+	if (numa_node < 0 && worker_push_local(threadpool, task)) {
+		return 0;
+	}
+	rv = threadpool_push_tasks(threadpool, numa_node, task, task, 1);
+	if (rv < 0) {
+		task_done(threadpool);
+	}
+	return rv;
+}
+
+int
+cx_threadpool_schedule_task(
+		struct CxThreadpool *threadpool, struct CxTask *task) {
+	return cx_threadpool_schedule_task_on_node(threadpool, -1, task);
+}
+
+int
+cx_threadpool_schedule_on_node(
+		struct CxThreadpool *threadpool, int numa_node,
+		cx_threadpool_task_t function, void *arg) {
+	int rv = 0;
+	struct CxTask *new_task = task_new(threadpool, function, arg);
+	if (new_task == NULL) {
+		rv = -1;
+		goto out;
+	}
+
+	rv = cx_threadpool_schedule_task_on_node(threadpool, numa_node, new_task);
+	if (rv < 0) {
+		task_free(threadpool, new_task);
+	}
+
+out:
+	return rv;
+}
+
+int
+cx_threadpool_schedule(
+		struct CxThreadpool *threadpool, cx_threadpool_task_t function,
+		void *arg) {
+	return cx_threadpool_schedule_on_node(threadpool, -1, function, arg);
+}
+
+int
+cx_threadpool_schedule_priority(
+		struct CxThreadpool *threadpool, enum CxTaskPriority priority,
+		cx_threadpool_task_t function, void *arg) {
+	int rv = 0;
+	struct CxTask *new_task = task_new(threadpool, function, arg);
+	if (new_task == NULL) {
+		return -1;
+	}
+	new_task->priority = priority;
+
+	rv = cx_threadpool_schedule_task(threadpool, new_task);
+	if (rv < 0) {
+		task_free(threadpool, new_task);
+	}
+	return rv;
+}
+
+/**
+ * Schedules a linked list of tasks that were admitted to the pool.
+ */
+static int
+threadpool_push_batch(
+		struct CxThreadpool *threadpool, struct CxTask *tasks, size_t count) {
+	int rv = 0;
+
+	if (count == 0) {
+		return 0;
+	}
+
+	// Split the tasks into one contiguous slice per worker. Each slice goes to
+	// the least loaded worker at that time.
+	size_t worker_count =
+			CX_MIN(CX_MAX(atomic_load(&threadpool->worker_count), 1), count);
+
+	atomic_fetch_add(&threadpool->active_tasks, count);
+	for (size_t i = 0; i < worker_count; i++) {
+		size_t slice_count = count / worker_count + (i < count % worker_count);
+		struct CxTask *head = tasks;
+		struct CxTask *tail = head;
+		for (size_t j = 1; j < slice_count; j++) {
+			tail = tail->next;
+		}
+		tasks = tail->next;
+		tail->next = NULL;
+
+		if (threadpool_push_tasks(threadpool, -1, head, tail, slice_count) <
+			0) {
+			// Pushing only fails on corrupted state or while shutting
+			// down, run the slice inline so that the counters stay
+			// consistent.
+			for (struct CxTask *task = head; task != NULL;) {
+				struct CxTask *next = task->next;
+				threadpool_run_task(threadpool, NULL, task);
+				task = next;
+			}
+			rv = -1;
+		}
+	}
+
+	return rv;
+}
+
+int
+cx_threadpool_schedule_batch(
+		struct CxThreadpool *threadpool, cx_threadpool_task_t function,
+		void **args, size_t count) {
+	int rv = 0;
+	struct CxTask *tasks = NULL;
+	size_t allocated = 0;
+	bool reserved = false;
+
+	if (count == 0) {
+		return 0;
+	}
+
+	uint64_t enqueue_time_ns = now_ns();
+	for (; allocated < count; allocated++) {
+		struct CxTask *task = cx_concurrent_pool_get(&threadpool->task_pool);
+		if (task == NULL) {
+			break;
+		}
+		cx_task_init(task, function, args[count - allocated - 1]);
+		task->pooled = true;
+		task->enqueue_time_ns = enqueue_time_ns;
+		task->next = tasks;
+		tasks = task;
+	}
+	if (allocated < count) {
+		rv = -1;
+		goto out;
+	}
+	if (threadpool->overflow == CX_THREADPOOL_OVERFLOW_FAIL) {
+		// Either all tasks fit into the pool or none is scheduled, so that
+		// the caller knows which arguments were taken.
+		rv = threadpool_try_admit_all(threadpool, count);
+		if (rv < 0) {
+			goto out;
+		}
+		reserved = true;
+	}
+
+	struct CxTask *admitted = NULL;
+	struct CxTask **admitted_tail = &admitted;
+	size_t admitted_count = 0;
+	while (tasks != NULL) {
+		struct CxTask *task = tasks;
+		int admit = reserved ? 0 : threadpool_try_admit(threadpool);
+		if (admit == -CX_ERR_WOULD_BLOCK &&
+			threadpool->overflow == CX_THREADPOOL_OVERFLOW_BLOCK) {
+			// Queue what is admitted so far before waiting, the pool may be
+			// waiting for exactly these tasks.
+			threadpool_push_batch(threadpool, admitted, admitted_count);
+			admitted = NULL;
+			admitted_tail = &admitted;
+			admitted_count = 0;
+			admit = threadpool_admit(threadpool);
+		}
+		assert(admit >= 0);
+
+		tasks = task->next;
+		task->next = NULL;
+		if (admit > 0) {
+			task_run(threadpool, NULL, task);
+		} else {
+			*admitted_tail = task;
+			admitted_tail = &task->next;
+			admitted_count++;
+		}
+	}
+	// Tasks that cannot be pushed are run inline, so all of them are taken.
+	threadpool_push_batch(threadpool, admitted, admitted_count);
+
+out:
+	while (tasks != NULL) {
+		struct CxTask *next = tasks->next;
+		task_free(threadpool, tasks);
+		tasks = next;
+	}
+	return rv;
+}
+
+int
+cx_task_fork(struct CxThreadpool *threadpool, struct CxTask *task) {
+	int rv = 0;
+
+	task->threadpool = threadpool;
+	atomic_store(&task->join_state, TASK_FORKED);
+	rv = cx_threadpool_schedule_task(threadpool, task);
+	if (rv < 0) {
+		atomic_store(&task->join_state, TASK_DETACHED);
+	}
+	return rv;
+}
+
+int
+cx_task_join(struct CxTask *task) {
+	struct CxThreadpool *threadpool = task->threadpool;
+	struct CxWorker *worker = current_worker;
+	uint32_t state = atomic_load(&task->join_state);
+
+	if (state == TASK_DETACHED) {
+		// Not forked, cx_task_fork failed or the task was joined before.
+		// Nothing is going to run it.
+		return -1;
+	}
+	if (worker != NULL && worker->pool != threadpool) {
+		worker = NULL;
+	}
+
+	while ((state = atomic_load(&task->join_state)) != TASK_DONE) {
+		// Run other work while waiting, the own deque first. Usually this
+		// is the joined task itself.
+		if (worker != NULL) {
+			struct CxTask *other = worker_find_task(worker);
+			if (other != NULL) {
+				threadpool_run_task(threadpool, worker, other);
+				continue;
+			}
+		} else if (threadpool_help(threadpool)) {
+			continue;
+		}
+
+		// The task is running on another thread.
+		if (state == TASK_FORKED &&
+			!atomic_compare_exchange_strong(
+					&task->join_state, &state, TASK_JOIN_WAITING)) {
+			continue;
+		}
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += HELP_POLL_INTERVAL_NS;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		cx__futex_wait(&task->join_state, TASK_JOIN_WAITING, &deadline);
+	}
+	atomic_store(&task->join_state, TASK_DETACHED);
+	return 0;
+}
+
+/**
+ * Waits until all tasks are done or `deadline` passed. Waits without a limit
+ * if `deadline` is NULL.
+ */
+static int
+threadpool_wait_until(
+		struct CxThreadpool *threadpool, const struct timespec *deadline) {
+	int rv = 0;
+
+	pthread_mutex_lock(&threadpool->wait_mutex);
+	while (atomic_load(&threadpool->active_tasks) > 0) {
+		if (deadline == NULL) {
+			pthread_cond_wait(&threadpool->wait_cond, &threadpool->wait_mutex);
+		} else if (
+				pthread_cond_timedwait(
+						&threadpool->wait_cond, &threadpool->wait_mutex,
+						deadline) == ETIMEDOUT) {
+			break;
+		}
+	}
+	if (atomic_load(&threadpool->active_tasks) > 0) {
+		rv = -CX_ERR_TIMEOUT;
+	}
+	pthread_mutex_unlock(&threadpool->wait_mutex);
+	return rv;
+}
+
+int
+cx_threadpool_wait(struct CxThreadpool *threadpool) {
+	return threadpool_wait_until(threadpool, NULL);
+}
+
+static void
+threadpool_stop_workers(struct CxThreadpool *threadpool) {
+	// Stop firing timers before the workers go away.
+	cx__timer_queue_stop(&threadpool->timers);
+
+	atomic_store(&threadpool->running, false);
+	pthread_mutex_lock(&threadpool->resize_mutex);
+	for (size_t i = 0; i < threadpool->worker_capacity; i++) {
+		struct CxWorker *worker = &threadpool->workers[i];
+		worker_join(worker);
+	}
+	atomic_store(&threadpool->worker_count, 0);
+	pthread_mutex_unlock(&threadpool->resize_mutex);
+}
+
+int
+cx_threadpool_shutdown(
+		struct CxThreadpool *threadpool, enum CxThreadpoolShutdown mode,
+		const struct timespec *deadline) {
+	int rv = 0;
+
+	if (mode == CX_THREADPOOL_SHUTDOWN_DRAIN) {
+		// Timers that fire while draining are run as well.
+		rv = threadpool_wait_until(threadpool, deadline);
+	}
+	threadpool_stop_workers(threadpool);
+	// All workers are stopped, so their queues can be emptied from here.
+	for (size_t i = 0; i < threadpool->worker_capacity; i++) {
+		worker_cancel_tasks(
+				&threadpool->workers[i],
+				mode == CX_THREADPOOL_SHUTDOWN_DETACH);
+	}
+	return rv;
+}
+
+int
+cx_threadpool_cleanup(struct CxThreadpool *threadpool) {
+	threadpool_stop_workers(threadpool);
+	// Tasks still queued hold timers, futures and the like, cancel them so
+	// that these are released.
+	for (size_t i = 0; i < threadpool->worker_capacity; i++) {
+		worker_cancel_tasks(&threadpool->workers[i], false);
+	}
+	// Workers steal from each other, so their queues may only be freed once
+	// all of them are stopped.
+	for (size_t i = 0; i < threadpool->worker_capacity; i++) {
+		struct CxWorker *worker = &threadpool->workers[i];
+		worker_cleanup(worker);
+	}
+	free(threadpool->workers);
+	pthread_mutex_destroy(&threadpool->resize_mutex);
+	cx_semaphore_destroy(&threadpool->queue_slots);
+	cx__timer_queue_cleanup(&threadpool->timers);
+	pthread_cond_destroy(&threadpool->wait_cond);
+	pthread_mutex_destroy(&threadpool->wait_mutex);
+	cx_concurrent_pool_cleanup(&threadpool->task_pool);
+
+	return 0;
+}
+
+int
+cx_task_group_init(
+		struct CxTaskGroup *group, struct CxThreadpool *threadpool) {
+	int rv = 0;
+
+	group->threadpool = threadpool;
+	atomic_init(&group->pending, 0);
+
+	rv = pthread_mutex_init(&group->mutex, NULL);
+	if (rv != 0) {
+		rv = -1;
+		goto out;
+	}
+	rv = pthread_cond_init(&group->cond, NULL);
+	if (rv != 0) {
+		pthread_mutex_destroy(&group->mutex);
+		rv = -1;
+		goto out;
+	}
+
+out:
+	return rv;
+}
+
+int
+cx_task_group_schedule_task(struct CxTaskGroup *group, struct CxTask *task) {
+	int rv = 0;
+
+	task->group = group;
+	atomic_fetch_add(&group->pending, 1);
+	rv = cx_threadpool_schedule_task(group->threadpool, task);
+	if (rv < 0) {
+		task_group_done(group);
+	}
+	return rv;
+}
+
+int
+cx_task_group_schedule(
+		struct CxTaskGroup *group, cx_threadpool_task_t function, void *arg) {
+	int rv = 0;
+	struct CxThreadpool *threadpool = group->threadpool;
+	struct CxTask *new_task = task_new(threadpool, function, arg);
+	if (new_task == NULL) {
+		rv = -1;
+		goto out;
+	}
+
+	rv = cx_task_group_schedule_task(group, new_task);
+	if (rv < 0) {
+		task_free(threadpool, new_task);
+	}
+
+out:
+	return rv;
+}
+
+int
+cx_task_group_wait(struct CxTaskGroup *group) {
+	struct CxThreadpool *threadpool = group->threadpool;
+
+	while (atomic_load(&group->pending) > 0) {
+		if (threadpool_help(threadpool)) {
+			continue;
+		}
+
+		// Nothing left to help with, the remaining tasks of the group are
+		// running. The timeout picks up tasks that are queued while
+		// sleeping.
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += HELP_POLL_INTERVAL_NS;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		pthread_mutex_lock(&group->mutex);
+		if (atomic_load(&group->pending) > 0) {
+			pthread_cond_timedwait(&group->cond, &group->mutex, &deadline);
+		}
+		pthread_mutex_unlock(&group->mutex);
+	}
+
+	// Synchronize with the last task_group_done(), which may still hold the
+	// mutex.
+	pthread_mutex_lock(&group->mutex);
+	pthread_mutex_unlock(&group->mutex);
+	return 0;
+}
+
+int
+cx_task_group_cleanup(struct CxTaskGroup *group) {
+	pthread_mutex_destroy(&group->mutex);
+	pthread_cond_destroy(&group->cond);
 	return 0;
 }
@@ -0,0 +1,393 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright (c) 2023, Enno Boland <g@s01.de>                                 *
+ *                                                                            *
+ * Redistribution and use in source and binary forms, with or without         *
+ * modification, are permitted provided that the following conditions are     *
+ * met:                                                                       *
+ *                                                                            *
+ * * Redistributions of source code must retain the above copyright notice,   *
+ *   this list of conditions and the following disclaimer.                    *
+ * * Redistributions in binary form must reproduce the above copyright        *
+ *   notice, this list of conditions and the following disclaimer in the      *
+ *   documentation and/or other materials provided with the distribution.     *
+ *                                                                            *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS    *
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,  *
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR     *
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR          *
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,      *
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,        *
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR         *
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF     *
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING       *
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS         *
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.               *
+ *                                                                            *
+ ******************************************************************************/
+
+
+#include "../../include/cextras/concurrency.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+extern void cx__task_set_internal(struct CxTask *task);
+
+#define MIN_HEAP_CAPACITY 16
+
+enum TimerState {
+	TIMER_IDLE,
+	TIMER_ARMED,
+	TIMER_FIRING,
+};
+
+static uint64_t
+now_ns(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+static void
+heap_set(struct CxTimerQueue *queue, size_t index, struct CxTimer *timer) {
+	queue->heap[index] = timer;
+	timer->heap_index = index;
+}
+
+static void
+heap_sift_up(struct CxTimerQueue *queue, size_t index) {
+	struct CxTimer *timer = queue->heap[index];
+	while (index > 0) {
+		size_t parent = (index - 1) / 2;
+		if (queue->heap[parent]->deadline_ns <= timer->deadline_ns) {
+			break;
+		}
+		heap_set(queue, index, queue->heap[parent]);
+		index = parent;
+	}
+	heap_set(queue, index, timer);
+}
+
+static void
+heap_sift_down(struct CxTimerQueue *queue, size_t index) {
+	struct CxTimer *timer = queue->heap[index];
+	for (;;) {
+		size_t child = index * 2 + 1;
+		if (child >= queue->count) {
+			break;
+		}
+		if (child + 1 < queue->count &&
+			queue->heap[child + 1]->deadline_ns <
+					queue->heap[child]->deadline_ns) {
+			child++;
+		}
+		if (timer->deadline_ns <= queue->heap[child]->deadline_ns) {
+			break;
+		}
+		heap_set(queue, index, queue->heap[child]);
+		index = child;
+	}
+	heap_set(queue, index, timer);
+}
+
+static int
+heap_push(struct CxTimerQueue *queue, struct CxTimer *timer) {
+	if (queue->count == queue->capacity) {
+		size_t capacity = CX_MAX(queue->capacity * 2, MIN_HEAP_CAPACITY);
+		struct CxTimer **heap =
+				realloc(queue->heap, capacity * sizeof(struct CxTimer *));
+		if (heap == NULL) {
+			return -1;
+		}
+		queue->heap = heap;
+		queue->capacity = capacity;
+	}
+	queue->count++;
+	heap_set(queue, queue->count - 1, timer);
+	heap_sift_up(queue, queue->count - 1);
+	return 0;
+}
+
+static void
+heap_remove(struct CxTimerQueue *queue, size_t index) {
+	queue->count--;
+	if (index == queue->count) {
+		return;
+	}
+	heap_set(queue, index, queue->heap[queue->count]);
+	heap_sift_down(queue, index);
+	heap_sift_up(queue, index);
+}
+
+/**
+ * Runs the task of a timer and arms it again if it is periodic.
+ */
+static void
+timer_run(void *arg) {
+	struct CxTimer *timer = arg;
+	struct CxTimerQueue *queue = &timer->threadpool->timers;
+	bool release = false;
+
+	timer->function(timer->arg);
+
+	pthread_mutex_lock(&queue->mutex);
+	if (timer->period_ns > 0 && !timer->cancelled && !queue->stopping) {
+		uint64_t now = now_ns();
+		timer->deadline_ns += timer->period_ns;
+		if (timer->deadline_ns <= now) {
+			// Skip the runs that were missed.
+			uint64_t missed = (now - timer->deadline_ns) / timer->period_ns;
+			timer->deadline_ns += (missed + 1) * timer->period_ns;
+		}
+		// The timer was removed from the heap before it fired, so there
+		// is room for it.
+		heap_push(queue, timer);
+		timer->state = TIMER_ARMED;
+		if (queue->heap[0] == timer) {
+			pthread_cond_signal(&queue->cond);
+		}
+	} else {
+		timer->state = TIMER_IDLE;
+		release = timer->owned;
+	}
+	pthread_cond_broadcast(&queue->idle_cond);
+	pthread_mutex_unlock(&queue->mutex);
+
+	if (release) {
+		free(timer);
+	}
+}
+
+/**
+ * Called instead of timer_run if the pool is shut down before the timer task
+ * ran. The timer is not armed again.
+ */
+static void
+timer_cancel_run(void *arg) {
+	struct CxTimer *timer = arg;
+	struct CxTimerQueue *queue = &timer->threadpool->timers;
+	bool release = false;
+
+	pthread_mutex_lock(&queue->mutex);
+	timer->state = TIMER_IDLE;
+	release = timer->owned;
+	pthread_cond_broadcast(&queue->idle_cond);
+	pthread_mutex_unlock(&queue->mutex);
+
+	if (release) {
+		free(timer);
+	}
+}
+
+static void *
+timer_queue_run(void *data) {
+	struct CxThreadpool *threadpool = data;
+	struct CxTimerQueue *queue = &threadpool->timers;
+
+	pthread_mutex_lock(&queue->mutex);
+	while (!queue->stopping) {
+		if (queue->count == 0) {
+			pthread_cond_wait(&queue->cond, &queue->mutex);
+			continue;
+		}
+
+		struct CxTimer *timer = queue->heap[0];
+		uint64_t now = now_ns();
+		if (timer->deadline_ns > now) {
+			// Condition variables wait for a CLOCK_REALTIME deadline, the
+			// heap is ordered by CLOCK_MONOTONIC.
+			uint64_t delay = timer->deadline_ns - now;
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += delay / 1000000000;
+			deadline.tv_nsec += delay % 1000000000;
+			if (deadline.tv_nsec >= 1000000000) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&queue->cond, &queue->mutex, &deadline);
+			continue;
+		}
+
+		heap_remove(queue, 0);
+		timer->state = TIMER_FIRING;
+		pthread_mutex_unlock(&queue->mutex);
+
+		cx_task_init(&timer->task, timer_run, timer);
+		cx_task_set_cancel(&timer->task, timer_cancel_run);
+		cx__task_set_internal(&timer->task);
+		if (cx_threadpool_schedule_task(threadpool, &timer->task) < 0) {
+			// The pool is full and does not take more tasks, run the
+			// timer here instead of dropping it.
+			timer_run(timer);
+		}
+
+		pthread_mutex_lock(&queue->mutex);
+	}
+	pthread_mutex_unlock(&queue->mutex);
+
+	return NULL;
+}
+
+static int
+timer_arm(struct CxTimer *timer) {
+	int rv = 0;
+	struct CxThreadpool *threadpool = timer->threadpool;
+	struct CxTimerQueue *queue = &threadpool->timers;
+
+	pthread_mutex_lock(&queue->mutex);
+	if (queue->stopping) {
+		// The pool is shutting down, the timer would never fire.
+		rv = -1;
+		goto out;
+	} else if (!queue->started) {
+		rv = pthread_create(&queue->thread, NULL, timer_queue_run, threadpool);
+		if (rv != 0) {
+			rv = -1;
+			goto out;
+		}
+		queue->started = true;
+	}
+	rv = heap_push(queue, timer);
+	if (rv < 0) {
+		goto out;
+	}
+	timer->state = TIMER_ARMED;
+	if (queue->heap[0] == timer) {
+		pthread_cond_signal(&queue->cond);
+	}
+out:
+	pthread_mutex_unlock(&queue->mutex);
+	return rv;
+}
+
+static void
+timer_init(
+		struct CxTimer *timer, struct CxThreadpool *threadpool,
+		uint64_t delay_ns, uint64_t period_ns, cx_threadpool_task_t function,
+		void *arg) {
+	timer->threadpool = threadpool;
+	timer->function = function;
+	timer->arg = arg;
+	timer->deadline_ns = now_ns() + delay_ns;
+	timer->period_ns = period_ns;
+	timer->heap_index = 0;
+	timer->state = TIMER_IDLE;
+	timer->cancelled = false;
+	timer->owned = false;
+}
+
+int
+cx__timer_queue_init(struct CxTimerQueue *queue) {
+	int rv = 0;
+
+	queue->started = false;
+	queue->stopping = false;
+	queue->heap = NULL;
+	queue->count = 0;
+	queue->capacity = 0;
+
+	rv = pthread_mutex_init(&queue->mutex, NULL);
+	if (rv != 0) {
+		goto out;
+	}
+	rv = pthread_cond_init(&queue->cond, NULL);
+	if (rv != 0) {
+		goto destroy_mutex;
+	}
+	rv = pthread_cond_init(&queue->idle_cond, NULL);
+	if (rv != 0) {
+		goto destroy_cond;
+	}
+
+	return 0;
+
+destroy_cond:
+	pthread_cond_destroy(&queue->cond);
+destroy_mutex:
+	pthread_mutex_destroy(&queue->mutex);
+out:
+	return -1;
+}
+
+void
+cx__timer_queue_stop(struct CxTimerQueue *queue) {
+	pthread_mutex_lock(&queue->mutex);
+	queue->stopping = true;
+	pthread_cond_signal(&queue->cond);
+	pthread_mutex_unlock(&queue->mutex);
+
+	if (queue->started) {
+		pthread_join(queue->thread, NULL);
+		queue->started = false;
+	}
+}
+
+void
+cx__timer_queue_cleanup(struct CxTimerQueue *queue) {
+	for (size_t i = 0; i < queue->count; i++) {
+		if (queue->heap[i]->owned) {
+			free(queue->heap[i]);
+		}
+	}
+	free(queue->heap);
+	pthread_cond_destroy(&queue->idle_cond);
+	pthread_cond_destroy(&queue->cond);
+	pthread_mutex_destroy(&queue->mutex);
+}
+
+int
+cx_threadpool_schedule_after(
+		struct CxThreadpool *threadpool, uint64_t delay_ns,
+		cx_threadpool_task_t function, void *arg) {
+	int rv = 0;
+	struct CxTimer *timer = calloc(1, sizeof(struct CxTimer));
+	if (timer == NULL) {
+		return -1;
+	}
+
+	timer_init(timer, threadpool, delay_ns, 0, function, arg);
+	timer->owned = true;
+	rv = timer_arm(timer);
+	if (rv < 0) {
+		free(timer);
+	}
+	return rv;
+}
+
+int
+cx_timer_start_periodic(
+		struct CxTimer *timer, struct CxThreadpool *threadpool,
+		uint64_t period_ns, cx_threadpool_task_t function, void *arg) {
+	if (period_ns == 0) {
+		return -1;
+	}
+
+	timer_init(timer, threadpool, period_ns, period_ns, function, arg);
+	return timer_arm(timer);
+}
+
+int
+cx_timer_cancel(struct CxTimer *timer) {
+	if (timer->threadpool == NULL) {
+		// Zero-initialized and never started.
+		return 0;
+	}
+	struct CxTimerQueue *queue = &timer->threadpool->timers;
+
+	pthread_mutex_lock(&queue->mutex);
+	timer->cancelled = true;
+	if (timer->state == TIMER_ARMED) {
+		heap_remove(queue, timer->heap_index);
+		timer->state = TIMER_IDLE;
+	}
+	while (timer->state == TIMER_FIRING) {
+		pthread_cond_wait(&queue->idle_cond, &queue->mutex);
+	}
+	pthread_mutex_unlock(&queue->mutex);
+
+	return 0;
+}
@@ -0,0 +1,207 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright (c) 2023, Enno Boland <g@s01.de>                                 *
+ *                                                                            *
+ * Redistribution and use in source and binary forms, with or without         *
+ * modification, are permitted provided that the following conditions are     *
+ * met:                                                                       *
+ *                                                                            *
+ * * Redistributions of source code must retain the above copyright notice,   *
+ *   this list of conditions and the following disclaimer.                    *
+ * * Redistributions in binary form must reproduce the above copyright        *
+ *   notice, this list of conditions and the following disclaimer in the      *
+ *   documentation and/or other materials provided with the distribution.     *
+ *                                                                            *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS    *
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,  *
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR     *
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR          *
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,      *
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,        *
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR         *
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF     *
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING       *
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS         *
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.               *
+ *                                                                            *
+ ******************************************************************************/
+
+/**
+ * @author       Enno Boland (mail@eboland.de)
+ * @file         topology.c
+ *
+ * CPU and NUMA topology helpers for worker placement. NUMA nodes are read
+ * from sysfs on Linux. Elsewhere every CPU is reported to be on node 0 and
+ * pinning is a no-op.
+ */
+
+#define _GNU_SOURCE
+
+#include "../../include/cextras/concurrency.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef __linux__
+#	include <dirent.h>
+#	include <sched.h>
+
+#	define SYSFS_NODE_PATH "/sys/devices/system/node"
+#	define SYSFS_CPU_PATH "/sys/devices/system/cpu"
+
+static int
+parse_node_name(const char *name) {
+	int node = -1;
+	char trailing;
+	if (sscanf(name, "node%d%c", &node, &trailing) != 1) {
+		return -1;
+	}
+	return node;
+}
+
+static int
+compare_int(const void *a, const void *b) {
+	return *(const int *)a - *(const int *)b;
+}
+
+static int
+node_cpu_set(int node, cpu_set_t *set) {
+	int rv = 0;
+	char path[64];
+	int first, last;
+	char separator;
+
+	CPU_ZERO(set);
+	snprintf(path, sizeof(path), SYSFS_NODE_PATH "/node%d/cpulist", node);
+	FILE *file = fopen(path, "r");
+	if (file == NULL) {
+		return -1;
+	}
+	// Format: 0-3,8,10-11
+	while (fscanf(file, "%d", &first) == 1) {
+		last = first;
+		separator = (char)fgetc(file);
+		if (separator == '-') {
+			if (fscanf(file, "%d", &last) != 1) {
+				rv = -1;
+				break;
+			}
+			separator = (char)fgetc(file);
+		}
+		for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+			CPU_SET(cpu, set);
+		}
+		if (separator != ',') {
+			break;
+		}
+	}
+	fclose(file);
+
+	// Only keep the CPUs the process may run on, e.g. in a container.
+	cpu_set_t allowed;
+	if (rv == 0 && sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+		CPU_AND(set, set, &allowed);
+	}
+	if (rv == 0 && CPU_COUNT(set) == 0) {
+		rv = -1;
+	}
+	return rv;
+}
+
+size_t
+cx__numa_nodes(int *nodes, size_t max_nodes) {
+	size_t count = 0;
+	struct dirent *entry;
+	DIR *dir = opendir(SYSFS_NODE_PATH);
+	if (dir == NULL) {
+		goto out;
+	}
+	while ((entry = readdir(dir)) != NULL && count < max_nodes) {
+		int node = parse_node_name(entry->d_name);
+		cpu_set_t set;
+		// Memory-only nodes have no CPUs to run workers on.
+		if (node >= 0 && node_cpu_set(node, &set) == 0) {
+			nodes[count++] = node;
+		}
+	}
+	closedir(dir);
+	qsort(nodes, count, sizeof(int), compare_int);
+
+out:
+	if (count == 0 && max_nodes > 0) {
+		nodes[count++] = 0;
+	}
+	return count;
+}
+
+int
+cx__numa_node_of_cpu(int cpu) {
+	int node = 0;
+	char path[64];
+	struct dirent *entry;
+
+	snprintf(path, sizeof(path), SYSFS_CPU_PATH "/cpu%d", cpu);
+	DIR *dir = opendir(path);
+	if (dir == NULL) {
+		return 0;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		int candidate = parse_node_name(entry->d_name);
+		if (candidate >= 0) {
+			node = candidate;
+			break;
+		}
+	}
+	closedir(dir);
+	return node;
+}
+
+int
+cx__pin_attr_to_cpu(pthread_attr_t *attr, int cpu) {
+	cpu_set_t set;
+	if (cpu < 0 || cpu >= CPU_SETSIZE) {
+		return -1;
+	}
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_attr_setaffinity_np(attr, sizeof(set), &set) == 0 ? 0 : -1;
+}
+
+int
+cx__pin_attr_to_node(pthread_attr_t *attr, int node) {
+	cpu_set_t set;
+	if (node_cpu_set(node, &set) < 0) {
+		return -1;
+	}
+	return pthread_attr_setaffinity_np(attr, sizeof(set), &set) == 0 ? 0 : -1;
+}
+#else
+size_t
+cx__numa_nodes(int *nodes, size_t max_nodes) {
+	if (max_nodes == 0) {
+		return 0;
+	}
+	nodes[0] = 0;
+	return 1;
+}
+
+int
+cx__numa_node_of_cpu(int cpu) {
+	(void)cpu;
+	return 0;
+}
+
+int
+cx__pin_attr_to_cpu(pthread_attr_t *attr, int cpu) {
+	(void)attr;
+	(void)cpu;
+	return 0;
+}
+
+int
+cx__pin_attr_to_node(pthread_attr_t *attr, int node) {
+	(void)attr;
+	(void)node;
+	return 0;
+}
+#endif
@@ -0,0 +1,190 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright (c) 2023, Enno Boland <g@s01.de>                                 *
+ *                                                                            *
+ * Redistribution and use in source and binary forms, with or without         *
+ * modification, are permitted provided that the following conditions are     *
+ * met:                                                                       *
+ *                                                                            *
+ * * Redistributions of source code must retain the above copyright notice,   *
+ *   this list of conditions and the following disclaimer.                    *
+ * * Redistributions in binary form must reproduce the above copyright        *
+ *   notice, this list of conditions and the following disclaimer in the      *
+ *   documentation and/or other materials provided with the distribution.     *
+ *                                                                            *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS    *
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,  *
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR     *
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR          *
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,      *
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,        *
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR         *
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF     *
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING       *
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS         *
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.               *
+ *                                                                            *
+ ******************************************************************************/
+
+/**
+ * @author       Enno Boland (mail@eboland.de)
+ * @file         work_deque.c
+ *
+ * Chase-Lev work-stealing deque following "Correct and Efficient Work-Stealing
+ * for Weak Memory Models" (Lê et al., 2013).
+ */
+
+#include "../../include/cextras/concurrency.h"
+#include "../../include/cextras/error.h"
+#include <stdlib.h>
+
+#define INITIAL_CAPACITY 32
+
+struct CxWorkDequeArray {
+	int64_t capacity;
+	struct CxWorkDequeArray *previous;
+	_Atomic(void *) items[];
+};
+
+static struct CxWorkDequeArray *
+array_new(int64_t capacity, struct CxWorkDequeArray *previous) {
+	struct CxWorkDequeArray *array = calloc(
+			1, sizeof(struct CxWorkDequeArray) +
+					   (size_t)capacity * sizeof(_Atomic(void *)));
+	if (array == NULL) {
+		return NULL;
+	}
+	array->capacity = capacity;
+	array->previous = previous;
+	return array;
+}
+
+static void *
+array_get(struct CxWorkDequeArray *array, int64_t index) {
+	return atomic_load_explicit(
+			&array->items[index & (array->capacity - 1)],
+			memory_order_relaxed);
+}
+
+static void
+array_put(struct CxWorkDequeArray *array, int64_t index, void *item) {
+	atomic_store_explicit(
+			&array->items[index & (array->capacity - 1)], item,
+			memory_order_relaxed);
+}
+
+static struct CxWorkDequeArray *
+array_grow(struct CxWorkDequeArray *array, int64_t top, int64_t bottom) {
+	// The old array is kept alive until cleanup, as thieves may still read
+	// from it.
+	struct CxWorkDequeArray *new_array =
+			array_new(array->capacity * 2, array);
+	if (new_array == NULL) {
+		return NULL;
+	}
+	for (int64_t i = top; i < bottom; i++) {
+		array_put(new_array, i, array_get(array, i));
+	}
+	return new_array;
+}
+
+int
+cx_work_deque_init(struct CxWorkDeque *deque) {
+	struct CxWorkDequeArray *array = array_new(INITIAL_CAPACITY, NULL);
+	if (array == NULL) {
+		return -CX_ERR_ALLOC;
+	}
+	atomic_init(&deque->top, 0);
+	atomic_init(&deque->bottom, 0);
+	atomic_init(&deque->array, array);
+	return 0;
+}
+
+int
+cx_work_deque_push(struct CxWorkDeque *deque, void *item) {
+	int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+	int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+	struct CxWorkDequeArray *array =
+			atomic_load_explicit(&deque->array, memory_order_relaxed);
+
+	if (bottom - top > array->capacity - 1) {
+		array = array_grow(array, top, bottom);
+		if (array == NULL) {
+			return -CX_ERR_ALLOC;
+		}
+		atomic_store_explicit(&deque->array, array, memory_order_release);
+	}
+	array_put(array, bottom, item);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+	return 0;
+}
+
+void *
+cx_work_deque_pop(struct CxWorkDeque *deque) {
+	void *item = NULL;
+	int64_t bottom =
+			atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+	struct CxWorkDequeArray *array =
+			atomic_load_explicit(&deque->array, memory_order_relaxed);
+	atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+	if (top <= bottom) {
+		item = array_get(array, bottom);
+		if (top == bottom) {
+			// Last item: race against thieves for it.
+			if (!atomic_compare_exchange_strong_explicit(
+						&deque->top, &top, top + 1, memory_order_seq_cst,
+						memory_order_relaxed)) {
+				item = NULL;
+			}
+			atomic_store_explicit(
+					&deque->bottom, bottom + 1, memory_order_relaxed);
+		}
+	} else {
+		atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+	}
+	return item;
+}
+
+void *
+cx_work_deque_steal(struct CxWorkDeque *deque) {
+	void *item = NULL;
+	int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+	if (top < bottom) {
+		struct CxWorkDequeArray *array =
+				atomic_load_explicit(&deque->array, memory_order_acquire);
+		item = array_get(array, top);
+		if (!atomic_compare_exchange_strong_explicit(
+					&deque->top, &top, top + 1, memory_order_seq_cst,
+					memory_order_relaxed)) {
+			item = NULL;
+		}
+	}
+	return item;
+}
+
+size_t
+cx_work_deque_size(struct CxWorkDeque *deque) {
+	int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+	int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+	return bottom > top ? (size_t)(bottom - top) : 0;
+}
+
+int
+cx_work_deque_cleanup(struct CxWorkDeque *deque) {
+	struct CxWorkDequeArray *array =
+			atomic_load_explicit(&deque->array, memory_order_relaxed);
+	while (array != NULL) {
+		struct CxWorkDequeArray *previous = array->previous;
+		free(array);
+		array = previous;
+	}
+	atomic_store_explicit(&deque->array, NULL, memory_order_relaxed);
+	return 0;
+}
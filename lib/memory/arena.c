@@ -0,0 +1,116 @@
+#include "../../include/cextras/memory.h"
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DEFAULT_CHUNK_SIZE 4096
+
+/**
+ * Chunks form a list from the current chunk back to the first one.
+ */
+struct CxArenaChunk {
+	struct CxArenaChunk *prev;
+	size_t size;
+	max_align_t data[];
+};
+
+static void *
+chunk_bump(
+		struct CxArenaChunk *chunk, size_t *offset, size_t size,
+		size_t alignment) {
+	uintptr_t base = (uintptr_t)chunk->data;
+	uintptr_t start = (base + *offset + alignment - 1) & ~(alignment - 1);
+	size_t used = start - base;
+
+	if (used > chunk->size || size > chunk->size - used) {
+		return NULL;
+	}
+	*offset = used + size;
+	return (void *)start;
+}
+
+static struct CxArenaChunk *
+chunk_new(struct CxArena *arena, size_t size, size_t alignment) {
+	size_t data_size = arena->chunk_size;
+	if (size > SIZE_MAX - sizeof(struct CxArenaChunk) - alignment) {
+		return NULL;
+	} else if (data_size < size + alignment - 1) {
+		data_size = size + alignment - 1;
+	}
+
+	struct CxArenaChunk *chunk =
+			malloc(sizeof(struct CxArenaChunk) + data_size);
+	if (chunk == NULL) {
+		return NULL;
+	}
+	chunk->prev = arena->chunk;
+	chunk->size = data_size;
+	arena->chunk = chunk;
+	arena->offset = 0;
+	return chunk;
+}
+
+static void
+free_chunks_until(struct CxArena *arena, struct CxArenaChunk *last) {
+	struct CxArenaChunk *chunk = arena->chunk;
+	while (chunk != last) {
+		assert(chunk != NULL);
+		struct CxArenaChunk *prev = chunk->prev;
+		free(chunk);
+		chunk = prev;
+	}
+	arena->chunk = last;
+}
+
+void
+cx_arena_init(struct CxArena *arena, size_t chunk_size) {
+	arena->chunk = NULL;
+	arena->offset = 0;
+	arena->chunk_size = chunk_size == 0 ? DEFAULT_CHUNK_SIZE : chunk_size;
+}
+
+void *
+cx_arena_alloc(struct CxArena *arena, size_t size, size_t alignment) {
+	assert(alignment > 0 && (alignment & (alignment - 1)) == 0);
+	void *memory = NULL;
+
+	if (arena->chunk != NULL) {
+		memory = chunk_bump(arena->chunk, &arena->offset, size, alignment);
+	}
+	if (memory == NULL && chunk_new(arena, size, alignment) != NULL) {
+		memory = chunk_bump(arena->chunk, &arena->offset, size, alignment);
+		assert(memory != NULL);
+	}
+	return memory;
+}
+
+struct CxArenaMark
+cx_arena_mark(const struct CxArena *arena) {
+	struct CxArenaMark mark = {
+			.chunk = arena->chunk,
+			.offset = arena->offset,
+	};
+	return mark;
+}
+
+void
+cx_arena_reset_to(struct CxArena *arena, const struct CxArenaMark *mark) {
+	free_chunks_until(arena, mark->chunk);
+	arena->offset = mark->offset;
+}
+
+void
+cx_arena_reset(struct CxArena *arena) {
+	struct CxArenaChunk *first = arena->chunk;
+	while (first != NULL && first->prev != NULL) {
+		first = first->prev;
+	}
+	free_chunks_until(arena, first);
+	arena->offset = 0;
+}
+
+void
+cx_arena_cleanup(struct CxArena *arena) {
+	free_chunks_until(arena, NULL);
+	arena->offset = 0;
+}
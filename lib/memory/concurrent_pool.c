@@ -0,0 +1,302 @@
+#include "../../include/cextras/memory.h"
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define DEFAULT_MAGAZINE_SIZE 64
+// Number of magazines carved from a new chunk. The first one goes to the
+// thread that allocated the chunk, the others to the depot.
+#define CHUNK_MAGAZINES 4
+#define CACHE_LINE_SIZE 64
+
+// A free element. Free elements are linked through their storage, the first
+// element of a magazine also links the magazines in the depot.
+struct CxConcurrentPoolElement {
+	struct CxConcurrentPoolElement *next;
+	struct CxConcurrentPoolElement *next_magazine;
+	size_t count;
+};
+
+// The magazines of one thread. `previous` lets a thread that alternates
+// between taking and returning elements around a magazine boundary do so
+// without going to the depot each time.
+struct CxConcurrentPoolCache {
+	struct CxConcurrentPool *pool;
+	struct CxConcurrentPoolElement *loaded;
+	size_t loaded_count;
+	struct CxConcurrentPoolElement *previous;
+	size_t previous_count;
+	struct CxConcurrentPoolCache *next;
+};
+
+/**
+ * Pushes a magazine to the depot. Threads only go to the depot once per
+ * magazine, so a mutex does not get contended and is free of ABA, unlike a
+ * lock-free stack.
+ */
+static void
+depot_push(
+		struct CxConcurrentPool *pool,
+		struct CxConcurrentPoolElement *magazine, size_t count) {
+	magazine->count = count;
+	pthread_mutex_lock(&pool->depot_mutex);
+	magazine->next_magazine = pool->depot;
+	pool->depot = magazine;
+	pthread_mutex_unlock(&pool->depot_mutex);
+}
+
+static struct CxConcurrentPoolElement *
+depot_pop(struct CxConcurrentPool *pool) {
+	pthread_mutex_lock(&pool->depot_mutex);
+	struct CxConcurrentPoolElement *magazine = pool->depot;
+	if (magazine != NULL) {
+		pool->depot = magazine->next_magazine;
+		magazine->next_magazine = NULL;
+	}
+	pthread_mutex_unlock(&pool->depot_mutex);
+	return magazine;
+}
+
+/**
+ * Allocates a new chunk and returns its first magazine. The other magazines
+ * of the chunk are pushed to the depot.
+ */
+static struct CxConcurrentPoolElement *
+pool_add_chunk(struct CxConcurrentPool *pool) {
+	size_t magazine_bytes = pool->magazine_size * pool->element_size;
+
+	pthread_mutex_lock(&pool->mutex);
+	// Another thread may have added a chunk while this one waited for the
+	// lock, use its magazines instead of growing the pool again.
+	struct CxConcurrentPoolElement *magazine = depot_pop(pool);
+	if (magazine != NULL) {
+		pthread_mutex_unlock(&pool->mutex);
+		return magazine;
+	}
+
+	char *chunk = malloc(magazine_bytes * CHUNK_MAGAZINES);
+	char **chunks = NULL;
+	if (chunk != NULL) {
+		chunks = realloc(
+				pool->chunks, (pool->chunk_count + 1) * sizeof(char *));
+	}
+	if (chunks == NULL) {
+		pthread_mutex_unlock(&pool->mutex);
+		free(chunk);
+		return NULL;
+	}
+	pool->chunks = chunks;
+	pool->chunks[pool->chunk_count++] = chunk;
+
+	struct CxConcurrentPoolElement *magazines[CHUNK_MAGAZINES];
+	for (size_t i = 0; i < CHUNK_MAGAZINES; i++) {
+		char *start = &chunk[i * magazine_bytes];
+		struct CxConcurrentPoolElement *next = NULL;
+		for (size_t j = pool->magazine_size; j > 0; j--) {
+			struct CxConcurrentPoolElement *element =
+					(void *)&start[(j - 1) * pool->element_size];
+			element->next = next;
+			element->next_magazine = NULL;
+			next = element;
+		}
+		magazines[i] = next;
+		magazines[i]->count = pool->magazine_size;
+	}
+	for (size_t i = 1; i < CHUNK_MAGAZINES; i++) {
+		depot_push(pool, magazines[i], pool->magazine_size);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return magazines[0];
+}
+
+static void
+cache_flush(struct CxConcurrentPoolCache *cache) {
+	struct CxConcurrentPool *pool = cache->pool;
+
+	if (cache->loaded_count > 0) {
+		depot_push(pool, cache->loaded, cache->loaded_count);
+	}
+	if (cache->previous_count > 0) {
+		depot_push(pool, cache->previous, cache->previous_count);
+	}
+	cache->loaded = NULL;
+	cache->loaded_count = 0;
+	cache->previous = NULL;
+	cache->previous_count = 0;
+}
+
+/**
+ * Called when a thread exits. Hands the elements of the thread to the other
+ * threads.
+ */
+static void
+cache_destroy(void *data) {
+	struct CxConcurrentPoolCache *cache = data;
+	struct CxConcurrentPool *pool = cache->pool;
+
+	cache_flush(cache);
+
+	pthread_mutex_lock(&pool->mutex);
+	struct CxConcurrentPoolCache **link = &pool->caches;
+	while (*link != cache) {
+		link = &(*link)->next;
+	}
+	*link = cache->next;
+	pthread_mutex_unlock(&pool->mutex);
+
+	free(cache);
+}
+
+static struct CxConcurrentPoolCache *
+pool_cache(struct CxConcurrentPool *pool) {
+	struct CxConcurrentPoolCache *cache = pthread_getspecific(pool->key);
+	if (cache != NULL) {
+		return cache;
+	}
+
+	// Caches of different threads do not share a cache line.
+	cache = aligned_alloc(
+			CACHE_LINE_SIZE,
+			(sizeof(struct CxConcurrentPoolCache) + CACHE_LINE_SIZE - 1) /
+					CACHE_LINE_SIZE * CACHE_LINE_SIZE);
+	if (cache == NULL) {
+		return NULL;
+	}
+	memset(cache, 0, sizeof(struct CxConcurrentPoolCache));
+	cache->pool = pool;
+	if (pthread_setspecific(pool->key, cache) != 0) {
+		free(cache);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	cache->next = pool->caches;
+	pool->caches = cache;
+	pthread_mutex_unlock(&pool->mutex);
+	return cache;
+}
+
+int
+cx_concurrent_pool_init2(
+		struct CxConcurrentPool *pool, size_t magazine_size,
+		size_t element_size) {
+	assert(magazine_size > 0);
+	memset(pool, 0, sizeof(struct CxConcurrentPool));
+
+	// Free elements store the links in their storage.
+	if (element_size < sizeof(struct CxConcurrentPoolElement)) {
+		element_size = sizeof(struct CxConcurrentPoolElement);
+	}
+	size_t alignment = _Alignof(max_align_t);
+	pool->element_size = (element_size + alignment - 1) / alignment * alignment;
+	pool->magazine_size = magazine_size;
+	pool->depot = NULL;
+
+	if (pthread_key_create(&pool->key, cache_destroy) != 0) {
+		goto err;
+	}
+	if (pthread_mutex_init(&pool->mutex, NULL) != 0) {
+		goto delete_key;
+	}
+	if (pthread_mutex_init(&pool->depot_mutex, NULL) != 0) {
+		goto destroy_mutex;
+	}
+	return 0;
+
+destroy_mutex:
+	pthread_mutex_destroy(&pool->mutex);
+delete_key:
+	pthread_key_delete(pool->key);
+err:
+	return -1;
+}
+
+int
+cx_concurrent_pool_init(struct CxConcurrentPool *pool, size_t element_size) {
+	return cx_concurrent_pool_init2(pool, DEFAULT_MAGAZINE_SIZE, element_size);
+}
+
+void *
+cx_concurrent_pool_get(struct CxConcurrentPool *pool) {
+	struct CxConcurrentPoolCache *cache = pool_cache(pool);
+	if (cache == NULL) {
+		return NULL;
+	}
+
+	if (cache->loaded_count == 0) {
+		if (cache->previous_count > 0) {
+			cache->loaded = cache->previous;
+			cache->loaded_count = cache->previous_count;
+			cache->previous = NULL;
+			cache->previous_count = 0;
+		} else {
+			struct CxConcurrentPoolElement *magazine = depot_pop(pool);
+			if (magazine == NULL) {
+				magazine = pool_add_chunk(pool);
+			}
+			if (magazine == NULL) {
+				return NULL;
+			}
+			cache->loaded = magazine;
+			cache->loaded_count = magazine->count;
+		}
+	}
+
+	struct CxConcurrentPoolElement *element = cache->loaded;
+	cache->loaded = element->next;
+	cache->loaded_count--;
+
+	memset(element, 0, sizeof(struct CxConcurrentPoolElement));
+	return element;
+}
+
+void
+cx_concurrent_pool_recycle(struct CxConcurrentPool *pool, void *element) {
+	struct CxConcurrentPoolElement *free_element = element;
+	if (free_element == NULL) {
+		return;
+	}
+
+	free_element->next_magazine = NULL;
+	struct CxConcurrentPoolCache *cache = pool_cache(pool);
+	if (cache == NULL) {
+		// Without a cache, return the element on its own.
+		free_element->next = NULL;
+		depot_push(pool, free_element, 1);
+		return;
+	}
+
+	if (cache->loaded_count == pool->magazine_size) {
+		// Return the previous magazine in one batch and start a new one.
+		if (cache->previous_count > 0) {
+			depot_push(pool, cache->previous, cache->previous_count);
+		}
+		cache->previous = cache->loaded;
+		cache->previous_count = cache->loaded_count;
+		cache->loaded = NULL;
+		cache->loaded_count = 0;
+	}
+	free_element->next = cache->loaded;
+	cache->loaded = free_element;
+	cache->loaded_count++;
+}
+
+void
+cx_concurrent_pool_cleanup(struct CxConcurrentPool *pool) {
+	// Threads that exit afterwards do not call cache_destroy anymore.
+	pthread_key_delete(pool->key);
+
+	struct CxConcurrentPoolCache *cache = pool->caches;
+	while (cache != NULL) {
+		struct CxConcurrentPoolCache *next = cache->next;
+		free(cache);
+		cache = next;
+	}
+	for (size_t i = 0; i < pool->chunk_count; i++) {
+		free(pool->chunks[i]);
+	}
+	free(pool->chunks);
+	pthread_mutex_destroy(&pool->depot_mutex);
+	pthread_mutex_destroy(&pool->mutex);
+}
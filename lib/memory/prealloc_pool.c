@@ -1,16 +1,20 @@
+#define _GNU_SOURCE
+
 #include "../../include/cextras/memory.h"
-#include "../../include/cextras/types.h"
 #include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
+#ifdef __unix__
+#	include <sys/mman.h>
+#endif
 
 #if 0
 void
-cx_prealloc_pool_init2(
-		struct CxPreallocPool *pool, size_t element_count,
-		size_t element_size) {
-	(void)element_count;
-	(void)pool;
-	pool->element_size = element_size;
+cx_prealloc_pool_init3(
+		struct CxPreallocPool *pool,
+		const struct CxPreallocPoolOptions *options) {
+	pool->element_size = options->element_size;
 }
 
 void *
@@ -24,92 +28,338 @@ cx_prealloc_pool_recycle(struct CxPreallocPool *pool, void *element) {
 	free(element);
 }
 
+size_t
+cx_prealloc_pool_trim(struct CxPreallocPool *pool) {
+	(void)pool;
+	return 0;
+}
+
 void
 cx_prealloc_pool_cleanup(struct CxPreallocPool *pool) {
 	(void)pool;
 }
 #else
+#define MIN_CHUNK_SIZE 4096
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
 union ReuseList {
 	union ReuseList *next;
 	char element;
 };
 
-char *
-reuse_node(struct CxPreallocPool *pool) {
-	union ReuseList *element = pool->reuse_pool;
-	union ReuseList *next = element->next;
-	pool->reuse_pool = next;
+/**
+ * The header at the start of each chunk. Chunks are aligned to their size, so
+ * the chunk of an element is found by masking its address.
+ */
+struct CxPreallocChunk {
+	struct CxPreallocChunk *prev;
+	struct CxPreallocChunk *next;
+	// Links the chunks that have free elements.
+	struct CxPreallocChunk *reuse_prev;
+	struct CxPreallocChunk *reuse_next;
+	union ReuseList *free_list;
+	size_t next_offset;
+	size_t live;
+	bool reusable;
+};
 
-	memset(element, 0, sizeof(union ReuseList));
-	return &element->element;
+static size_t
+header_size(void) {
+	size_t alignment = _Alignof(max_align_t);
+	return (sizeof(struct CxPreallocChunk) + alignment - 1) / alignment *
+			alignment;
 }
 
-int
-add_chunk(struct CxPreallocPool *pool) {
-	pool->pool_count++;
-	pool->chunk_size *= 2;
-	pool->pools = realloc(pool->pools, pool->pool_count * sizeof(char *));
-	if (pool->pools == NULL) {
-		return -1;
+static struct CxPreallocChunk *
+element_chunk(struct CxPreallocPool *pool, void *element) {
+	return (void *)((uintptr_t)element & ~(uintptr_t)(pool->chunk_size - 1));
+}
+
+static bool
+chunk_is_full(struct CxPreallocPool *pool, struct CxPreallocChunk *chunk) {
+	return chunk->free_list == NULL &&
+			chunk->next_offset + pool->element_size > pool->chunk_size;
+}
+
+static void
+reuse_list_add(
+		struct CxPreallocPool *pool, struct CxPreallocChunk *chunk,
+		bool tail) {
+	struct CxPreallocChunk *head = pool->reuse_pool;
+	chunk->reusable = true;
+	if (head == NULL) {
+		chunk->reuse_prev = chunk->reuse_next = chunk;
+		pool->reuse_pool = chunk;
+		return;
 	}
-	char *new_chunk = calloc(pool->chunk_size, sizeof(char));
-	if (new_chunk == NULL) {
-		return -1;
+	chunk->reuse_next = head;
+	chunk->reuse_prev = head->reuse_prev;
+	head->reuse_prev->reuse_next = chunk;
+	head->reuse_prev = chunk;
+	if (!tail) {
+		pool->reuse_pool = chunk;
 	}
+}
 
-	pool->current_pool = new_chunk;
-	pool->pools[pool->pool_count - 1] = new_chunk;
-	pool->next_offset = 0;
-	return 0;
+static void
+reuse_list_remove(struct CxPreallocPool *pool, struct CxPreallocChunk *chunk) {
+	chunk->reusable = false;
+	if (chunk->reuse_next == chunk) {
+		pool->reuse_pool = NULL;
+		return;
+	}
+	chunk->reuse_prev->reuse_next = chunk->reuse_next;
+	chunk->reuse_next->reuse_prev = chunk->reuse_prev;
+	if (pool->reuse_pool == chunk) {
+		pool->reuse_pool = chunk->reuse_next;
+	}
+}
+
+#ifdef __unix__
+/**
+ * Maps a chunk aligned to its size. More than needed is mapped, the parts
+ * before and after the aligned chunk are unmapped again.
+ */
+static void *
+chunk_map(struct CxPreallocPool *pool) {
+	size_t size = pool->chunk_size;
+	char *mapping = mmap(
+			NULL, size * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+			-1, 0);
+	if (mapping == MAP_FAILED) {
+		return NULL;
+	}
+
+	uintptr_t address = (uintptr_t)mapping;
+	char *chunk = (char *)((address + size - 1) & ~(uintptr_t)(size - 1));
+	size_t head = (size_t)(chunk - mapping);
+	if (head > 0) {
+		munmap(mapping, head);
+	}
+	munmap(chunk + size, size - head);
+
+#	ifdef MADV_HUGEPAGE
+	if (pool->huge_pages) {
+		// Only a hint, the chunk works without huge pages as well.
+		madvise(chunk, size, MADV_HUGEPAGE);
+	}
+#	endif
+	return chunk;
+}
+#endif
+
+static void *
+chunk_alloc(struct CxPreallocPool *pool) {
+#ifdef __unix__
+	if (pool->mapped) {
+		// Anonymous mappings are zeroed by the kernel.
+		return chunk_map(pool);
+	}
+#endif
+	void *chunk = aligned_alloc(pool->chunk_size, pool->chunk_size);
+	if (chunk == NULL) {
+		return NULL;
+	} else if (pool->lazy_zero) {
+		// Elements are zeroed when they are handed out the first time.
+		memset(chunk, 0, sizeof(struct CxPreallocChunk));
+	} else {
+		memset(chunk, 0, pool->chunk_size);
+	}
+	return chunk;
+}
+
+static void
+chunk_release(struct CxPreallocPool *pool, struct CxPreallocChunk *chunk) {
+#ifdef __unix__
+	if (pool->mapped) {
+		munmap(chunk, pool->chunk_size);
+		return;
+	}
+#endif
+	free(chunk);
+}
+
+static void
+chunk_free(struct CxPreallocPool *pool, struct CxPreallocChunk *chunk) {
+	if (chunk->reusable) {
+		reuse_list_remove(pool, chunk);
+	}
+	if (chunk->prev != NULL) {
+		chunk->prev->next = chunk->next;
+	} else {
+		pool->chunks = chunk->next;
+	}
+	if (chunk->next != NULL) {
+		chunk->next->prev = chunk->prev;
+	}
+	pool->chunk_count--;
+	chunk_release(pool, chunk);
+}
+
+static struct CxPreallocChunk *
+add_chunk(struct CxPreallocPool *pool) {
+	struct CxPreallocChunk *chunk = chunk_alloc(pool);
+	if (chunk == NULL) {
+		return NULL;
+	}
+	chunk->next_offset = header_size();
+
+	chunk->next = pool->chunks;
+	if (pool->chunks != NULL) {
+		pool->chunks->prev = chunk;
+	}
+	pool->chunks = chunk;
+	pool->chunk_count++;
+	pool->empty_count++;
+	reuse_list_add(pool, chunk, false);
+	return chunk;
 }
 
 void
-cx_prealloc_pool_init2(
-		struct CxPreallocPool *pool, size_t element_count,
-		size_t element_size) {
+cx_prealloc_pool_init3(
+		struct CxPreallocPool *pool,
+		const struct CxPreallocPoolOptions *options) {
+	size_t element_size = options->element_size;
+	size_t element_count =
+			options->element_count == 0 ? 8 : options->element_count;
+	size_t min_size = header_size() + element_count * element_size;
 	assert(element_size >= sizeof(union ReuseList));
-	assert(element_count > 0);
 	memset(pool, 0, sizeof(struct CxPreallocPool));
-	pool->chunk_size = element_count * element_size;
+
+#ifdef __unix__
+	pool->mapped = options->use_mmap || options->huge_pages;
+	pool->huge_pages = options->huge_pages;
+#endif
+	pool->lazy_zero = options->lazy_zero;
+	if (pool->huge_pages && min_size < HUGE_PAGE_SIZE) {
+		// A huge page can only back a chunk that spans all of it.
+		min_size = HUGE_PAGE_SIZE;
+	}
+
+	size_t chunk_size = MIN_CHUNK_SIZE;
+	while (chunk_size < min_size) {
+		chunk_size *= 2;
+	}
+	if (options->max_chunk_size > 0) {
+		while (chunk_size > MIN_CHUNK_SIZE &&
+			   chunk_size > options->max_chunk_size) {
+			chunk_size /= 2;
+		}
+	}
+	// A chunk holds at least one element.
+	while (chunk_size < header_size() + element_size) {
+		chunk_size *= 2;
+	}
+	pool->chunk_size = chunk_size;
 	pool->element_size = element_size;
 }
 
 void *
 cx_prealloc_pool_get(struct CxPreallocPool *pool) {
-	if (pool->reuse_pool != NULL) {
-		return reuse_node(pool);
-	} else if (
-			pool->pools == NULL ||
-			pool->next_offset + pool->element_size > pool->chunk_size) {
-		if (add_chunk(pool) < 0) {
+	struct CxPreallocChunk *chunk = pool->reuse_pool;
+	char *element = NULL;
+
+	if (chunk == NULL) {
+		chunk = add_chunk(pool);
+		if (chunk == NULL) {
 			return NULL;
 		}
 	}
 
-	void *element = &pool->current_pool[pool->next_offset];
-	pool->next_offset += pool->element_size;
+	if (chunk->free_list != NULL) {
+		union ReuseList *node = chunk->free_list;
+		chunk->free_list = node->next;
+		memset(node, 0, sizeof(union ReuseList));
+		element = &node->element;
+	} else {
+		element = &((char *)chunk)[chunk->next_offset];
+		chunk->next_offset += pool->element_size;
+		if (pool->lazy_zero && !pool->mapped) {
+			memset(element, 0, pool->element_size);
+		}
+	}
+
+	if (chunk->live == 0) {
+		pool->empty_count--;
+	}
+	chunk->live++;
+	if (chunk_is_full(pool, chunk)) {
+		reuse_list_remove(pool, chunk);
+	}
 	return element;
 }
 
 void
 cx_prealloc_pool_recycle(struct CxPreallocPool *pool, void *element) {
-	if (element != NULL) {
-		// Save the next pointer in the element.
-		*(void **)element = pool->reuse_pool;
-		pool->reuse_pool = element;
+	if (element == NULL) {
+		return;
+	}
+
+	struct CxPreallocChunk *chunk = element_chunk(pool, element);
+	union ReuseList *node = element;
+	node->next = chunk->free_list;
+	chunk->free_list = node;
+	chunk->live--;
+
+	if (chunk->live > 0) {
+		if (!chunk->reusable) {
+			reuse_list_add(pool, chunk, false);
+		}
+	} else if (pool->empty_count > 0) {
+		// Keep a single empty chunk around, so that a pool that hovers
+		// around a chunk boundary does not allocate and free all the time.
+		chunk_free(pool, chunk);
+	} else {
+		pool->empty_count++;
+		// Fill the other chunks first, so that this one may stay empty.
+		if (chunk->reusable) {
+			reuse_list_remove(pool, chunk);
+		}
+		reuse_list_add(pool, chunk, true);
 	}
 }
 
+size_t
+cx_prealloc_pool_trim(struct CxPreallocPool *pool) {
+	size_t freed = 0;
+	struct CxPreallocChunk *chunk = pool->chunks;
+	while (chunk != NULL) {
+		struct CxPreallocChunk *next = chunk->next;
+		if (chunk->live == 0) {
+			chunk_free(pool, chunk);
+			freed++;
+		}
+		chunk = next;
+	}
+	pool->empty_count = 0;
+	return freed;
+}
+
 void
 cx_prealloc_pool_cleanup(struct CxPreallocPool *pool) {
-	for (cx_index_t i = 0; i < pool->pool_count; i++) {
-		free(pool->pools[i]);
+	struct CxPreallocChunk *chunk = pool->chunks;
+	while (chunk != NULL) {
+		struct CxPreallocChunk *next = chunk->next;
+		chunk_release(pool, chunk);
+		chunk = next;
 	}
-
-	free(pool->pools);
+	pool->chunks = NULL;
+	pool->reuse_pool = NULL;
 }
 #endif
 
+void
+cx_prealloc_pool_init2(
+		struct CxPreallocPool *pool, size_t element_count,
+		size_t element_size) {
+	assert(element_count > 0);
+	struct CxPreallocPoolOptions options = {
+			.element_size = element_size,
+			.element_count = element_count,
+	};
+	cx_prealloc_pool_init3(pool, &options);
+}
+
 void
 cx_prealloc_pool_init(struct CxPreallocPool *pool, size_t element_size) {
 	cx_prealloc_pool_init2(pool, 8, element_size);
@@ -0,0 +1,77 @@
+#include "../../include/cextras/memory.h"
+#include <assert.h>
+
+#define MIN_CLASS_SIZE 16
+#define MAX_CLASS_SIZE (MIN_CLASS_SIZE << (CX_SLAB_CLASS_COUNT - 1))
+
+static size_t
+size_class(size_t size) {
+	size_t index = 0;
+	size_t class_size = MIN_CLASS_SIZE;
+	while (class_size < size) {
+		class_size *= 2;
+		index++;
+	}
+	return index;
+}
+
+void
+cx_slab_init(struct CxSlab *slab) {
+	for (size_t i = 0; i < CX_SLAB_CLASS_COUNT; i++) {
+		cx_prealloc_pool_init(&slab->pools[i], (size_t)MIN_CLASS_SIZE << i);
+		slab->live[i] = 0;
+		slab->allocations[i] = 0;
+	}
+}
+
+void *
+cx_slab_alloc(struct CxSlab *slab, size_t size) {
+	if (size > MAX_CLASS_SIZE) {
+		return malloc(size);
+	}
+
+	size_t index = size_class(size);
+	void *memory = cx_prealloc_pool_get(&slab->pools[index]);
+	if (memory == NULL) {
+		return NULL;
+	}
+	slab->live[index]++;
+	slab->allocations[index]++;
+	return memory;
+}
+
+void
+cx_slab_free(struct CxSlab *slab, void *memory, size_t size) {
+	if (memory == NULL) {
+		return;
+	} else if (size > MAX_CLASS_SIZE) {
+		free(memory);
+		return;
+	}
+
+	size_t index = size_class(size);
+	assert(slab->live[index] > 0);
+	cx_prealloc_pool_recycle(&slab->pools[index], memory);
+	slab->live[index]--;
+}
+
+int
+cx_slab_stats(
+		const struct CxSlab *slab, size_t size_class,
+		struct CxSlabStats *stats) {
+	if (size_class >= CX_SLAB_CLASS_COUNT) {
+		return -1;
+	}
+	stats->element_size = slab->pools[size_class].element_size;
+	stats->live = slab->live[size_class];
+	stats->allocations = slab->allocations[size_class];
+	stats->chunk_count = slab->pools[size_class].chunk_count;
+	return 0;
+}
+
+void
+cx_slab_cleanup(struct CxSlab *slab) {
+	for (size_t i = 0; i < CX_SLAB_CLASS_COUNT; i++) {
+		cx_prealloc_pool_cleanup(&slab->pools[i]);
+	}
+}
@@ -0,0 +1,210 @@
+#include <assert.h>
+#include <cextras/concurrency.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <testlib.h>
+
+struct Summer {
+	struct CxCoroutine coroutine;
+	cx_future_t inputs[8];
+	size_t index;
+	intptr_t sum;
+};
+
+static int
+summer(struct CxCoroutine *coroutine, void *arg) {
+	struct Summer *summer = arg;
+	void *value = NULL;
+
+	CX_COROUTINE_BEGIN(coroutine);
+	for (summer->index = 0; summer->index < 8; summer->index++) {
+		CX_COROUTINE_AWAIT(coroutine, summer->inputs[summer->index], value);
+		summer->sum += (intptr_t)value;
+	}
+	CX_COROUTINE_RETURN(coroutine, (void *)summer->sum);
+	CX_COROUTINE_END(coroutine);
+}
+
+static void
+test_await_resolved_later(void) {
+	struct CxThreadpool pool = {0};
+	struct Summer summer_state = {0};
+	int rv = cx_threadpool_init(&pool, 1);
+	assert(rv == 0);
+
+	for (size_t i = 0; i < 8; i++) {
+		summer_state.inputs[i] = cx_future_init(NULL);
+		assert(summer_state.inputs[i] != NULL);
+	}
+	// Half of the inputs are resolved before the coroutine awaits them.
+	for (size_t i = 0; i < 4; i++) {
+		cx_future_resolve(summer_state.inputs[i], (void *)(intptr_t)(i + 1));
+	}
+	cx_future_t result = cx_coroutine_start(
+			&summer_state.coroutine, &pool, summer, &summer_state);
+	assert(result != NULL);
+	for (size_t i = 4; i < 8; i++) {
+		cx_future_resolve(summer_state.inputs[i], (void *)(intptr_t)(i + 1));
+	}
+
+	assert((intptr_t)cx_future_wait(result) == 36);
+	cx_future_destroy(result);
+	for (size_t i = 0; i < 8; i++) {
+		cx_future_destroy(summer_state.inputs[i]);
+	}
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+}
+
+struct Waiters {
+	cx_future_t gate;
+	atomic_size_t resumed;
+};
+
+static int
+waiter(struct CxCoroutine *coroutine, void *arg) {
+	struct Waiters *waiters = arg;
+	void *value = NULL;
+
+	CX_COROUTINE_BEGIN(coroutine);
+	CX_COROUTINE_AWAIT(coroutine, waiters->gate, value);
+	atomic_fetch_add(&waiters->resumed, (size_t)(intptr_t)value);
+	CX_COROUTINE_END(coroutine);
+}
+
+static void
+test_more_coroutines_than_workers(void) {
+	enum { COUNT = 1000 };
+	struct CxThreadpool pool = {0};
+	struct Waiters waiters = {0};
+	struct CxCoroutine *coroutines = calloc(COUNT, sizeof(*coroutines));
+	cx_future_t *results = calloc(COUNT, sizeof(*results));
+	assert(coroutines != NULL && results != NULL);
+	int rv = cx_threadpool_init(&pool, 2);
+	assert(rv == 0);
+
+	waiters.gate = cx_future_init(NULL);
+	assert(waiters.gate != NULL);
+	// Every coroutine is suspended on the same future. With blocking waits
+	// the two workers could never get to the last one.
+	for (size_t i = 0; i < COUNT; i++) {
+		results[i] =
+				cx_coroutine_start(&coroutines[i], &pool, waiter, &waiters);
+		assert(results[i] != NULL);
+	}
+	rv = cx_threadpool_wait(&pool);
+	assert(rv == 0);
+	assert(atomic_load(&waiters.resumed) == 0);
+
+	cx_future_resolve(waiters.gate, (void *)1);
+	for (size_t i = 0; i < COUNT; i++) {
+		assert(cx_future_wait(results[i]) == NULL);
+		cx_future_destroy(results[i]);
+	}
+	assert(atomic_load(&waiters.resumed) == COUNT);
+
+	cx_future_destroy(waiters.gate);
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+	free(coroutines);
+	free(results);
+}
+
+static void *
+add_one(void *value) {
+	return (void *)((intptr_t)value + 1);
+}
+
+struct Chain {
+	struct CxThreadpool *pool;
+	cx_future_t future;
+};
+
+static int
+chain(struct CxCoroutine *coroutine, void *arg) {
+	struct Chain *chain = arg;
+	void *value = NULL;
+
+	CX_COROUTINE_BEGIN(coroutine);
+	chain->future = cx_threadpool_submit(chain->pool, add_one, (void *)41);
+	CX_COROUTINE_AWAIT(coroutine, chain->future, value);
+	cx_future_destroy(chain->future);
+	CX_COROUTINE_RETURN(coroutine, value);
+	CX_COROUTINE_END(coroutine);
+}
+
+static void
+test_await_submitted(void) {
+	struct CxThreadpool pool = {0};
+	struct CxCoroutine coroutine = {0};
+	struct Chain chain_state = {.pool = &pool};
+	int rv = cx_threadpool_init(&pool, 1);
+	assert(rv == 0);
+
+	cx_future_t result =
+			cx_coroutine_start(&coroutine, &pool, chain, &chain_state);
+	assert(result != NULL);
+	assert((intptr_t)cx_future_wait(result) == 42);
+	cx_future_destroy(result);
+
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+}
+
+struct Race {
+	struct CxCoroutine coroutine;
+	cx_future_t future;
+	atomic_bool started;
+	size_t delay;
+};
+
+static int
+racer(struct CxCoroutine *coroutine, void *arg) {
+	struct Race *race = arg;
+	void *value = NULL;
+
+	CX_COROUTINE_BEGIN(coroutine);
+	atomic_store(&race->started, true);
+	// Vary the delay to hit different points of cx_future_resolve.
+	for (volatile size_t i = 0; i < race->delay; i++) {
+	}
+	CX_COROUTINE_AWAIT(coroutine, race->future, value);
+	CX_COROUTINE_RETURN(coroutine, value);
+	CX_COROUTINE_END(coroutine);
+}
+
+static void
+test_await_while_resolving(void) {
+	struct CxThreadpool pool = {0};
+	int rv = cx_threadpool_init(&pool, 2);
+	assert(rv == 0);
+
+	// The coroutine awaits while the main thread resolves, it must get the
+	// value whichever side wins.
+	for (size_t i = 0; i < 256; i++) {
+		struct Race race = {.delay = i % 64};
+		race.future = cx_future_init(NULL);
+		assert(race.future != NULL);
+		cx_future_t result =
+				cx_coroutine_start(&race.coroutine, &pool, racer, &race);
+		assert(result != NULL);
+		while (!atomic_load(&race.started)) {
+		}
+		cx_future_resolve(race.future, (void *)1);
+
+		assert(cx_future_wait(result) == (void *)1);
+		cx_future_destroy(result);
+		cx_future_destroy(race.future);
+	}
+
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+}
+
+DECLARE_TESTS
+TEST(test_await_resolved_later)
+TEST(test_more_coroutines_than_workers)
+TEST(test_await_submitted)
+TEST(test_await_while_resolving)
+END_TESTS
@@ -2,11 +2,14 @@
 
 #include <assert.h>
 #include <cextras/concurrency.h>
+#include <cextras/error.h>
 #include <pthread.h>
 #include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <testlib.h>
+#include <time.h>
 #include <unistd.h>
 
 static void
@@ -85,8 +88,159 @@ test_first_resolve_then_wait(void) {
 	cx_threadpool_cleanup(&pool);
 }
 
+static void *
+add_one(void *arg) {
+	uintptr_t value = (uintptr_t)arg;
+	return (void *)(value + 1);
+}
+
+static void *
+slow_add_one(void *arg) {
+	usleep(10000);
+	return add_one(arg);
+}
+
+static void
+test_submit(void) {
+	int rv = 0;
+	struct CxThreadpool pool = {0};
+	rv = cx_threadpool_init(&pool, 2);
+	assert(rv == 0);
+
+	cx_future_t future = cx_threadpool_submit(&pool, add_one, (void *)41);
+	assert(future != NULL);
+	assert(cx_future_wait(future) == (void *)42);
+	cx_future_destroy(future);
+
+	// A return value of NULL resolves the future as well.
+	future = cx_threadpool_submit(&pool, add_one, (void *)UINTPTR_MAX);
+	assert(future != NULL);
+	assert(cx_future_wait(future) == NULL);
+	cx_future_destroy(future);
+
+	cx_threadpool_cleanup(&pool);
+}
+
+static void
+test_then(void) {
+	int rv = 0;
+	struct CxThreadpool pool = {0};
+	rv = cx_threadpool_init(&pool, 2);
+	assert(rv == 0);
+
+	cx_future_t first = cx_threadpool_submit(&pool, slow_add_one, (void *)0);
+	assert(first != NULL);
+	cx_future_t second = cx_future_then(first, &pool, add_one);
+	assert(second != NULL);
+	cx_future_t third = cx_future_then(second, &pool, add_one);
+	assert(third != NULL);
+
+	// Intermediate futures can be released before they resolve.
+	cx_future_destroy(first);
+	cx_future_destroy(second);
+
+	assert(cx_future_wait(third) == (void *)3);
+	cx_future_destroy(third);
+
+	cx_threadpool_cleanup(&pool);
+}
+
+static void
+test_then_resolved(void) {
+	int rv = 0;
+	struct CxThreadpool pool = {0};
+	rv = cx_threadpool_init(&pool, 1);
+	assert(rv == 0);
+
+	cx_future_t future = cx_future_init(NULL);
+	assert(future != NULL);
+	cx_future_resolve(future, (void *)1);
+
+	cx_future_t next = cx_future_then(future, &pool, add_one);
+	assert(next != NULL);
+	assert(cx_future_wait(next) == (void *)2);
+
+	cx_future_destroy(next);
+	cx_future_destroy(future);
+	cx_threadpool_cleanup(&pool);
+}
+
+static void
+test_pool_allocated(void) {
+	int rv = 0;
+	struct CxThreadpool pool = {0};
+	struct CxPreallocPool future_pool = {0};
+	rv = cx_threadpool_init(&pool, 2);
+	assert(rv == 0);
+	cx_prealloc_pool_init(&future_pool, sizeof(struct CxFuture));
+
+	for (uintptr_t i = 0; i < 100; i++) {
+		struct CxFuture *future = cx_prealloc_pool_get(&future_pool);
+		assert(future != NULL);
+		cx_future_init2(future, (void *)i);
+
+		cx_future_t next = cx_future_then(future, &pool, add_one);
+		assert(next != NULL);
+		cx_future_resolve(future, (void *)i);
+		assert(cx_future_wait(future) == (void *)i);
+
+		// Waits for the continuation to release its reference.
+		cx_future_cleanup(future);
+		cx_prealloc_pool_recycle(&future_pool, future);
+
+		assert(cx_future_wait(next) == (void *)(i + 1));
+		cx_future_destroy(next);
+	}
+
+	cx_prealloc_pool_cleanup(&future_pool);
+	cx_threadpool_cleanup(&pool);
+}
+
+static void
+test_try_get(void) {
+	void *value = NULL;
+	cx_future_t future = cx_future_init(NULL);
+	assert(future != NULL);
+
+	assert(cx_future_try_get(future, &value) == -CX_ERR_WOULD_BLOCK);
+	cx_future_resolve(future, (void *)42);
+	assert(cx_future_try_get(future, &value) == 0);
+	assert(value == (void *)42);
+
+	cx_future_destroy(future);
+}
+
+static void
+test_wait_until(void) {
+	void *value = NULL;
+	struct timespec deadline;
+	cx_future_t future = cx_future_init(NULL);
+	assert(future != NULL);
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_nsec += 10000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	assert(cx_future_wait_until(future, &deadline, &value) ==
+		   -CX_ERR_TIMEOUT);
+
+	cx_future_resolve(future, (void *)42);
+	assert(cx_future_wait_until(future, &deadline, &value) == 0);
+	assert(value == (void *)42);
+
+	cx_future_destroy(future);
+}
+
 DECLARE_TESTS
 TEST(test_simple_future)
 TEST(test_first_wait_then_resolve)
 TEST(test_first_resolve_then_wait)
+TEST(test_submit)
+TEST(test_then)
+TEST(test_then_resolved)
+TEST(test_pool_allocated)
+TEST(test_try_get)
+TEST(test_wait_until)
 END_TESTS
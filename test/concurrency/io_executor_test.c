@@ -0,0 +1,163 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <cextras/concurrency.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <testlib.h>
+#include <unistd.h>
+
+#define LENGTH(x) (sizeof(x) / sizeof(x[0]))
+#define BLOCK_SIZE 64
+#define BLOCK_COUNT 1024
+
+static int
+create_file(void) {
+	char path[] = "/tmp/cextras-io-XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	unlink(path);
+
+	for (size_t i = 0; i < BLOCK_COUNT; i++) {
+		char block[BLOCK_SIZE];
+		memset(block, (int)(i % 251), sizeof(block));
+		ssize_t written = pwrite(fd, block, sizeof(block), i * BLOCK_SIZE);
+		assert(written == BLOCK_SIZE);
+	}
+	return fd;
+}
+
+static void
+run_read_many(bool use_threadpool) {
+	struct CxThreadpool pool = {0};
+	struct CxIoExecutor executor = {0};
+	struct CxIoExecutorOptions options = {.use_threadpool = use_threadpool};
+	static char buffers[BLOCK_COUNT][BLOCK_SIZE];
+	cx_future_t futures[BLOCK_COUNT];
+	int rv = 0;
+	int fd = create_file();
+
+	rv = cx_threadpool_init(&pool, 2);
+	assert(rv == 0);
+	rv = cx_io_executor_init2(&executor, &pool, &options);
+	assert(rv == 0);
+
+	// All reads are in flight at the same time.
+	for (size_t i = 0; i < BLOCK_COUNT; i++) {
+		futures[i] = cx_io_read(
+				&executor, fd, buffers[i], BLOCK_SIZE, i * BLOCK_SIZE);
+		assert(futures[i] != NULL);
+	}
+	for (size_t i = 0; i < BLOCK_COUNT; i++) {
+		intptr_t result = (intptr_t)cx_future_wait(futures[i]);
+		assert(result == BLOCK_SIZE);
+		assert(buffers[i][0] == (char)(i % 251));
+		assert(buffers[i][BLOCK_SIZE - 1] == (char)(i % 251));
+		cx_future_destroy(futures[i]);
+	}
+
+	rv = cx_io_executor_cleanup(&executor);
+	assert(rv == 0);
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+	close(fd);
+}
+
+static void
+test_read_many(void) {
+	run_read_many(false);
+}
+
+static void
+test_read_many_threadpool(void) {
+	run_read_many(true);
+}
+
+static void
+test_write_read(void) {
+	struct CxThreadpool pool = {0};
+	struct CxIoExecutor executor = {0};
+	const char data[] = "hello io";
+	char buffer[sizeof(data)] = {0};
+	int rv = 0;
+	int fd = create_file();
+
+	rv = cx_threadpool_init(&pool, 2);
+	assert(rv == 0);
+	rv = cx_io_executor_init(&executor, &pool);
+	assert(rv == 0);
+
+	cx_future_t future = cx_io_write(&executor, fd, data, sizeof(data), 100);
+	assert(future != NULL);
+	assert((intptr_t)cx_future_wait(future) == sizeof(data));
+	cx_future_destroy(future);
+
+	future = cx_io_read(&executor, fd, buffer, sizeof(buffer), 100);
+	assert(future != NULL);
+	assert((intptr_t)cx_future_wait(future) == sizeof(data));
+	cx_future_destroy(future);
+	assert(strcmp(buffer, data) == 0);
+
+	// Errors are reported as negative errno values.
+	future = cx_io_read(&executor, -1, buffer, sizeof(buffer), 0);
+	assert(future != NULL);
+	assert((intptr_t)cx_future_wait(future) < 0);
+	cx_future_destroy(future);
+
+	// Lengths that do not fit into 32 bits are rejected, not truncated.
+	future = cx_io_read(&executor, fd, buffer, (size_t)UINT32_MAX + 1, 0);
+	assert(future != NULL);
+	assert((intptr_t)cx_future_wait(future) == -EOVERFLOW);
+	cx_future_destroy(future);
+
+	rv = cx_io_executor_cleanup(&executor);
+	assert(rv == 0);
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+	close(fd);
+}
+
+static void *
+double_result(void *value) {
+	return (void *)((intptr_t)value * 2);
+}
+
+static void
+test_continuation(void) {
+	struct CxThreadpool pool = {0};
+	struct CxIoExecutor executor = {0};
+	char buffer[BLOCK_SIZE];
+	int rv = 0;
+	int fd = create_file();
+
+	rv = cx_threadpool_init(&pool, 2);
+	assert(rv == 0);
+	rv = cx_io_executor_init(&executor, &pool);
+	assert(rv == 0);
+
+	cx_future_t read = cx_io_read(&executor, fd, buffer, sizeof(buffer), 0);
+	assert(read != NULL);
+	cx_future_t doubled = cx_future_then(read, &pool, double_result);
+	assert(doubled != NULL);
+	assert((intptr_t)cx_future_wait(doubled) == 2 * BLOCK_SIZE);
+	cx_future_destroy(doubled);
+	cx_future_destroy(read);
+
+	rv = cx_io_executor_cleanup(&executor);
+	assert(rv == 0);
+	rv = cx_threadpool_wait(&pool);
+	assert(rv == 0);
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+	close(fd);
+}
+
+DECLARE_TESTS
+TEST(test_read_many)
+TEST(test_read_many_threadpool)
+TEST(test_write_read)
+TEST(test_continuation)
+END_TESTS
@@ -0,0 +1,172 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <cextras/concurrency.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <testlib.h>
+#include <unistd.h>
+
+#define LENGTH(x) (sizeof(x) / sizeof(x[0]))
+#define RANGE_SIZE 100000
+
+struct VisitContext {
+	size_t grain;
+	atomic_uchar visited[RANGE_SIZE];
+};
+
+static void
+visit(size_t begin, size_t end, void *arg) {
+	struct VisitContext *ctx = arg;
+
+	assert(begin < end);
+	assert(ctx->grain == 0 || end - begin <= ctx->grain);
+	for (size_t i = begin; i < end; i++) {
+		atomic_fetch_add(&ctx->visited[i], 1);
+	}
+}
+
+static void
+run_visit(size_t worker_count, size_t begin, size_t end, size_t grain) {
+	int rv = 0;
+	static struct VisitContext ctx;
+	struct CxThreadpool pool = {0};
+
+	ctx.grain = grain;
+	for (size_t i = 0; i < RANGE_SIZE; i++) {
+		atomic_init(&ctx.visited[i], 0);
+	}
+
+	rv = cx_threadpool_init(&pool, worker_count);
+	assert(rv == 0);
+
+	rv = cx_threadpool_parallel_for(&pool, begin, end, grain, visit, &ctx);
+	assert(rv == 0);
+
+	for (size_t i = 0; i < RANGE_SIZE; i++) {
+		assert(atomic_load(&ctx.visited[i]) == (i >= begin && i < end));
+	}
+
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+}
+
+static void
+test_parallel_for(void) {
+	run_visit(4, 0, RANGE_SIZE, 100);
+}
+
+static void
+test_parallel_for_grain_one(void) {
+	run_visit(2, 10, 1000, 1);
+}
+
+static void
+test_parallel_for_auto_grain(void) {
+	run_visit(4, 0, RANGE_SIZE, 0);
+}
+
+static void
+test_parallel_for_empty(void) {
+	run_visit(2, 5, 5, 1);
+}
+
+static void
+test_parallel_for_no_workers(void) {
+	int rv = 0;
+	static struct VisitContext ctx;
+	struct CxThreadpool pool = {0};
+
+	rv = cx_threadpool_init(&pool, 2);
+	assert(rv == 0);
+	rv = cx_threadpool_shutdown(&pool, CX_THREADPOOL_SHUTDOWN_DRAIN, NULL);
+	assert(rv == 0);
+	assert(cx_threadpool_worker_count(&pool) == 0);
+
+	// Without workers the range runs on the calling thread.
+	rv = cx_threadpool_parallel_for(&pool, 0, RANGE_SIZE, 0, visit, &ctx);
+	assert(rv == 0);
+	for (size_t i = 0; i < RANGE_SIZE; i++) {
+		assert(atomic_load(&ctx.visited[i]) == 1);
+	}
+
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+}
+
+struct ShutdownContext {
+	struct CxThreadpool pool;
+	atomic_bool release;
+	atomic_size_t blocked;
+	atomic_bool shut_down;
+	atomic_size_t visited;
+};
+
+static void
+block(void *arg) {
+	struct ShutdownContext *ctx = arg;
+
+	atomic_fetch_add(&ctx->blocked, 1);
+	while (!atomic_load(&ctx->release)) {
+		usleep(1000);
+	}
+}
+
+static void *
+shutdown_pool(void *arg) {
+	struct ShutdownContext *ctx = arg;
+	int rv = cx_threadpool_shutdown(
+			&ctx->pool, CX_THREADPOOL_SHUTDOWN_CANCEL, NULL);
+	assert(rv == 0);
+	return NULL;
+}
+
+static void
+visit_and_shutdown(size_t begin, size_t end, void *arg) {
+	struct ShutdownContext *ctx = arg;
+	pthread_t thread;
+
+	atomic_fetch_add(&ctx->visited, end - begin);
+	if (atomic_exchange(&ctx->shut_down, true)) {
+		return;
+	}
+	// The sub ranges are queued behind the blocked workers. Shut the pool
+	// down, so that they are cancelled instead.
+	int rv = pthread_create(&thread, NULL, shutdown_pool, ctx);
+	assert(rv == 0);
+	usleep(50000);
+	atomic_store(&ctx->release, true);
+	pthread_join(thread, NULL);
+}
+
+static void
+test_parallel_for_shutdown(void) {
+	static struct ShutdownContext ctx;
+	void *args[] = {&ctx, &ctx};
+	int rv = 0;
+
+	rv = cx_threadpool_init(&ctx.pool, LENGTH(args));
+	assert(rv == 0);
+	rv = cx_threadpool_schedule_batch(&ctx.pool, block, args, LENGTH(args));
+	assert(rv == 0);
+	while (atomic_load(&ctx.blocked) < LENGTH(args)) {
+		usleep(1000);
+	}
+
+	rv = cx_threadpool_parallel_for(
+			&ctx.pool, 0, RANGE_SIZE, 100, visit_and_shutdown, &ctx);
+	assert(rv < 0);
+	assert(atomic_load(&ctx.visited) < RANGE_SIZE);
+
+	rv = cx_threadpool_cleanup(&ctx.pool);
+	assert(rv == 0);
+}
+
+DECLARE_TESTS
+TEST(test_parallel_for)
+TEST(test_parallel_for_grain_one)
+TEST(test_parallel_for_auto_grain)
+TEST(test_parallel_for_empty)
+TEST(test_parallel_for_no_workers)
+TEST(test_parallel_for_shutdown)
+END_TESTS
@@ -0,0 +1,116 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <cextras/concurrency.h>
+#include <cextras/error.h>
+#include <pthread.h>
+#include <testlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static void
+test_wait_post(void) {
+	int rv = 0;
+	struct CxSemaphore semaphore = {0};
+
+	rv = cx_semaphore_init(&semaphore, 2);
+	assert(rv == 0);
+
+	rv = cx_semaphore_wait(&semaphore);
+	assert(rv == 0);
+	rv = cx_semaphore_wait(&semaphore);
+	assert(rv == 0);
+	rv = cx_semaphore_post(&semaphore);
+	assert(rv == 0);
+	rv = cx_semaphore_wait(&semaphore);
+	assert(rv == 0);
+
+	rv = cx_semaphore_destroy(&semaphore);
+	assert(rv == 0);
+}
+
+static void
+test_try_wait(void) {
+	int rv = 0;
+	struct CxSemaphore semaphore = {0};
+
+	rv = cx_semaphore_init(&semaphore, 1);
+	assert(rv == 0);
+
+	rv = cx_semaphore_try_wait(&semaphore);
+	assert(rv == 0);
+	rv = cx_semaphore_try_wait(&semaphore);
+	assert(rv == -CX_ERR_WOULD_BLOCK);
+	rv = cx_semaphore_post(&semaphore);
+	assert(rv == 0);
+	rv = cx_semaphore_try_wait(&semaphore);
+	assert(rv == 0);
+
+	rv = cx_semaphore_destroy(&semaphore);
+	assert(rv == 0);
+}
+
+static void
+test_wait_timeout(void) {
+	int rv = 0;
+	struct CxSemaphore semaphore = {0};
+	struct timespec timeout = {.tv_sec = 0, .tv_nsec = 10000000};
+
+	rv = cx_semaphore_init(&semaphore, 0);
+	assert(rv == 0);
+
+	rv = cx_semaphore_wait_timeout(&semaphore, &timeout);
+	assert(rv == -CX_ERR_TIMEOUT);
+	rv = cx_semaphore_post(&semaphore);
+	assert(rv == 0);
+	rv = cx_semaphore_wait_timeout(&semaphore, &timeout);
+	assert(rv == 0);
+
+	rv = cx_semaphore_destroy(&semaphore);
+	assert(rv == 0);
+}
+
+static void *
+poster(void *arg) {
+	struct CxSemaphore *semaphore = arg;
+
+	for (size_t i = 0; i < 10000; i++) {
+		int rv = cx_semaphore_post(semaphore);
+		assert(rv == 0);
+	}
+	return NULL;
+}
+
+static void
+test_concurrent(void) {
+	int rv = 0;
+	struct CxSemaphore semaphore = {0};
+	pthread_t threads[2];
+
+	rv = cx_semaphore_init(&semaphore, 0);
+	assert(rv == 0);
+
+	for (size_t i = 0; i < 2; i++) {
+		rv = pthread_create(&threads[i], NULL, poster, &semaphore);
+		assert(rv == 0);
+	}
+	for (size_t i = 0; i < 20000; i++) {
+		rv = cx_semaphore_wait(&semaphore);
+		assert(rv == 0);
+	}
+	for (size_t i = 0; i < 2; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	rv = cx_semaphore_try_wait(&semaphore);
+	assert(rv == -CX_ERR_WOULD_BLOCK);
+
+	rv = cx_semaphore_destroy(&semaphore);
+	assert(rv == 0);
+}
+
+DECLARE_TESTS
+TEST(test_wait_post)
+TEST(test_try_wait)
+TEST(test_wait_timeout)
+TEST(test_concurrent)
+END_TESTS
@@ -3,8 +3,12 @@
 
 #include <assert.h>
 #include <cextras/concurrency.h>
+#include <cextras/error.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
 #include <testlib.h>
 #include <unistd.h>
 
@@ -122,9 +126,1228 @@ test_add_multiple_tasks(void) {
 	assert(atomic_load(&counter) == 10000);
 }
 
+static void
+thread_func_inc_fast(void *arg) {
+	atomic_uint *counter = arg;
+
+	atomic_fetch_add(counter, 1);
+}
+
+static void
+test_init_dirty_storage(void) {
+	struct CxThreadpool *pool = malloc(sizeof(struct CxThreadpool));
+	atomic_uint counter = 0;
+	int rv = 0;
+	assert(pool != NULL);
+
+	// The pool must not rely on zeroed storage.
+	memset(pool, 0xa5, sizeof(struct CxThreadpool));
+	rv = cx_threadpool_init(pool, 2);
+	assert(rv == 0);
+
+	for (size_t i = 0; i < 10; i++) {
+		rv = cx_threadpool_schedule(pool, thread_func_inc_fast, &counter);
+		assert(rv == 0);
+	}
+	rv = cx_threadpool_wait(pool);
+	assert(rv == 0);
+	assert(atomic_load(&counter) == 10);
+
+	rv = cx_threadpool_cleanup(pool);
+	assert(rv == 0);
+	free(pool);
+}
+
+static void
+test_work_stealing(void) {
+	struct CxThreadpool pool = {0};
+	int rv = 0;
+	atomic_uint counter = 0;
+
+	rv = cx_threadpool_init(&pool, 4);
+	assert(rv == 0);
+
+	for (size_t i = 0; i < 100000; i++) {
+		rv = cx_threadpool_schedule(&pool, thread_func_inc_fast, &counter);
+		assert(rv == 0);
+	}
+
+	rv = cx_threadpool_wait(&pool);
+	assert(rv == 0);
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+
+	assert(atomic_load(&counter) == 100000);
+}
+
+struct OwnedTask {
+	struct CxTask task;
+	atomic_uint *counter;
+};
+
+static void
+thread_func_owned(void *arg) {
+	struct OwnedTask *owned = arg;
+
+	atomic_fetch_add(owned->counter, 1);
+	// The task storage may be released from within the task.
+	free(owned);
+}
+
+static void
+test_schedule_task(void) {
+	struct CxThreadpool pool = {0};
+	int rv = 0;
+	atomic_uint counter = 0;
+
+	rv = cx_threadpool_init(&pool, 2);
+	assert(rv == 0);
+
+	for (size_t i = 0; i < 1000; i++) {
+		struct OwnedTask *owned = calloc(1, sizeof(struct OwnedTask));
+		assert(owned != NULL);
+		owned->counter = &counter;
+		cx_task_init(&owned->task, thread_func_owned, owned);
+		rv = cx_threadpool_schedule_task(&pool, &owned->task);
+		assert(rv == 0);
+	}
+
+	rv = cx_threadpool_wait(&pool);
+	assert(rv == 0);
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+
+	assert(atomic_load(&counter) == 1000);
+}
+
+static void
+test_schedule_batch(void) {
+	struct CxThreadpool pool = {0};
+	int rv = 0;
+	atomic_uint counter = 0;
+	void *args[1001];
+
+	for (size_t i = 0; i < LENGTH(args); i++) {
+		args[i] = &counter;
+	}
+
+	rv = cx_threadpool_init(&pool, 4);
+	assert(rv == 0);
+
+	rv = cx_threadpool_schedule_batch(
+			&pool, thread_func_inc_fast, args, LENGTH(args));
+	assert(rv == 0);
+	rv = cx_threadpool_schedule_batch(&pool, thread_func_inc_fast, args, 2);
+	assert(rv == 0);
+	rv = cx_threadpool_schedule_batch(&pool, thread_func_inc_fast, args, 0);
+	assert(rv == 0);
+
+	rv = cx_threadpool_wait(&pool);
+	assert(rv == 0);
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+
+	assert(atomic_load(&counter) == LENGTH(args) + 2);
+}
+
+struct BlockContext {
+	atomic_bool started;
+	atomic_bool release;
+};
+
+static void
+thread_func_block(void *arg) {
+	struct BlockContext *ctx = arg;
+
+	atomic_store(&ctx->started, true);
+	while (!atomic_load(&ctx->release)) {
+		usleep(1000);
+	}
+}
+
+static void
+test_task_group(void) {
+	struct CxThreadpool pool = {0};
+	struct CxTaskGroup slow_group = {0};
+	struct CxTaskGroup fast_group = {0};
+	int rv = 0;
+	struct BlockContext block = {0};
+	atomic_uint counter = 0;
+
+	rv = cx_threadpool_init(&pool, 2);
+	assert(rv == 0);
+	rv = cx_task_group_init(&slow_group, &pool);
+	assert(rv == 0);
+	rv = cx_task_group_init(&fast_group, &pool);
+	assert(rv == 0);
+
+	rv = cx_task_group_schedule(&slow_group, thread_func_block, &block);
+	assert(rv == 0);
+	while (!atomic_load(&block.started)) {
+		usleep(1000);
+	}
+	for (size_t i = 0; i < 100; i++) {
+		rv = cx_task_group_schedule(
+				&fast_group, thread_func_inc_fast, &counter);
+		assert(rv == 0);
+	}
+
+	// Must not wait for the blocked task of the other group.
+	rv = cx_task_group_wait(&fast_group);
+	assert(rv == 0);
+	assert(atomic_load(&counter) == 100);
+
+	atomic_store(&block.release, true);
+	rv = cx_task_group_wait(&slow_group);
+	assert(rv == 0);
+
+	cx_task_group_cleanup(&slow_group);
+	cx_task_group_cleanup(&fast_group);
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+}
+
+struct NestedContext {
+	struct CxThreadpool *pool;
+	atomic_uint counter;
+};
+
+static void
+thread_func_nested(void *arg) {
+	struct NestedContext *ctx = arg;
+	struct CxTaskGroup group = {0};
+	int rv = 0;
+
+	rv = cx_task_group_init(&group, ctx->pool);
+	assert(rv == 0);
+	for (size_t i = 0; i < 10; i++) {
+		rv = cx_task_group_schedule(
+				&group, thread_func_inc_fast, &ctx->counter);
+		assert(rv == 0);
+	}
+	// With a single worker, this only finishes if the waiting worker helps.
+	rv = cx_task_group_wait(&group);
+	assert(rv == 0);
+	cx_task_group_cleanup(&group);
+}
+
+static void
+test_task_group_nested(void) {
+	struct CxThreadpool pool = {0};
+	struct NestedContext ctx = {.pool = &pool};
+	int rv = 0;
+
+	rv = cx_threadpool_init(&pool, 1);
+	assert(rv == 0);
+
+	rv = cx_threadpool_schedule(&pool, thread_func_nested, &ctx);
+	assert(rv == 0);
+
+	rv = cx_threadpool_wait(&pool);
+	assert(rv == 0);
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+
+	assert(atomic_load(&ctx.counter) == 10);
+}
+
+struct PinnedContext {
+	atomic_uint counter;
+	int cpu;
+};
+
+static void
+thread_func_check_cpu(void *arg) {
+	struct PinnedContext *ctx = arg;
+
+	assert(sched_getcpu() == ctx->cpu);
+	atomic_fetch_add(&ctx->counter, 1);
+}
+
+static int
+first_allowed_cpu(void) {
+	cpu_set_t set;
+	int rv = sched_getaffinity(0, sizeof(set), &set);
+	assert(rv == 0);
+
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &set)) {
+			return cpu;
+		}
+	}
+	abort();
+}
+
+static void
+test_pinned_workers(void) {
+	struct CxThreadpool pool = {0};
+	int rv = 0;
+	struct PinnedContext ctx = {.cpu = first_allowed_cpu()};
+	const int cpus[] = {ctx.cpu};
+	struct CxThreadpoolOptions options = {
+			.worker_count = 2,
+			.cpus = cpus,
+			.cpu_count = LENGTH(cpus),
+	};
+
+	rv = cx_threadpool_init2(&pool, &options);
+	assert(rv == 0);
+
+	for (size_t i = 0; i < 100; i++) {
+		rv = cx_threadpool_schedule(&pool, thread_func_check_cpu, &ctx);
+		assert(rv == 0);
+	}
+
+	rv = cx_threadpool_wait(&pool);
+	assert(rv == 0);
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+
+	assert(atomic_load(&ctx.counter) == 100);
+}
+
+static void
+test_numa_schedule(void) {
+	struct CxThreadpool pool = {0};
+	int rv = 0;
+	atomic_uint counter = 0;
+	struct CxThreadpoolOptions options = {
+			.worker_count = 4,
+			.numa_aware = true,
+	};
+
+	rv = cx_threadpool_init2(&pool, &options);
+	assert(rv == 0);
+
+	for (size_t i = 0; i < 100; i++) {
+		rv = cx_threadpool_schedule_on_node(
+				&pool, 0, thread_func_inc_fast, &counter);
+		assert(rv == 0);
+		// Unknown nodes fall back to any worker.
+		rv = cx_threadpool_schedule_on_node(
+				&pool, 4096, thread_func_inc_fast, &counter);
+		assert(rv == 0);
+	}
+
+	rv = cx_threadpool_wait(&pool);
+	assert(rv == 0);
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+
+	assert(atomic_load(&counter) == 200);
+}
+
+static void
+run_idle_policy(long spin_ns, long yield_ns) {
+	struct CxThreadpool pool = {0};
+	int rv = 0;
+	atomic_uint counter = 0;
+	struct CxThreadpoolOptions options = {
+			.worker_count = 4,
+			.idle_spin_ns = spin_ns,
+			.idle_yield_ns = yield_ns,
+	};
+
+	rv = cx_threadpool_init2(&pool, &options);
+	assert(rv == 0);
+
+	// Let the workers go idle between the rounds, so that every round has to
+	// wake them up again.
+	for (size_t round = 0; round < 20; round++) {
+		for (size_t i = 0; i < 10; i++) {
+			rv = cx_threadpool_schedule(&pool, thread_func_inc_fast, &counter);
+			assert(rv == 0);
+		}
+		rv = cx_threadpool_wait(&pool);
+		assert(rv == 0);
+		assert(atomic_load(&counter) == (round + 1) * 10);
+		usleep(1000);
+	}
+
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+}
+
+static void
+test_idle_policy(void) {
+	// Park immediately.
+	run_idle_policy(-1, -1);
+	// Only spin.
+	run_idle_policy(10000000, -1);
+	// Only yield.
+	run_idle_policy(-1, 10000000);
+	// Defaults.
+	run_idle_policy(0, 0);
+}
+
+struct PriorityLog {
+	atomic_uint index;
+	enum CxTaskPriority order[20];
+};
+
+struct PriorityTask {
+	struct PriorityLog *log;
+	enum CxTaskPriority priority;
+};
+
+static void
+thread_func_log_priority(void *arg) {
+	struct PriorityTask *task = arg;
+	unsigned int index = atomic_fetch_add(&task->log->index, 1);
+
+	task->log->order[index] = task->priority;
+}
+
+static void
+thread_func_wait_semaphore(void *arg) {
+	cx_semaphore_wait(arg);
+}
+
+static void
+test_priority(void) {
+	struct CxThreadpool pool = {0};
+	struct CxSemaphore blocker = {0};
+	struct PriorityLog log = {0};
+	struct PriorityTask tasks[20];
+	int rv = 0;
+
+	rv = cx_threadpool_init(&pool, 1);
+	assert(rv == 0);
+	rv = cx_semaphore_init(&blocker, 0);
+	assert(rv == 0);
+
+	// Keep the only worker busy until all tasks are queued.
+	rv = cx_threadpool_schedule(&pool, thread_func_wait_semaphore, &blocker);
+	assert(rv == 0);
+	for (size_t i = 0; i < LENGTH(tasks); i++) {
+		tasks[i].log = &log;
+		tasks[i].priority =
+				i < 10 ? CX_TASK_PRIORITY_LOW : CX_TASK_PRIORITY_HIGH;
+		rv = cx_threadpool_schedule_priority(
+				&pool, tasks[i].priority, thread_func_log_priority,
+				&tasks[i]);
+		assert(rv == 0);
+	}
+	cx_semaphore_post(&blocker);
+
+	rv = cx_threadpool_wait(&pool);
+	assert(rv == 0);
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+	cx_semaphore_destroy(&blocker);
+
+	assert(atomic_load(&log.index) == LENGTH(tasks));
+	size_t high_first = 0;
+	while (log.order[high_first] == CX_TASK_PRIORITY_HIGH) {
+		high_first++;
+	}
+	// Low priority tasks are let through now and then, but not before the
+	// first few high priority ones.
+	assert(high_first >= 5);
+	assert(log.order[LENGTH(tasks) - 1] == CX_TASK_PRIORITY_LOW);
+}
+
+struct OrderLog {
+	atomic_uint index;
+	size_t order[200];
+};
+
+struct OrderTask {
+	struct OrderLog *log;
+	size_t id;
+};
+
+static void
+thread_func_log_order(void *arg) {
+	struct OrderTask *task = arg;
+	unsigned int index = atomic_fetch_add(&task->log->index, 1);
+
+	task->log->order[index] = task->id;
+}
+
+static void
+test_fifo_order(void) {
+	struct CxThreadpool pool = {0};
+	struct CxSemaphore blocker = {0};
+	struct OrderLog log = {0};
+	struct OrderTask tasks[200];
+	int rv = 0;
+
+	rv = cx_threadpool_init(&pool, 1);
+	assert(rv == 0);
+	rv = cx_semaphore_init(&blocker, 0);
+	assert(rv == 0);
+
+	rv = cx_threadpool_schedule(&pool, thread_func_wait_semaphore, &blocker);
+	assert(rv == 0);
+	for (size_t i = 0; i < LENGTH(tasks); i++) {
+		tasks[i].log = &log;
+		tasks[i].id = i;
+		rv = cx_threadpool_schedule(&pool, thread_func_log_order, &tasks[i]);
+		assert(rv == 0);
+		if (i == LENGTH(tasks) / 2) {
+			// The second half arrives while the first half is running.
+			cx_semaphore_post(&blocker);
+		}
+	}
+
+	rv = cx_threadpool_wait(&pool);
+	assert(rv == 0);
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+	cx_semaphore_destroy(&blocker);
+
+	assert(atomic_load(&log.index) == LENGTH(tasks));
+	for (size_t i = 0; i < LENGTH(tasks); i++) {
+		assert(log.order[i] == i);
+	}
+}
+
+static void
+wait_for_worker_count(struct CxThreadpool *pool, size_t worker_count) {
+	for (size_t i = 0; i < 5000; i++) {
+		if (cx_threadpool_worker_count(pool) == worker_count) {
+			return;
+		}
+		usleep(1000);
+	}
+	assert(cx_threadpool_worker_count(pool) == worker_count);
+}
+
+static void
+test_resize(void) {
+	struct CxThreadpool pool = {0};
+	int rv = 0;
+	atomic_uint counter = 0;
+	struct CxThreadpoolOptions options = {
+			.worker_count = 2,
+			.max_worker_count = 6,
+			.idle_timeout_ns = 10000000,
+	};
+
+	rv = cx_threadpool_init2(&pool, &options);
+	assert(rv == 0);
+	assert(cx_threadpool_worker_count(&pool) == 2);
+
+	rv = cx_threadpool_resize(&pool, 100);
+	assert(rv == 0);
+	assert(cx_threadpool_worker_count(&pool) == 6);
+	for (size_t i = 0; i < 100; i++) {
+		rv = cx_threadpool_schedule(&pool, thread_func_inc_fast, &counter);
+		assert(rv == 0);
+	}
+	rv = cx_threadpool_wait(&pool);
+	assert(rv == 0);
+
+	rv = cx_threadpool_resize(&pool, 1);
+	assert(rv == 0);
+	wait_for_worker_count(&pool, 1);
+	for (size_t i = 0; i < 100; i++) {
+		rv = cx_threadpool_schedule(&pool, thread_func_inc_fast, &counter);
+		assert(rv == 0);
+	}
+	rv = cx_threadpool_wait(&pool);
+	assert(rv == 0);
+
+	// Reuse the slots of the retired workers.
+	rv = cx_threadpool_resize(&pool, 4);
+	assert(rv == 0);
+	assert(cx_threadpool_worker_count(&pool) == 4);
+
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+	assert(atomic_load(&counter) == 200);
+}
+
+struct BlockingTask {
+	struct CxThreadpool *pool;
+	struct CxSemaphore *semaphore;
+};
+
+static void
+thread_func_blocking_wait(void *arg) {
+	struct BlockingTask *task = arg;
+
+	cx_threadpool_blocking_begin(task->pool);
+	cx_semaphore_wait(task->semaphore);
+	cx_threadpool_blocking_end(task->pool);
+}
+
+static void
+thread_func_post_semaphore(void *arg) {
+	cx_semaphore_post(arg);
+}
+
+static void
+test_blocking_spare_worker(void) {
+	struct CxThreadpool pool = {0};
+	struct CxSemaphore semaphore = {0};
+	int rv = 0;
+	struct CxThreadpoolOptions options = {
+			.worker_count = 1,
+			.max_worker_count = 2,
+			.idle_timeout_ns = 10000000,
+	};
+	struct BlockingTask task = {.pool = &pool, .semaphore = &semaphore};
+
+	rv = cx_threadpool_init2(&pool, &options);
+	assert(rv == 0);
+	rv = cx_semaphore_init(&semaphore, 0);
+	assert(rv == 0);
+
+	// The only worker blocks until the second task runs, which needs a
+	// spare worker.
+	rv = cx_threadpool_schedule(&pool, thread_func_blocking_wait, &task);
+	assert(rv == 0);
+	rv = cx_threadpool_schedule(&pool, thread_func_post_semaphore, &semaphore);
+	assert(rv == 0);
+	rv = cx_threadpool_wait(&pool);
+	assert(rv == 0);
+
+	// The spare retires once idle.
+	wait_for_worker_count(&pool, 1);
+
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+	cx_semaphore_destroy(&semaphore);
+}
+
+static void
+test_stats(void) {
+	struct CxThreadpool pool = {0};
+	struct CxWorkerStats stats[4] = {0};
+	int rv = 0;
+	atomic_uint counter = 0;
+
+	rv = cx_threadpool_init(&pool, 2);
+	assert(rv == 0);
+
+	for (size_t i = 0; i < 100; i++) {
+		rv = cx_threadpool_schedule(&pool, thread_func_inc_fast, &counter);
+		assert(rv == 0);
+	}
+	rv = cx_threadpool_wait(&pool);
+	assert(rv == 0);
+
+	size_t worker_count = cx_threadpool_stats(&pool, stats, LENGTH(stats));
+	assert(worker_count == 2);
+
+	uint64_t executed = 0;
+	uint64_t histogram_total = 0;
+	uint64_t max_queue_depth = 0;
+	for (size_t i = 0; i < worker_count; i++) {
+		executed += stats[i].tasks_executed;
+		max_queue_depth = CX_MAX(max_queue_depth, stats[i].max_queue_depth);
+		assert(stats[i].tasks_stolen <= stats[i].steal_attempts);
+		for (size_t j = 0; j < CX_THREADPOOL_LATENCY_BUCKETS; j++) {
+			histogram_total += stats[i].latency_histogram[j];
+		}
+	}
+	assert(executed == 100);
+	assert(histogram_total == 100);
+	assert(max_queue_depth >= 1);
+
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+}
+
+static void
+thread_func_record_thread(void *arg) {
+	pthread_t *thread = arg;
+
+	*thread = pthread_self();
+}
+
+static void
+test_capacity_fail(void) {
+	struct CxThreadpool pool = {0};
+	struct CxSemaphore blocker = {0};
+	int rv = 0;
+	atomic_uint counter = 0;
+	void *args[] = {&counter, &counter, &counter};
+	struct CxThreadpoolOptions options = {
+			.worker_count = 1,
+			.queue_capacity = 2,
+			.overflow = CX_THREADPOOL_OVERFLOW_FAIL,
+	};
+
+	rv = cx_threadpool_init2(&pool, &options);
+	assert(rv == 0);
+	rv = cx_semaphore_init(&blocker, 0);
+	assert(rv == 0);
+
+	rv = cx_threadpool_schedule(&pool, thread_func_wait_semaphore, &blocker);
+	assert(rv == 0);
+	rv = cx_threadpool_schedule(&pool, thread_func_inc_fast, &counter);
+	assert(rv == 0);
+	rv = cx_threadpool_schedule(&pool, thread_func_inc_fast, &counter);
+	assert(rv == -CX_ERR_WOULD_BLOCK);
+	rv = cx_threadpool_schedule_batch(
+			&pool, thread_func_inc_fast, args, LENGTH(args));
+	assert(rv == -CX_ERR_WOULD_BLOCK);
+
+	cx_semaphore_post(&blocker);
+	rv = cx_threadpool_wait(&pool);
+	assert(rv == 0);
+	assert(atomic_load(&counter) == 1);
+
+	// The slots are released once the tasks are done.
+	rv = cx_threadpool_schedule_batch(&pool, thread_func_inc_fast, args, 2);
+	assert(rv == 0);
+	rv = cx_threadpool_wait(&pool);
+	assert(rv == 0);
+	assert(atomic_load(&counter) == 3);
+
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+	cx_semaphore_destroy(&blocker);
+}
+
+static void
+thread_func_mark(void *arg) {
+	atomic_bool *ran = arg;
+
+	assert(!atomic_exchange(ran, true));
+}
+
+static void
+test_capacity_fail_batch(void) {
+	struct CxThreadpool pool = {0};
+	struct CxSemaphore blocker = {0};
+	int rv = 0;
+	atomic_bool ran[6] = {0};
+	void *args[LENGTH(ran)];
+	struct CxThreadpoolOptions options = {
+			.worker_count = 1,
+			.queue_capacity = 4,
+			.overflow = CX_THREADPOOL_OVERFLOW_FAIL,
+	};
+
+	for (size_t i = 0; i < LENGTH(ran); i++) {
+		args[i] = &ran[i];
+	}
+	rv = cx_threadpool_init2(&pool, &options);
+	assert(rv == 0);
+	rv = cx_semaphore_init(&blocker, 0);
+	assert(rv == 0);
+
+	rv = cx_threadpool_schedule(&pool, thread_func_wait_semaphore, &blocker);
+	assert(rv == 0);
+
+	// Three slots are left, a batch of four is rejected as a whole.
+	rv = cx_threadpool_schedule_batch(&pool, thread_func_mark, args, 4);
+	assert(rv == -CX_ERR_WOULD_BLOCK);
+	rv = cx_threadpool_schedule_batch(&pool, thread_func_mark, &args[3], 3);
+	assert(rv == 0);
+
+	cx_semaphore_post(&blocker);
+	rv = cx_threadpool_wait(&pool);
+	assert(rv == 0);
+	for (size_t i = 0; i < LENGTH(ran); i++) {
+		assert(atomic_load(&ran[i]) == (i >= 3));
+	}
+
+	// The slots of the rejected batch were released.
+	rv = cx_threadpool_schedule_batch(&pool, thread_func_mark, args, 3);
+	assert(rv == 0);
+	rv = cx_threadpool_wait(&pool);
+	assert(rv == 0);
+	for (size_t i = 0; i < LENGTH(ran); i++) {
+		assert(atomic_load(&ran[i]));
+	}
+
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+	cx_semaphore_destroy(&blocker);
+}
+
+static void
+test_capacity_caller_runs(void) {
+	struct CxThreadpool pool = {0};
+	struct CxSemaphore blocker = {0};
+	int rv = 0;
+	pthread_t thread;
+	struct CxThreadpoolOptions options = {
+			.worker_count = 1,
+			.queue_capacity = 1,
+			.overflow = CX_THREADPOOL_OVERFLOW_CALLER_RUNS,
+	};
+
+	rv = cx_threadpool_init2(&pool, &options);
+	assert(rv == 0);
+	rv = cx_semaphore_init(&blocker, 0);
+	assert(rv == 0);
+
+	rv = cx_threadpool_schedule(&pool, thread_func_wait_semaphore, &blocker);
+	assert(rv == 0);
+	rv = cx_threadpool_schedule(&pool, thread_func_record_thread, &thread);
+	assert(rv == 0);
+	assert(pthread_equal(thread, pthread_self()));
+
+	cx_semaphore_post(&blocker);
+	rv = cx_threadpool_wait(&pool);
+	assert(rv == 0);
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+	cx_semaphore_destroy(&blocker);
+}
+
+static void
+test_capacity_block(void) {
+	struct CxThreadpool pool = {0};
+	int rv = 0;
+	atomic_uint counter = 0;
+	void *args[50];
+	struct CxThreadpoolOptions options = {
+			.worker_count = 2,
+			.queue_capacity = 4,
+			.overflow = CX_THREADPOOL_OVERFLOW_BLOCK,
+	};
+
+	for (size_t i = 0; i < LENGTH(args); i++) {
+		args[i] = &counter;
+	}
+
+	rv = cx_threadpool_init2(&pool, &options);
+	assert(rv == 0);
+
+	for (size_t i = 0; i < 100; i++) {
+		rv = cx_threadpool_schedule(&pool, thread_func_inc_fast, &counter);
+		assert(rv == 0);
+	}
+	rv = cx_threadpool_schedule_batch(
+			&pool, thread_func_inc_fast, args, LENGTH(args));
+	assert(rv == 0);
+	rv = cx_threadpool_wait(&pool);
+	assert(rv == 0);
+	assert(atomic_load(&counter) == 150);
+
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+}
+
+struct FibTask {
+	struct CxTask task;
+	struct CxThreadpool *pool;
+	unsigned int n;
+	unsigned int result;
+};
+
+static void
+thread_func_fib(void *arg) {
+	struct FibTask *fib = arg;
+	int rv = 0;
+
+	if (fib->n < 2) {
+		fib->result = fib->n;
+		return;
+	}
+
+	struct FibTask left = {.pool = fib->pool, .n = fib->n - 1};
+	struct FibTask right = {.pool = fib->pool, .n = fib->n - 2};
+	cx_task_init(&left.task, thread_func_fib, &left);
+	rv = cx_task_fork(fib->pool, &left.task);
+	assert(rv == 0);
+	thread_func_fib(&right);
+	rv = cx_task_join(&left.task);
+	assert(rv == 0);
+
+	fib->result = left.result + right.result;
+}
+
+static void
+test_fork_join(void) {
+	struct CxThreadpool pool = {0};
+	int rv = 0;
+
+	rv = cx_threadpool_init(&pool, 2);
+	assert(rv == 0);
+
+	// Every task blocks in cx_task_join on its child, far more tasks than
+	// there are workers.
+	struct FibTask fib = {.pool = &pool, .n = 16};
+	cx_task_init(&fib.task, thread_func_fib, &fib);
+	rv = cx_task_fork(&pool, &fib.task);
+	assert(rv == 0);
+	rv = cx_task_join(&fib.task);
+	assert(rv == 0);
+	assert(fib.result == 987);
+
+	rv = cx_threadpool_wait(&pool);
+	assert(rv == 0);
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+}
+
+static void
+test_join_unforked(void) {
+	struct CxThreadpool pool = {0};
+	struct CxTask task = {0};
+	atomic_uint counter = 0;
+	int rv = 0;
+
+	rv = cx_threadpool_init(&pool, 2);
+	assert(rv == 0);
+	cx_task_init(&task, thread_func_inc_fast, &counter);
+	rv = cx_task_join(&task);
+	assert(rv < 0);
+
+	rv = cx_threadpool_shutdown(&pool, CX_THREADPOOL_SHUTDOWN_DRAIN, NULL);
+	assert(rv == 0);
+	// The pool is stopped, the fork fails and joining must not hang.
+	rv = cx_task_fork(&pool, &task);
+	assert(rv < 0);
+	rv = cx_task_join(&task);
+	assert(rv < 0);
+	assert(atomic_load(&counter) == 0);
+
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+}
+
+#define FORK_COUNT 30
+
+struct ForkContext {
+	struct CxThreadpool *pool;
+	struct CxTask busy;
+	atomic_bool busy_started;
+	atomic_bool release;
+	struct CxTask tasks[FORK_COUNT];
+};
+
+static void
+thread_func_busy(void *arg) {
+	struct ForkContext *ctx = arg;
+
+	atomic_store(&ctx->busy_started, true);
+	while (!atomic_load(&ctx->release)) {
+		usleep(1000);
+	}
+}
+
+static void
+thread_func_sleep(void *arg) {
+	(void)arg;
+	usleep(10000);
+}
+
+static void
+thread_func_fork_many(void *arg) {
+	struct ForkContext *ctx = arg;
+	int rv = 0;
+
+	// Keep the next worker busy, so that waking it up does not help.
+	cx_task_init(&ctx->busy, thread_func_busy, ctx);
+	rv = cx_task_fork(ctx->pool, &ctx->busy);
+	assert(rv == 0);
+	while (!atomic_load(&ctx->busy_started)) {
+		usleep(1000);
+	}
+	// Let the other workers park.
+	usleep(50000);
+
+	for (size_t i = 0; i < FORK_COUNT; i++) {
+		cx_task_init(&ctx->tasks[i], thread_func_sleep, NULL);
+		rv = cx_task_fork(ctx->pool, &ctx->tasks[i]);
+		assert(rv == 0);
+	}
+	for (size_t i = 0; i < FORK_COUNT; i++) {
+		rv = cx_task_join(&ctx->tasks[i]);
+		assert(rv == 0);
+	}
+	atomic_store(&ctx->release, true);
+	rv = cx_task_join(&ctx->busy);
+	assert(rv == 0);
+}
+
+static void
+test_fork_spreads(void) {
+	struct CxThreadpool pool = {0};
+	struct CxWorkerStats stats[4] = {0};
+	struct ForkContext ctx = {.pool = &pool};
+	int rv = 0;
+
+	rv = cx_threadpool_init(&pool, LENGTH(stats));
+	assert(rv == 0);
+
+	rv = cx_threadpool_schedule(&pool, thread_func_fork_many, &ctx);
+	assert(rv == 0);
+	rv = cx_threadpool_wait(&pool);
+	assert(rv == 0);
+
+	size_t worker_count = cx_threadpool_stats(&pool, stats, LENGTH(stats));
+	assert(worker_count == LENGTH(stats));
+	uint64_t executed = 0;
+	uint64_t max_executed = 0;
+	for (size_t i = 0; i < worker_count; i++) {
+		executed += stats[i].tasks_executed;
+		max_executed = CX_MAX(max_executed, stats[i].tasks_executed);
+	}
+	assert(executed == FORK_COUNT + 2);
+	// The parked workers must be woken up to take forked tasks instead of
+	// the forking worker running them all while it joins.
+	assert(max_executed <= FORK_COUNT / 2);
+
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+}
+
+static void
+thread_func_schedule_nested(void *arg) {
+	struct FibTask *fib = arg;
+	int rv = 0;
+
+	for (size_t i = 0; i < 2 && fib->n > 0; i++) {
+		struct FibTask *child = calloc(1, sizeof(struct FibTask));
+		assert(child != NULL);
+		child->pool = fib->pool;
+		child->n = fib->n - 1;
+		rv = cx_threadpool_schedule(
+				fib->pool, thread_func_schedule_nested, child);
+		assert(rv == 0);
+	}
+	free(fib);
+}
+
+static void
+test_schedule_from_worker(void) {
+	struct CxThreadpool pool = {0};
+	int rv = 0;
+
+	rv = cx_threadpool_init(&pool, 2);
+	assert(rv == 0);
+
+	struct FibTask *root = calloc(1, sizeof(struct FibTask));
+	assert(root != NULL);
+	root->pool = &pool;
+	root->n = 10;
+	rv = cx_threadpool_schedule(&pool, thread_func_schedule_nested, root);
+	assert(rv == 0);
+	rv = cx_threadpool_wait(&pool);
+	assert(rv == 0);
+
+	struct CxWorkerStats stats[2] = {0};
+	cx_threadpool_stats(&pool, stats, LENGTH(stats));
+	assert(stats[0].tasks_executed + stats[1].tasks_executed == 2047);
+
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+}
+
+static void *
+release_later(void *arg) {
+	struct BlockContext *ctx = arg;
+
+	// Give cx_threadpool_shutdown time to stop the workers first.
+	usleep(50000);
+	atomic_store(&ctx->release, true);
+	return NULL;
+}
+
+static void
+test_shutdown_drain(void) {
+	struct CxThreadpool pool = {0};
+	atomic_uint counter = 0;
+	int rv = cx_threadpool_init(&pool, 2);
+	assert(rv == 0);
+
+	for (int i = 0; i < 100; i++) {
+		rv = cx_threadpool_schedule(&pool, thread_func_inc_fast, &counter);
+		assert(rv == 0);
+	}
+	rv = cx_threadpool_shutdown(&pool, CX_THREADPOOL_SHUTDOWN_DRAIN, NULL);
+	assert(rv == 0);
+	assert(atomic_load(&counter) == 100);
+
+	// The workers are stopped.
+	rv = cx_threadpool_schedule(&pool, thread_func_inc_fast, &counter);
+	assert(rv < 0);
+
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+}
+
+struct ShutdownCounters {
+	atomic_uint executed;
+	atomic_uint cancelled;
+};
+
+static void
+thread_func_count_executed(void *arg) {
+	struct ShutdownCounters *counters = arg;
+
+	atomic_fetch_add(&counters->executed, 1);
+}
+
+static void
+thread_func_count_cancelled(void *arg) {
+	struct ShutdownCounters *counters = arg;
+
+	atomic_fetch_add(&counters->cancelled, 1);
+}
+
+static void
+run_shutdown(
+		enum CxThreadpoolShutdown mode, const struct timespec *deadline,
+		int expected_rv, unsigned int expected_cancelled) {
+	struct CxThreadpool pool = {0};
+	struct BlockContext block = {0};
+	struct CxTask tasks[10];
+	struct ShutdownCounters counters = {0};
+	pthread_t releaser;
+	int rv = 0;
+
+	rv = cx_threadpool_init(&pool, 1);
+	assert(rv == 0);
+
+	// The tasks stay queued behind the running blocker.
+	rv = cx_threadpool_schedule(&pool, thread_func_block, &block);
+	assert(rv == 0);
+	while (!atomic_load(&block.started)) {
+		usleep(1000);
+	}
+	for (size_t i = 0; i < LENGTH(tasks); i++) {
+		cx_task_init(&tasks[i], thread_func_count_executed, &counters);
+		cx_task_set_cancel(&tasks[i], thread_func_count_cancelled);
+		rv = cx_threadpool_schedule_task(&pool, &tasks[i]);
+		assert(rv == 0);
+	}
+
+	rv = pthread_create(&releaser, NULL, release_later, &block);
+	assert(rv == 0);
+	rv = cx_threadpool_shutdown(&pool, mode, deadline);
+	assert(rv == expected_rv);
+	pthread_join(releaser, NULL);
+
+	// The queued tasks were never run.
+	assert(atomic_load(&counters.executed) == 0);
+	assert(atomic_load(&counters.cancelled) == expected_cancelled);
+
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+}
+
+static void
+test_shutdown_cancel(void) {
+	run_shutdown(CX_THREADPOOL_SHUTDOWN_CANCEL, NULL, 0, 10);
+}
+
+static void
+test_shutdown_drain_timeout(void) {
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+
+	// The deadline passed already, the queued tasks are cancelled.
+	run_shutdown(
+			CX_THREADPOOL_SHUTDOWN_DRAIN, &deadline, -CX_ERR_TIMEOUT, 10);
+}
+
+static void
+test_shutdown_detach(void) {
+	run_shutdown(CX_THREADPOOL_SHUTDOWN_DETACH, NULL, 0, 0);
+}
+
+static void *
+future_func_count_executed(void *arg) {
+	thread_func_count_executed(arg);
+	return arg;
+}
+
+/**
+ * Drops queued tasks by cleaning up the pool, optionally after detaching
+ * them. Futures and timers queued by the library are always cancelled.
+ */
+static void
+run_dropped(bool detach) {
+	struct CxThreadpool pool = {0};
+	struct BlockContext block = {0};
+	struct CxTask tasks[10];
+	struct ShutdownCounters counters = {0};
+	pthread_t releaser;
+	int rv = 0;
+
+	rv = cx_threadpool_init(&pool, 1);
+	assert(rv == 0);
+
+	rv = cx_threadpool_schedule(&pool, thread_func_block, &block);
+	assert(rv == 0);
+	while (!atomic_load(&block.started)) {
+		usleep(1000);
+	}
+	for (size_t i = 0; i < LENGTH(tasks); i++) {
+		cx_task_init(&tasks[i], thread_func_count_executed, &counters);
+		cx_task_set_cancel(&tasks[i], thread_func_count_cancelled);
+		rv = cx_threadpool_schedule_task(&pool, &tasks[i]);
+		assert(rv == 0);
+	}
+	cx_future_t future =
+			cx_threadpool_submit(&pool, future_func_count_executed, &counters);
+	assert(future != NULL);
+	rv = cx_threadpool_schedule_after(
+			&pool, 0, thread_func_count_executed, &counters);
+	assert(rv == 0);
+	// Let the timer fire, its task is queued behind the blocker.
+	usleep(20000);
+
+	rv = pthread_create(&releaser, NULL, release_later, &block);
+	assert(rv == 0);
+	if (detach) {
+		rv = cx_threadpool_shutdown(
+				&pool, CX_THREADPOOL_SHUTDOWN_DETACH, NULL);
+		assert(rv == 0);
+	}
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+	pthread_join(releaser, NULL);
+
+	assert(atomic_load(&counters.executed) == 0);
+	assert(atomic_load(&counters.cancelled) == (detach ? 0 : LENGTH(tasks)));
+	// The future was cancelled and resolved with NULL.
+	assert(cx_future_wait(future) == NULL);
+	cx_future_destroy(future);
+}
+
+static void
+test_cleanup_cancels_queued(void) {
+	run_dropped(false);
+}
+
+static void
+test_detach_cancels_internal(void) {
+	run_dropped(true);
+}
+
 DECLARE_TESTS
 TEST(test_init_cleanup)
+TEST(test_init_dirty_storage)
 TEST(test_add_task)
 TEST(test_add_multiple_tasks)
 TEST(test_add_multiple_tasks_ackermann)
+TEST(test_work_stealing)
+TEST(test_schedule_task)
+TEST(test_schedule_batch)
+TEST(test_task_group)
+TEST(test_task_group_nested)
+TEST(test_pinned_workers)
+TEST(test_numa_schedule)
+TEST(test_idle_policy)
+TEST(test_priority)
+TEST(test_fifo_order)
+TEST(test_resize)
+TEST(test_blocking_spare_worker)
+TEST(test_stats)
+TEST(test_capacity_fail)
+TEST(test_capacity_fail_batch)
+TEST(test_capacity_caller_runs)
+TEST(test_capacity_block)
+TEST(test_fork_join)
+TEST(test_join_unforked)
+TEST(test_fork_spreads)
+TEST(test_schedule_from_worker)
+TEST(test_shutdown_drain)
+TEST(test_shutdown_cancel)
+TEST(test_shutdown_drain_timeout)
+TEST(test_shutdown_detach)
+TEST(test_cleanup_cancels_queued)
+TEST(test_detach_cancels_internal)
 END_TESTS
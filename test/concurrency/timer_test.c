@@ -0,0 +1,218 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <cextras/concurrency.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <testlib.h>
+#include <time.h>
+#include <unistd.h>
+
+struct Fired {
+	struct CxSemaphore semaphore;
+	atomic_uint count;
+	uint64_t time_ns;
+};
+
+static uint64_t
+now_ns(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+static void
+fire(void *arg) {
+	struct Fired *fired = arg;
+
+	fired->time_ns = now_ns();
+	atomic_fetch_add(&fired->count, 1);
+	cx_semaphore_post(&fired->semaphore);
+}
+
+static void
+test_schedule_after(void) {
+	struct CxThreadpool pool = {0};
+	struct Fired fired = {0};
+	int rv = 0;
+
+	rv = cx_threadpool_init(&pool, 2);
+	assert(rv == 0);
+	rv = cx_semaphore_init(&fired.semaphore, 0);
+	assert(rv == 0);
+
+	uint64_t start = now_ns();
+	rv = cx_threadpool_schedule_after(&pool, 20000000, fire, &fired);
+	assert(rv == 0);
+	rv = cx_semaphore_wait(&fired.semaphore);
+	assert(rv == 0);
+	assert(fired.time_ns - start >= 20000000);
+	assert(atomic_load(&fired.count) == 1);
+
+	rv = cx_threadpool_wait(&pool);
+	assert(rv == 0);
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+	cx_semaphore_destroy(&fired.semaphore);
+}
+
+static void
+test_order(void) {
+	struct CxThreadpool pool = {0};
+	struct Fired fired[3] = {0};
+	int rv = 0;
+
+	rv = cx_threadpool_init(&pool, 1);
+	assert(rv == 0);
+
+	// Scheduled in reverse order of their deadlines.
+	for (size_t i = 0; i < 3; i++) {
+		rv = cx_semaphore_init(&fired[i].semaphore, 0);
+		assert(rv == 0);
+		rv = cx_threadpool_schedule_after(
+				&pool, (3 - i) * 10000000, fire, &fired[i]);
+		assert(rv == 0);
+	}
+	for (size_t i = 0; i < 3; i++) {
+		rv = cx_semaphore_wait(&fired[i].semaphore);
+		assert(rv == 0);
+	}
+	assert(fired[2].time_ns <= fired[1].time_ns);
+	assert(fired[1].time_ns <= fired[0].time_ns);
+
+	rv = cx_threadpool_wait(&pool);
+	assert(rv == 0);
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+	for (size_t i = 0; i < 3; i++) {
+		cx_semaphore_destroy(&fired[i].semaphore);
+	}
+}
+
+static void
+test_periodic(void) {
+	struct CxThreadpool pool = {0};
+	struct CxTimer timer = {0};
+	struct Fired fired = {0};
+	int rv = 0;
+
+	rv = cx_threadpool_init(&pool, 2);
+	assert(rv == 0);
+	rv = cx_semaphore_init(&fired.semaphore, 0);
+	assert(rv == 0);
+
+	rv = cx_timer_start_periodic(&timer, &pool, 1000000, fire, &fired);
+	assert(rv == 0);
+	for (size_t i = 0; i < 5; i++) {
+		rv = cx_semaphore_wait(&fired.semaphore);
+		assert(rv == 0);
+	}
+	rv = cx_timer_cancel(&timer);
+	assert(rv == 0);
+
+	// No more runs after cancelling.
+	unsigned int count = atomic_load(&fired.count);
+	assert(count >= 5);
+	usleep(10000);
+	assert(atomic_load(&fired.count) == count);
+
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+	cx_semaphore_destroy(&fired.semaphore);
+}
+
+static void
+test_cleanup_pending(void) {
+	struct CxThreadpool pool = {0};
+	struct Fired fired = {0};
+	int rv = 0;
+
+	rv = cx_threadpool_init(&pool, 1);
+	assert(rv == 0);
+
+	// Timers that did not fire are released by the cleanup.
+	rv = cx_threadpool_schedule_after(&pool, 10000000000, fire, &fired);
+	assert(rv == 0);
+
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+	assert(atomic_load(&fired.count) == 0);
+}
+
+static void
+test_cancel_unstarted(void) {
+	struct CxTimer timer = {0};
+
+	assert(cx_timer_cancel(&timer) == 0);
+}
+
+static void
+test_schedule_after_shutdown(void) {
+	struct CxThreadpool pool = {0};
+	struct CxTimer timer = {0};
+	struct Fired fired = {0};
+	int rv = 0;
+
+	rv = cx_threadpool_init(&pool, 1);
+	assert(rv == 0);
+	rv = cx_threadpool_shutdown(&pool, CX_THREADPOOL_SHUTDOWN_DRAIN, NULL);
+	assert(rv == 0);
+
+	// The timer thread is stopped, the timers would never fire.
+	rv = cx_threadpool_schedule_after(&pool, 0, fire, &fired);
+	assert(rv < 0);
+	rv = cx_timer_start_periodic(&timer, &pool, 1000000, fire, &fired);
+	assert(rv < 0);
+
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+}
+
+static void
+block(void *arg) {
+	atomic_bool *started = arg;
+
+	atomic_store(started, true);
+	usleep(100000);
+}
+
+static void
+test_cancel_detached(void) {
+	struct CxThreadpool pool = {0};
+	struct CxTimer timer = {0};
+	struct Fired fired = {0};
+	atomic_bool started = false;
+	int rv = 0;
+
+	rv = cx_threadpool_init(&pool, 1);
+	assert(rv == 0);
+	rv = cx_threadpool_schedule(&pool, block, &started);
+	assert(rv == 0);
+	while (!atomic_load(&started)) {
+		usleep(1000);
+	}
+
+	// The timer fires, but its task is queued behind the blocker.
+	rv = cx_timer_start_periodic(&timer, &pool, 1000000, fire, &fired);
+	assert(rv == 0);
+	usleep(20000);
+
+	rv = cx_threadpool_shutdown(&pool, CX_THREADPOOL_SHUTDOWN_DETACH, NULL);
+	assert(rv == 0);
+	rv = cx_timer_cancel(&timer);
+	assert(rv == 0);
+	assert(atomic_load(&fired.count) == 0);
+
+	rv = cx_threadpool_cleanup(&pool);
+	assert(rv == 0);
+}
+
+DECLARE_TESTS
+TEST(test_schedule_after)
+TEST(test_order)
+TEST(test_periodic)
+TEST(test_cleanup_pending)
+TEST(test_cancel_unstarted)
+TEST(test_schedule_after_shutdown)
+TEST(test_cancel_detached)
+END_TESTS
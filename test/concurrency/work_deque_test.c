@@ -0,0 +1,137 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <cextras/concurrency.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <testlib.h>
+
+#define ITEM_COUNT 10000
+#define THIEF_COUNT 3
+
+static void
+test_push_pop(void) {
+	int rv = 0;
+	int items[3] = {0};
+	struct CxWorkDeque deque = {0};
+
+	rv = cx_work_deque_init(&deque);
+	assert(rv == 0);
+
+	assert(cx_work_deque_pop(&deque) == NULL);
+
+	for (size_t i = 0; i < 3; i++) {
+		rv = cx_work_deque_push(&deque, &items[i]);
+		assert(rv == 0);
+	}
+	assert(cx_work_deque_size(&deque) == 3);
+
+	// The owner works LIFO, thieves work FIFO.
+	assert(cx_work_deque_pop(&deque) == &items[2]);
+	assert(cx_work_deque_steal(&deque) == &items[0]);
+	assert(cx_work_deque_pop(&deque) == &items[1]);
+	assert(cx_work_deque_pop(&deque) == NULL);
+	assert(cx_work_deque_steal(&deque) == NULL);
+
+	rv = cx_work_deque_cleanup(&deque);
+	assert(rv == 0);
+}
+
+static void
+test_grow(void) {
+	int rv = 0;
+	static int items[ITEM_COUNT] = {0};
+	struct CxWorkDeque deque = {0};
+
+	rv = cx_work_deque_init(&deque);
+	assert(rv == 0);
+
+	for (size_t i = 0; i < ITEM_COUNT; i++) {
+		rv = cx_work_deque_push(&deque, &items[i]);
+		assert(rv == 0);
+	}
+	assert(cx_work_deque_size(&deque) == ITEM_COUNT);
+	for (size_t i = ITEM_COUNT; i > 0; i--) {
+		assert(cx_work_deque_pop(&deque) == &items[i - 1]);
+	}
+	assert(cx_work_deque_pop(&deque) == NULL);
+
+	rv = cx_work_deque_cleanup(&deque);
+	assert(rv == 0);
+}
+
+struct StealContext {
+	struct CxWorkDeque deque;
+	atomic_bool done;
+	atomic_size_t taken[ITEM_COUNT];
+};
+
+static void *
+thief(void *arg) {
+	struct StealContext *ctx = arg;
+	for (;;) {
+		bool done = atomic_load(&ctx->done);
+		size_t *item = cx_work_deque_steal(&ctx->deque);
+		if (item != NULL) {
+			atomic_fetch_add(&ctx->taken[*item], 1);
+		} else if (done && cx_work_deque_size(&ctx->deque) == 0) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+static void
+test_concurrent_steal(void) {
+	int rv = 0;
+	static size_t items[ITEM_COUNT] = {0};
+	static struct StealContext ctx = {0};
+	pthread_t thieves[THIEF_COUNT];
+
+	rv = cx_work_deque_init(&ctx.deque);
+	assert(rv == 0);
+	atomic_init(&ctx.done, false);
+	for (size_t i = 0; i < ITEM_COUNT; i++) {
+		items[i] = i;
+		atomic_init(&ctx.taken[i], 0);
+	}
+
+	for (size_t i = 0; i < THIEF_COUNT; i++) {
+		rv = pthread_create(&thieves[i], NULL, thief, &ctx);
+		assert(rv == 0);
+	}
+
+	for (size_t i = 0; i < ITEM_COUNT; i++) {
+		rv = cx_work_deque_push(&ctx.deque, &items[i]);
+		assert(rv == 0);
+		if (i % 3 == 0) {
+			size_t *item = cx_work_deque_pop(&ctx.deque);
+			if (item != NULL) {
+				atomic_fetch_add(&ctx.taken[*item], 1);
+			}
+		}
+	}
+	size_t *item;
+	while ((item = cx_work_deque_pop(&ctx.deque)) != NULL) {
+		atomic_fetch_add(&ctx.taken[*item], 1);
+	}
+	atomic_store(&ctx.done, true);
+
+	for (size_t i = 0; i < THIEF_COUNT; i++) {
+		pthread_join(thieves[i], NULL);
+	}
+
+	// Every item must be taken exactly once.
+	for (size_t i = 0; i < ITEM_COUNT; i++) {
+		assert(atomic_load(&ctx.taken[i]) == 1);
+	}
+
+	rv = cx_work_deque_cleanup(&ctx.deque);
+	assert(rv == 0);
+}
+
+DECLARE_TESTS
+TEST(test_push_pop)
+TEST(test_grow)
+TEST(test_concurrent_steal)
+END_TESTS
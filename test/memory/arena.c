@@ -0,0 +1,113 @@
+#include <assert.h>
+#include <cextras/memory.h>
+#include <stdint.h>
+#include <string.h>
+#include <testlib.h>
+
+static void
+test_alloc(void) {
+	struct CxArena arena = {0};
+	cx_arena_init(&arena, 0);
+
+	char *first = cx_arena_alloc(&arena, 3, 1);
+	assert(first != NULL);
+	memcpy(first, "ab", 3);
+
+	uint64_t *second = cx_arena_alloc(&arena, sizeof(uint64_t), 8);
+	assert(second != NULL);
+	assert((uintptr_t)second % 8 == 0);
+	*second = 42;
+
+	void *aligned = cx_arena_alloc(&arena, 16, 256);
+	assert(aligned != NULL);
+	assert((uintptr_t)aligned % 256 == 0);
+
+	assert(strcmp(first, "ab") == 0);
+	assert(*second == 42);
+
+	cx_arena_cleanup(&arena);
+}
+
+static void
+test_large_alloc(void) {
+	struct CxArena arena = {0};
+	cx_arena_init(&arena, 64);
+
+	char *small = cx_arena_alloc(&arena, 16, 1);
+	assert(small != NULL);
+
+	// Allocations larger than a chunk get a chunk of their own.
+	char *large = cx_arena_alloc(&arena, 1000, 64);
+	assert(large != NULL);
+	assert((uintptr_t)large % 64 == 0);
+	memset(large, 0xff, 1000);
+
+	assert(cx_arena_alloc(&arena, SIZE_MAX, 1) == NULL);
+
+	cx_arena_cleanup(&arena);
+}
+
+static void
+test_reset_to(void) {
+	struct CxArena arena = {0};
+	cx_arena_init(&arena, 128);
+
+	char *before = cx_arena_alloc(&arena, 32, 1);
+	assert(before != NULL);
+	struct CxArenaMark mark = cx_arena_mark(&arena);
+
+	char *after = cx_arena_alloc(&arena, 32, 1);
+	assert(after != NULL);
+	for (int i = 0; i < 100; i++) {
+		assert(cx_arena_alloc(&arena, 32, 1) != NULL);
+	}
+
+	// Memory after the mark is handed out again.
+	cx_arena_reset_to(&arena, &mark);
+	assert(cx_arena_alloc(&arena, 32, 1) == after);
+
+	cx_arena_cleanup(&arena);
+}
+
+static void
+test_reset_to_empty(void) {
+	struct CxArena arena = {0};
+	cx_arena_init(&arena, 0);
+
+	struct CxArenaMark mark = cx_arena_mark(&arena);
+	for (int i = 0; i < 100; i++) {
+		assert(cx_arena_alloc(&arena, 100, 8) != NULL);
+	}
+	cx_arena_reset_to(&arena, &mark);
+
+	assert(cx_arena_alloc(&arena, 100, 8) != NULL);
+	cx_arena_cleanup(&arena);
+}
+
+static void
+test_reset(void) {
+	struct CxArena arena = {0};
+	cx_arena_init(&arena, 128);
+
+	char *first = cx_arena_alloc(&arena, 32, 1);
+	assert(first != NULL);
+	for (int i = 0; i < 100; i++) {
+		assert(cx_arena_alloc(&arena, 32, 1) != NULL);
+	}
+
+	// The first chunk is kept.
+	cx_arena_reset(&arena);
+	assert(cx_arena_alloc(&arena, 32, 1) == first);
+
+	cx_arena_reset(&arena);
+	cx_arena_cleanup(&arena);
+	cx_arena_reset(&arena);
+}
+
+DECLARE_TESTS
+TEST(test_alloc)
+TEST(test_large_alloc)
+TEST(test_reset_to)
+TEST(test_reset_to_empty)
+TEST(test_reset)
+END_TESTS
@@ -0,0 +1,151 @@
+#include <assert.h>
+#include <cextras/memory.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <testlib.h>
+
+#define LENGTH(x) (sizeof(x) / sizeof(x[0]))
+
+struct MyStruct {
+	uintptr_t owner;
+	char dummy[120];
+};
+
+static void
+test_simple(void) {
+	struct CxConcurrentPool pool = {0};
+	int rv = cx_concurrent_pool_init(&pool, sizeof(struct MyStruct));
+	assert(rv == 0);
+
+	struct MyStruct *element = cx_concurrent_pool_get(&pool);
+	assert(element != NULL);
+
+	cx_concurrent_pool_recycle(&pool, element);
+
+	struct MyStruct *element2 = cx_concurrent_pool_get(&pool);
+	assert(element2 == element);
+
+	cx_concurrent_pool_recycle(&pool, element2);
+	cx_concurrent_pool_cleanup(&pool);
+}
+
+static void
+test_magazine_exchange(void) {
+	struct CxConcurrentPool pool = {0};
+	struct MyStruct *elements[100];
+	int rv = cx_concurrent_pool_init2(&pool, 4, sizeof(struct MyStruct));
+	assert(rv == 0);
+
+	// Takes more elements than a chunk holds and returns them all, so
+	// magazines go back and forth with the depot.
+	for (size_t i = 0; i < LENGTH(elements); i++) {
+		elements[i] = cx_concurrent_pool_get(&pool);
+		assert(elements[i] != NULL);
+		elements[i]->owner = i;
+	}
+	for (size_t i = 0; i < LENGTH(elements); i++) {
+		assert(elements[i]->owner == i);
+		cx_concurrent_pool_recycle(&pool, elements[i]);
+	}
+	for (size_t i = 0; i < LENGTH(elements); i++) {
+		elements[i] = cx_concurrent_pool_get(&pool);
+		assert(elements[i] != NULL);
+		for (size_t j = 0; j < i; j++) {
+			assert(elements[i] != elements[j]);
+		}
+	}
+	for (size_t i = 0; i < LENGTH(elements); i++) {
+		cx_concurrent_pool_recycle(&pool, elements[i]);
+	}
+
+	cx_concurrent_pool_cleanup(&pool);
+}
+
+#define THREAD_COUNT 4
+#define ROUNDS 2000
+#define BATCH 32
+
+struct Exchange {
+	struct CxConcurrentPool *pool;
+	pthread_mutex_t mutex;
+	struct MyStruct *slots[THREAD_COUNT][BATCH];
+};
+
+struct Worker {
+	struct Exchange *exchange;
+	uintptr_t index;
+};
+
+static void *
+worker(void *arg) {
+	struct Worker *self = arg;
+	struct Exchange *exchange = self->exchange;
+
+	for (size_t round = 0; round < ROUNDS; round++) {
+		struct MyStruct *batch[BATCH];
+		for (size_t i = 0; i < BATCH; i++) {
+			batch[i] = cx_concurrent_pool_get(exchange->pool);
+			assert(batch[i] != NULL);
+			batch[i]->owner = self->index;
+		}
+		for (size_t i = 0; i < BATCH; i++) {
+			assert(batch[i]->owner == self->index);
+		}
+
+		// Swap the batch with the one another thread left behind, so
+		// elements are freed by other threads than the ones that took
+		// them.
+		pthread_mutex_lock(&exchange->mutex);
+		size_t slot = (self->index + round) % THREAD_COUNT;
+		for (size_t i = 0; i < BATCH; i++) {
+			struct MyStruct *other = exchange->slots[slot][i];
+			exchange->slots[slot][i] = batch[i];
+			batch[i] = other;
+		}
+		pthread_mutex_unlock(&exchange->mutex);
+
+		for (size_t i = 0; i < BATCH; i++) {
+			cx_concurrent_pool_recycle(exchange->pool, batch[i]);
+		}
+	}
+	return NULL;
+}
+
+static void
+test_cross_thread(void) {
+	struct CxConcurrentPool pool = {0};
+	struct Exchange exchange = {.pool = &pool};
+	struct Worker workers[THREAD_COUNT];
+	pthread_t threads[THREAD_COUNT];
+	int rv = cx_concurrent_pool_init2(&pool, 16, sizeof(struct MyStruct));
+	assert(rv == 0);
+	pthread_mutex_init(&exchange.mutex, NULL);
+
+	for (size_t i = 0; i < THREAD_COUNT; i++) {
+		workers[i].exchange = &exchange;
+		workers[i].index = i;
+		rv = pthread_create(&threads[i], NULL, worker, &workers[i]);
+		assert(rv == 0);
+	}
+	for (size_t i = 0; i < THREAD_COUNT; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	// At most 2 * THREAD_COUNT * BATCH elements are in use at once, which
+	// fits in 4 chunks of 4 magazines. Leave room for the per-thread
+	// magazines, but threads racing for the depot must not grow the pool.
+	assert(pool.chunk_count <= 8);
+	for (size_t i = 0; i < THREAD_COUNT; i++) {
+		for (size_t j = 0; j < BATCH; j++) {
+			cx_concurrent_pool_recycle(&pool, exchange.slots[i][j]);
+		}
+	}
+
+	pthread_mutex_destroy(&exchange.mutex);
+	cx_concurrent_pool_cleanup(&pool);
+}
+
+DECLARE_TESTS
+TEST(test_simple)
+TEST(test_magazine_exchange)
+TEST(test_cross_thread)
+END_TESTS
@@ -4,9 +4,12 @@
 #include <assert.h>
 #include <cextras/memory.h>
 #include <pthread.h>
+#include <string.h>
 #include <testlib.h>
 #include <unistd.h>
 
+#define LENGTH(x) (sizeof(x) / sizeof(x[0]))
+
 struct MyStruct {
 	char dummy[256];
 };
@@ -31,6 +34,171 @@ test_simple(void) {
 	cx_prealloc_pool_cleanup(&pool);
 }
 
+static void
+test_trim(void) {
+	struct CxPreallocPool pool = {0};
+	struct MyStruct *elements[100];
+
+	cx_prealloc_pool_init(&pool, sizeof(struct MyStruct));
+
+	for (size_t i = 0; i < LENGTH(elements); i++) {
+		elements[i] = cx_prealloc_pool_get(&pool);
+		assert(elements[i] != NULL);
+		memset(elements[i], 0xff, sizeof(struct MyStruct));
+	}
+	assert(pool.chunk_count > 2);
+
+	// Releasing all elements frees all chunks but one empty chunk.
+	for (size_t i = 0; i < LENGTH(elements); i++) {
+		cx_prealloc_pool_recycle(&pool, elements[i]);
+	}
+	assert(pool.chunk_count == 1);
+
+	// The empty chunk is reused.
+	struct MyStruct *element = cx_prealloc_pool_get(&pool);
+	assert(element != NULL);
+	assert(pool.chunk_count == 1);
+	assert(cx_prealloc_pool_trim(&pool) == 0);
+
+	cx_prealloc_pool_recycle(&pool, element);
+	assert(cx_prealloc_pool_trim(&pool) == 1);
+	assert(pool.chunk_count == 0);
+
+	// The pool grows again after trimming.
+	element = cx_prealloc_pool_get(&pool);
+	assert(element != NULL);
+	cx_prealloc_pool_recycle(&pool, element);
+
+	cx_prealloc_pool_cleanup(&pool);
+}
+
+static void
+test_partial_chunks_first(void) {
+	struct CxPreallocPool pool = {0};
+	struct MyStruct *elements[100];
+
+	cx_prealloc_pool_init(&pool, sizeof(struct MyStruct));
+
+	for (size_t i = 0; i < LENGTH(elements); i++) {
+		elements[i] = cx_prealloc_pool_get(&pool);
+		assert(elements[i] != NULL);
+	}
+	size_t chunk_count = pool.chunk_count;
+
+	// Free every other element, no chunk becomes empty.
+	for (size_t i = 0; i < LENGTH(elements); i += 2) {
+		cx_prealloc_pool_recycle(&pool, elements[i]);
+	}
+	assert(pool.chunk_count == chunk_count);
+
+	// The holes are filled before a new chunk is allocated.
+	for (size_t i = 0; i < LENGTH(elements); i += 2) {
+		elements[i] = cx_prealloc_pool_get(&pool);
+		assert(elements[i] != NULL);
+	}
+	assert(pool.chunk_count == chunk_count);
+
+	for (size_t i = 0; i < LENGTH(elements); i++) {
+		cx_prealloc_pool_recycle(&pool, elements[i]);
+	}
+	cx_prealloc_pool_cleanup(&pool);
+}
+
+static void
+assert_zeroed(const struct MyStruct *element) {
+	for (size_t i = 0; i < sizeof(element->dummy); i++) {
+		assert(element->dummy[i] == 0);
+	}
+}
+
+static void
+run_options(const struct CxPreallocPoolOptions *options) {
+	struct CxPreallocPool pool = {0};
+	struct MyStruct *elements[100];
+
+	cx_prealloc_pool_init3(&pool, options);
+
+	for (size_t i = 0; i < LENGTH(elements); i++) {
+		elements[i] = cx_prealloc_pool_get(&pool);
+		assert(elements[i] != NULL);
+		assert_zeroed(elements[i]);
+		memset(elements[i], 0xff, sizeof(struct MyStruct));
+	}
+	for (size_t i = 0; i < LENGTH(elements); i++) {
+		cx_prealloc_pool_recycle(&pool, elements[i]);
+	}
+	cx_prealloc_pool_cleanup(&pool);
+}
+
+static void
+test_max_chunk_size(void) {
+	struct CxPreallocPool pool = {0};
+	struct CxPreallocPoolOptions options = {
+			.element_size = sizeof(struct MyStruct),
+			.element_count = 1024,
+			.max_chunk_size = 16384,
+	};
+
+	cx_prealloc_pool_init3(&pool, &options);
+	assert(pool.chunk_size == 16384);
+	cx_prealloc_pool_cleanup(&pool);
+
+	// A chunk always holds at least one element.
+	options.element_size = 8192;
+	options.max_chunk_size = 1;
+	cx_prealloc_pool_init3(&pool, &options);
+	assert(pool.chunk_size > 8192);
+	void *element = cx_prealloc_pool_get(&pool);
+	assert(element != NULL);
+	cx_prealloc_pool_recycle(&pool, element);
+	cx_prealloc_pool_cleanup(&pool);
+
+	options.element_size = sizeof(struct MyStruct);
+	run_options(&options);
+}
+
+static void
+test_lazy_zero(void) {
+	struct CxPreallocPoolOptions options = {
+			.element_size = sizeof(struct MyStruct),
+			.lazy_zero = true,
+	};
+	run_options(&options);
+}
+
+static void
+test_mmap(void) {
+	struct CxPreallocPoolOptions options = {
+			.element_size = sizeof(struct MyStruct),
+			.use_mmap = true,
+	};
+	run_options(&options);
+
+	options.lazy_zero = true;
+	run_options(&options);
+}
+
+static void
+test_huge_pages(void) {
+	struct CxPreallocPool pool = {0};
+	struct CxPreallocPoolOptions options = {
+			.element_size = sizeof(struct MyStruct),
+			.huge_pages = true,
+	};
+
+	cx_prealloc_pool_init3(&pool, &options);
+	assert(pool.chunk_size >= 2 * 1024 * 1024);
+	cx_prealloc_pool_cleanup(&pool);
+
+	run_options(&options);
+}
+
 DECLARE_TESTS
 TEST(test_simple)
+TEST(test_trim)
+TEST(test_partial_chunks_first)
+TEST(test_max_chunk_size)
+TEST(test_lazy_zero)
+TEST(test_mmap)
+TEST(test_huge_pages)
 END_TESTS
@@ -0,0 +1,91 @@
+#include <assert.h>
+#include <cextras/memory.h>
+#include <stdint.h>
+#include <string.h>
+#include <testlib.h>
+
+static void
+test_alloc(void) {
+	struct CxSlab slab = {0};
+	cx_slab_init(&slab);
+
+	for (size_t size = 0; size <= 5000; size += 7) {
+		char *memory = cx_slab_alloc(&slab, size);
+		assert(memory != NULL);
+		assert((uintptr_t)memory % 16 == 0);
+		memset(memory, 0xff, size);
+		cx_slab_free(&slab, memory, size);
+	}
+
+	cx_slab_cleanup(&slab);
+}
+
+static void
+test_stats(void) {
+	struct CxSlab slab = {0};
+	struct CxSlabStats stats = {0};
+	void *small[10];
+	cx_slab_init(&slab);
+
+	for (size_t i = 0; i < 10; i++) {
+		small[i] = cx_slab_alloc(&slab, 20);
+		assert(small[i] != NULL);
+	}
+	void *large = cx_slab_alloc(&slab, 4096);
+	assert(large != NULL);
+
+	assert(cx_slab_stats(&slab, 1, &stats) == 0);
+	assert(stats.element_size == 32);
+	assert(stats.live == 10);
+	assert(stats.allocations == 10);
+	assert(stats.chunk_count > 0);
+
+	assert(cx_slab_stats(&slab, CX_SLAB_CLASS_COUNT - 1, &stats) == 0);
+	assert(stats.element_size == 4096);
+	assert(stats.live == 1);
+
+	assert(cx_slab_stats(&slab, 0, &stats) == 0);
+	assert(stats.element_size == 16);
+	assert(stats.live == 0);
+	assert(stats.chunk_count == 0);
+
+	assert(cx_slab_stats(&slab, CX_SLAB_CLASS_COUNT, &stats) == -1);
+
+	for (size_t i = 0; i < 10; i++) {
+		cx_slab_free(&slab, small[i], 20);
+	}
+	cx_slab_free(&slab, large, 4096);
+
+	assert(cx_slab_stats(&slab, 1, &stats) == 0);
+	assert(stats.live == 0);
+	assert(stats.allocations == 10);
+
+	cx_slab_cleanup(&slab);
+}
+
+static void
+test_oversized(void) {
+	struct CxSlab slab = {0};
+	struct CxSlabStats stats = {0};
+	cx_slab_init(&slab);
+
+	char *memory = cx_slab_alloc(&slab, 100000);
+	assert(memory != NULL);
+	memset(memory, 0xff, 100000);
+
+	// Oversized allocations bypass the size classes.
+	for (size_t i = 0; i < CX_SLAB_CLASS_COUNT; i++) {
+		assert(cx_slab_stats(&slab, i, &stats) == 0);
+		assert(stats.allocations == 0);
+	}
+
+	cx_slab_free(&slab, memory, 100000);
+	cx_slab_free(&slab, NULL, 10);
+	cx_slab_cleanup(&slab);
+}
+
+DECLARE_TESTS
+TEST(test_alloc)
+TEST(test_stats)
+TEST(test_oversized)
+END_TESTS